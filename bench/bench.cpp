@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "corpus.h"
+#include "decoder.h"
+#include "printer.h"
+#include "io.h"
+#include "parallel.h"
+#include "boundaries.h"
+#include "stats.h"
+#include "simulator.h"
+#include "blocks.h"
+#include "snapshot.h"
+#include "stream.h"
+#include "incremental.h"
+#include "lanes.h"
+
+using namespace std;
+
+struct options {
+    size_t size = 16 << 20;
+    int repeat = 10;
+    u64 seed = 1;
+    bool json = false;
+    // Threads of the parallel disassembly, one per core by default
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Corpus is written to this file, it's also used by the end-to-end run
+    const char* corpus_path = "vm8086_bench_corpus.bin";
+};
+
+struct result {
+    const char* name;
+    size_t bytes;
+    size_t instructions;
+    // Seconds of every run, sorted
+    vector<double> seconds;
+
+    // Nearest-rank percentile
+    double percentile(const double p) const {
+        const size_t rank = static_cast<size_t>(p / 100.0 * static_cast<double>(seconds.size() - 1) + 0.5);
+        return seconds[rank];
+    }
+};
+
+bool parse_options(const int argc, char** argv, options* opts) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--json") == 0) opts->json = true;
+        else if (strcmp(arg, "--size") == 0 && has_value) opts->size = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (strcmp(arg, "--repeat") == 0 && has_value) opts->repeat = max(1, atoi(argv[++i]));
+        else if (strcmp(arg, "--seed") == 0 && has_value) opts->seed = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(arg, "--corpus") == 0 && has_value) opts->corpus_path = argv[++i];
+        else if (strcmp(arg, "--threads") == 0 && has_value) opts->threads = max(1ul, strtoul(argv[++i], nullptr, 10));
+        else return false;
+    }
+    return true;
+}
+
+template <typename F>
+result measure(const char* name, const options& opts, const size_t bytes, F&& run) {
+    result r { .name = name, .bytes = bytes };
+    // Warm up caches and the page cache before measuring
+    r.instructions = run();
+
+    for (int i = 0; i < opts.repeat; i++) {
+        const auto start = chrono::steady_clock::now();
+        r.instructions = run();
+        const auto end = chrono::steady_clock::now();
+        r.seconds.push_back(chrono::duration<double>(end - start).count());
+    }
+    sort(r.seconds.begin(), r.seconds.end());
+    return r;
+}
+
+void print_text(const result& r) {
+    const double mb = static_cast<double>(r.bytes) / (1 << 20);
+    const double median = r.percentile(50);
+    cout << r.name << ":\n"
+         << "    time p50/p90/min/max: " << median * 1e3 << " / " << r.percentile(90) * 1e3 << " / "
+         << r.seconds.front() * 1e3 << " / " << r.seconds.back() * 1e3 << " ms\n"
+         << "    throughput p50: " << mb / median << " MB/s, "
+         << static_cast<double>(r.instructions) / median / 1e6 << " M instructions/s\n";
+}
+
+void print_json(const result& r, const bool last) {
+    const double mb = static_cast<double>(r.bytes) / (1 << 20);
+    cout << "    {\"name\": \"" << r.name << "\", \"bytes\": " << r.bytes << ", \"instructions\": " << r.instructions
+         << ", \"runs\": " << r.seconds.size()
+         << ", \"seconds\": {\"p50\": " << r.percentile(50) << ", \"p90\": " << r.percentile(90)
+         << ", \"p99\": " << r.percentile(99) << ", \"min\": " << r.seconds.front()
+         << ", \"max\": " << r.seconds.back() << "}"
+         << ", \"mb_per_second\": " << mb / r.percentile(50)
+         << ", \"instructions_per_second\": " << static_cast<double>(r.instructions) / r.percentile(50) << "}"
+         << (last ? "\n" : ",\n");
+}
+
+bool write_corpus(const char* path, const vector<u8>& data) {
+    const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t bytes = ::write(fd, data.data() + written, data.size() - written);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            ::close(fd);
+            return false;
+        }
+        written += bytes;
+    }
+    return ::close(fd) == 0;
+}
+
+int main(int argc, char** argv) {
+    options opts{};
+    if (!parse_options(argc, argv, &opts)) {
+        cerr << "Usage: vm8086_bench [--size <MB>] [--repeat <runs>] [--seed <seed>] [--corpus <file>] [--threads <count>] [--json]\n";
+        return 1;
+    }
+
+    const vector<u8> program = corpus::generate(opts.size, opts.seed);
+    if (!write_corpus(opts.corpus_path, program)) {
+        cerr << "Error: failed to write the corpus: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    const int null_fd = ::open("/dev/null", O_WRONLY);
+    vector<decoder::Instruction> instructions{};
+    vector<result> results{};
+
+    // Decoding into the flat array of instructions without any output
+    results.push_back(measure("decode", opts, program.size(), [&]() {
+        instructions.clear();
+        size_t pos;
+        decoder::decode_program(program, instructions, &pos);
+        return instructions.size();
+    }));
+
+    // Decoding, label resolution and formatting, output is discarded
+    results.push_back(measure("decode_format", opts, program.size(), [&]() {
+        instructions.clear();
+        size_t pos;
+        decoder::decode_program(program, instructions, &pos);
+        const decoder::label_table labels = decoder::find_labels(instructions);
+        printer::writer out{null_fd};
+        printer::print_program(out, instructions, labels);
+        return instructions.size();
+    }));
+
+    // Decoding, label resolution and formatting split between threads
+    results.push_back(measure("decode_format_parallel", opts, program.size(), [&]() {
+        printer::writer out{null_fd};
+        size_t pos;
+        parallel::disassemble(program, opts.threads, out, &pos);
+        // Instruction count is the same as for the sequential run
+        return instructions.size();
+    }));
+
+    // Instruction boundaries without decoding, with the fastest and the scalar length pre-pass
+    const boundaries::Implementation best = boundaries::best_implementation();
+    results.push_back(measure(best == boundaries::Implementation::AVX2 ? "boundaries_avx2" : "boundaries_scalar",
+                              opts, program.size(), [&]() {
+        return boundaries::find(program, best).count;
+    }));
+    if (best != boundaries::Implementation::SCALAR) {
+        results.push_back(measure("boundaries_scalar", opts, program.size(), [&]() {
+            return boundaries::find(program, boundaries::Implementation::SCALAR).count;
+        }));
+    }
+    results.push_back(measure("count", opts, program.size(), [&]() {
+        size_t end;
+        return boundaries::count(program, best, &end);
+    }));
+    results.push_back(measure("stats", opts, program.size(), [&]() {
+        return stats::collect(program, best).instructions;
+    }));
+
+    // Short routine run for many vectors of registers, the machine is either reset and reloaded
+    // before every run or restored from a snapshot
+    const vector<u8> routine = {
+            0xB9, 0x40, 0x00, // mov cx, 64
+            0x89, 0x07,       // mov [bx], ax
+            0x83, 0xC3, 0x02, // add bx, 2
+            0xE2, 0xF9,       // loop $-5
+    };
+    const size_t vectors = 1000;
+    // Every run writes 128 bytes from bx, past the routine and without wrapping around the segment
+    const auto sweep_bx = [](const size_t i) {
+        return static_cast<u16>(0x1000 + i * 128 % 0xE000);
+    };
+    simulator::machine m{};
+    blocks::cache block_cache{};
+    results.push_back(measure("sweep_reload", opts, routine.size() * vectors, [&]() {
+        u64 executed = 0;
+        for (size_t i = 0; i < vectors; i++) {
+            memset(m.memory.get(), 0, MEMORY_SIZE);
+            m.load(routine);
+            m.regs = simulator::register_file{};
+            m.regs.set_word(static_cast<u8>(simulator::Register::BX), sweep_bx(i));
+            m.ip = 0;
+            m.flags = simulator::lazy_flags{};
+            m.executed = 0;
+            decoder::DecodingError error;
+            blocks::run(m, block_cache, static_cast<u16>(routine.size()), ~u64{0}, &error);
+            executed += m.executed;
+        }
+        return executed;
+    }));
+
+    simulator::machine restored{};
+    blocks::cache restored_cache{};
+    snapshot::snapshot initial{};
+    restored.load(routine);
+    snapshot::take(restored, &initial);
+    results.push_back(measure("sweep_restore", opts, routine.size() * vectors, [&]() {
+        u64 executed = 0;
+        for (size_t i = 0; i < vectors; i++) {
+            snapshot::restore(restored, initial);
+            restored.regs.set_word(static_cast<u8>(simulator::Register::BX), sweep_bx(i));
+            decoder::DecodingError error;
+            blocks::run(restored, restored_cache, static_cast<u16>(routine.size()), ~u64{0}, &error);
+            executed += restored.executed;
+        }
+        return executed;
+    }));
+
+    // Register-only routine with a data-dependent branch, run for every vector one by one or in lanes
+    const vector<u8> arithmetic = {
+            0xB9, 0x40, 0x00, // mov cx, 64
+            0x01, 0xD8,       // add ax, bx
+            0x29, 0xC2,       // sub dx, ax
+            0x39, 0xF2,       // cmp dx, si
+            0x7C, 0x03,       // jl $+5
+            0x83, 0xC7, 0x03, // add di, 3
+            0xE2, 0xF3,       // loop $-11
+    };
+    vector<simulator::register_file> register_vectors(4096);
+    for (size_t i = 0; i < register_vectors.size(); i++) {
+        for (u8 reg = 0; reg < 8; reg++) register_vectors[i].set_word(reg, static_cast<u16>((i + 1) * 0x9E37 * (reg + 1)));
+    }
+    vector<lanes::result> lane_results(register_vectors.size());
+    simulator::machine arithmetic_machine{};
+    blocks::cache arithmetic_cache{};
+    snapshot::snapshot arithmetic_initial{};
+    arithmetic_machine.load(arithmetic);
+    snapshot::take(arithmetic_machine, &arithmetic_initial);
+    results.push_back(measure("sweep_registers", opts, arithmetic.size() * register_vectors.size(), [&]() {
+        u64 executed = 0;
+        for (const simulator::register_file& regs : register_vectors) {
+            snapshot::restore(arithmetic_machine, arithmetic_initial);
+            arithmetic_machine.regs = regs;
+            decoder::DecodingError error;
+            blocks::run(arithmetic_machine, arithmetic_cache, static_cast<u16>(arithmetic.size()), ~u64{0}, &error);
+            executed += arithmetic_machine.executed;
+        }
+        return executed;
+    }));
+
+    results.push_back(measure("sweep_lanes", opts, arithmetic.size() * register_vectors.size(), [&]() {
+        return lanes::run(arithmetic, register_vectors, ~u64{0}, lane_results).executed;
+    }));
+
+    // Same as the executable does: reading the file, decoding and printing
+    results.push_back(measure("end_to_end", opts, program.size(), [&]() {
+        io::input_stream is;
+        is.open(opts.corpus_path);
+        instructions.clear();
+        size_t pos;
+        decoder::decode_program(is.data(), instructions, &pos);
+        const decoder::label_table labels = decoder::find_labels(instructions);
+        printer::writer out{null_fd};
+        printer::print_program(out, instructions, labels);
+        return instructions.size();
+    }));
+
+    // Reading, decoding and formatting the file on three threads
+    results.push_back(measure("end_to_end_stream", opts, program.size(), [&]() {
+        const int fd = ::open(opts.corpus_path, O_RDONLY);
+        printer::writer out{null_fd};
+        stream::disassemble(fd, out);
+        ::close(fd);
+        return instructions.size();
+    }));
+
+    // Disassembling the corpus again after one byte changed, the state of the previous run is kept next to the corpus
+    const string state_path = string(opts.corpus_path) + ".incremental";
+    vector<u8> patched(program.begin(), program.end());
+    {
+        printer::writer out{null_fd};
+        incremental::summary summary{};
+        incremental::update(state_path.c_str(), patched, out, format::Syntax::NASM, &summary);
+    }
+    size_t patches = 0;
+    results.push_back(measure("incremental_patch", opts, program.size(), [&]() {
+        patched[(patches++ * 7919 + 1) % patched.size()] ^= 0x01;
+        printer::writer out{null_fd};
+        incremental::summary summary{};
+        incremental::update(state_path.c_str(), patched, out, format::Syntax::NASM, &summary);
+        return instructions.size();
+    }));
+    ::unlink(state_path.c_str());
+
+    if (opts.json) {
+        cout << "{\"size\": " << program.size() << ", \"seed\": " << opts.seed << ", \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) print_json(results[i], i + 1 == results.size());
+        cout << "]}\n";
+    } else {
+        cout << "Corpus: " << program.size() << " bytes, " << results.front().instructions << " instructions\n";
+        for (const result& r : results) print_text(r);
+    }
+
+    ::close(null_fd);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "corpus.h"
+#include "decoder.h"
+
+corpus::random::random(const u64 seed): state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+
+u64 corpus::random::next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+u32 corpus::random::below(const u32 bound) {
+    return static_cast<u32>(((next() >> 32) * bound) >> 32);
+}
+
+// [ mod reg rm ] [ disp low ] [ disp high ]
+static void emit_mod_reg_rm(std::vector<u8>& out, corpus::random& rng, const u8 reg) {
+    const u8 mod = rng.below(4);
+    const u8 rm = rng.below(8);
+    out.push_back(static_cast<u8>((mod << 6) | (reg << 3) | rm));
+
+    if (mod == 0b01) {
+        out.push_back(static_cast<u8>(rng.next()));
+    } else if (mod == 0b10 || (mod == 0b00 && rm == 0b110)) {
+        out.push_back(static_cast<u8>(rng.next()));
+        out.push_back(static_cast<u8>(rng.next()));
+    }
+}
+
+// [ data low ] [ data high ]
+static void emit_data(std::vector<u8>& out, corpus::random& rng, const bool word) {
+    out.push_back(static_cast<u8>(rng.next()));
+    if (word) out.push_back(static_cast<u8>(rng.next()));
+}
+
+// Opcodes of the reg/memory with register to either form: mov, add, sub, cmp, adc, sbb, and, or, xor
+const static u8 reg_mem_opcodes[] = {
+        0b10001000, 0b00000000, 0b00101000, 0b00111000, 0b00010000, 0b00011000, 0b00100000, 0b00001000, 0b00110000
+};
+
+// Opcodes of the immediate with accumulator form: add, sub, cmp, adc, sbb, and, or, xor
+const static u8 accumulator_opcodes[] = {
+        0b00000100, 0b00101100, 0b00111100, 0b00010100, 0b00011100, 0b00100100, 0b00001100, 0b00110100
+};
+
+// Jumps on condition, loops and jcxz
+const static u8 jump_opcodes[] = {
+        0b01110000, 0b01110001, 0b01110010, 0b01110011, 0b01110100, 0b01110101, 0b01110110, 0b01110111,
+        0b01111000, 0b01111001, 0b01111010, 0b01111011, 0b01111100, 0b01111101, 0b01111110, 0b01111111,
+        0b11100000, 0b11100001, 0b11100010, 0b11100011
+};
+
+std::vector<u8> corpus::generate(const size_t size, const u64 seed) {
+    random rng{seed};
+    std::vector<u8> out{};
+    out.reserve(size + 8);
+
+    while (out.size() < size) {
+        switch (rng.below(6)) {
+            // <instr> <reg/mem>, <reg/mem>
+            case 0: {
+                const u8 dw = rng.below(4);
+                out.push_back(reg_mem_opcodes[rng.below(sizeof(reg_mem_opcodes))] | dw);
+                emit_mod_reg_rm(out, rng, rng.below(8));
+                break;
+            }
+            // mov <reg>, <data>
+            case 1: {
+                const u8 wreg = rng.below(16);
+                out.push_back(0b10110000 | wreg);
+                emit_data(out, rng, wreg >> 3);
+                break;
+            }
+            // <instr> <acc>, <data>
+            case 2: {
+                const u8 w = rng.below(2);
+                out.push_back(accumulator_opcodes[rng.below(sizeof(accumulator_opcodes))] | w);
+                emit_data(out, rng, w);
+                break;
+            }
+            // <instr> <reg/mem>, <data>
+            case 3: {
+                const u8 sw = rng.below(4);
+                out.push_back(0b10000000 | sw);
+                emit_mod_reg_rm(out, rng, rng.below(8));
+                emit_data(out, rng, sw == 0b01);
+                break;
+            }
+            // <jump> <label>
+            case 4: {
+                out.push_back(jump_opcodes[rng.below(sizeof(jump_opcodes))]);
+                out.push_back(static_cast<u8>(rng.next()));
+                break;
+            }
+            // Any other instruction: random bytes which the decoder accepts
+            case 5: {
+                u8 bytes[MAX_INSTRUCTION_LENGTH];
+                for (u8& byte : bytes) byte = static_cast<u8>(rng.next());
+                decoder::Instruction instr{};
+                if (decoder::decode(bytes, &instr) != decoder::DecodingError::NONE) break;
+                out.insert(out.end(), bytes, bytes + instr.length);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return out;
+}
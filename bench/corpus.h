@@ -0,0 +1,31 @@
+#ifndef VM8086_CORPUS_H
+#define VM8086_CORPUS_H
+
+#include <utils/types.h>
+#include <vector>
+
+namespace corpus {
+
+    /**
+     * Deterministic xorshift generator, so the same seed always produces the same corpus.
+     */
+    struct random {
+        u64 state;
+
+        explicit random(u64 seed);
+
+        u64 next();
+
+        // Uniform value in [0, bound)
+        u32 below(u32 bound);
+    };
+
+    /**
+     * Generates a stream of valid instructions of at least `size` bytes. It contains every
+     * instruction the decoder supports in all addressing modes.
+     */
+    std::vector<u8> generate(size_t size, u64 seed);
+
+}
+
+#endif //VM8086_CORPUS_H
@@ -0,0 +1,156 @@
+#include "batch.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <unordered_set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "io.h"
+#include "parallel.h"
+using namespace batch;
+
+static std::string base_name(const std::string& path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static void add_job(std::vector<job>& jobs, std::string input, const size_t bytes) {
+    job j{};
+    j.input = std::move(input);
+    j.bytes = bytes;
+    jobs.push_back(std::move(j));
+}
+
+std::vector<job> batch::collect(const std::span<const char* const> paths, const settings& s) {
+    std::vector<job> jobs{};
+    for (const char* path : paths) {
+        struct stat info{};
+        if (::stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+            // Errors are reported when the program is read
+            add_job(jobs, path, static_cast<size_t>(info.st_size));
+            continue;
+        }
+
+        DIR* directory = ::opendir(path);
+        if (!directory) {
+            add_job(jobs, path, 0);
+            continue;
+        }
+        std::vector<std::pair<std::string, size_t>> files{};
+        while (const dirent* e = ::readdir(directory)) {
+            std::string file = std::string(path) + "/" + e->d_name;
+            struct stat file_info{};
+            if (::stat(file.c_str(), &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+                files.emplace_back(std::move(file), static_cast<size_t>(file_info.st_size));
+            }
+        }
+        ::closedir(directory);
+
+        std::sort(files.begin(), files.end());
+        for (auto& [file, bytes] : files) add_job(jobs, std::move(file), bytes);
+    }
+
+    // Programs with the same name from different directories would share a listing, which is
+    // written by two threads at once, so the later ones get a suffix
+    std::unordered_set<std::string> names{};
+    for (job& j : jobs) {
+        const std::string name = base_name(j.input);
+        std::string unique = name;
+        for (size_t n = 1; !names.insert(unique).second; n++) unique = name + "-" + std::to_string(n);
+        j.output = std::string(s.directory) + "/" + unique + ".asm";
+    }
+    return jobs;
+}
+
+static void disassemble(job& j, context& c, const settings& s) {
+    io::input_stream is;
+    if (!is.open(j.input.c_str())) {
+        j.io_error = errno;
+        return;
+    }
+    const std::span<const u8> program = is.data();
+    j.bytes = program.size();
+
+    c.instructions.clear();
+    j.error = decoder::decode_program(program, c.instructions, &j.pos);
+    j.instructions = c.instructions.size();
+    const decoder::label_table labels = decoder::find_labels(c.instructions);
+
+    const int fd = ::open(j.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        j.io_error = errno;
+        return;
+    }
+    c.out.fd = fd;
+    if (s.cycles) cycles::print_program(c.out, c.instructions, labels, s.model);
+    else printer::print_program(c.out, c.instructions, labels, s.syntax);
+    if (!c.out.flush()) j.io_error = errno;
+    c.out.fd = -1;
+    ::close(fd);
+}
+
+void batch::run(std::vector<job>& jobs, const settings& s) {
+    // Large programs go first, so they don't end up as the last task of a thread
+    std::vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&jobs](const size_t a, const size_t b) {
+        return jobs[a].bytes > jobs[b].bytes;
+    });
+
+    const unsigned threads = std::max(s.threads, 1u);
+    const std::unique_ptr<context[]> contexts{new context[threads]};
+    parallel::for_each_stealing(order.size(), threads, [&](const size_t i, const unsigned thread) {
+        disassemble(jobs[order[i]], contexts[thread], s);
+    });
+}
+
+// Paths can be longer than a line of the writer
+static void print_path(printer::writer& out, const std::string& path) {
+    for (size_t pos = 0; pos < path.size(); pos += WRITER_MAX_LINE / 2) {
+        out.line();
+        out.write(path.data() + pos, std::min<size_t>(WRITER_MAX_LINE / 2, path.size() - pos));
+    }
+}
+
+size_t batch::print_summary(printer::writer& out, const std::span<const job> jobs) {
+    size_t failed = 0;
+    u64 bytes = 0;
+    u64 instructions = 0;
+    for (const job& j : jobs) {
+        failed += j.io_error != 0 || j.error != decoder::DecodingError::NONE;
+        bytes += j.bytes;
+        instructions += j.instructions;
+    }
+
+    out.line();
+    out.write("; Files: ", 9);
+    out.unsigned_integer(jobs.size());
+    out.write(", failed: ", 10);
+    out.unsigned_integer(failed);
+    out.write("\n; Bytes: ", 10);
+    out.unsigned_integer(bytes);
+    out.write("\n; Instructions: ", 17);
+    out.unsigned_integer(instructions);
+    out.put('\n');
+
+    for (const job& j : jobs) {
+        if (j.io_error == 0 && j.error == decoder::DecodingError::NONE) continue;
+        out.line();
+        out.write(";   ", 4);
+        print_path(out, j.input);
+        out.line();
+        out.write(": ", 2);
+        if (j.io_error != 0) {
+            out.str(std::strerror(j.io_error));
+        } else {
+            out.str(decoder::decoding_error_message[static_cast<int>(j.error)]);
+            out.write(" at ", 4);
+            out.unsigned_integer(j.pos);
+        }
+        out.put('\n');
+    }
+    return failed;
+}
@@ -0,0 +1,65 @@
+#ifndef VM8086_BATCH_H
+#define VM8086_BATCH_H
+
+#include <utils/types.h>
+#include <span>
+#include <string>
+#include <vector>
+#include "decoder.h"
+#include "printer.h"
+#include "cycles.h"
+
+namespace batch {
+
+    /**
+     * Everything a thread needs to disassemble one program after another. Buffers are kept
+     * between the programs, so only the first program of a thread allocates them.
+     */
+    struct context {
+        std::vector<decoder::Instruction> instructions{};
+        printer::writer out{-1};
+    };
+
+    // One program of the batch
+    struct job {
+        std::string input;
+        std::string output;
+        size_t bytes = 0;
+        size_t instructions = 0;
+        decoder::DecodingError error = decoder::DecodingError::NONE;
+        // Position of the instruction which failed to decode
+        size_t pos = 0;
+        // errno of a failed read or write, 0 otherwise
+        int io_error = 0;
+    };
+
+    struct settings {
+        // Listing of every program is written to <directory>/<name of the program>.asm, see collect
+        const char* directory = ".";
+        unsigned threads = 1;
+        bool cycles = false;
+        format::Syntax syntax = format::Syntax::NASM;
+        cycles::Model model = cycles::Model::I8086;
+    };
+
+    /**
+     * Programs from the paths, directories are replaced with the regular files inside them,
+     * sorted by name. Listing of a program whose name was already taken by an earlier program
+     * is written to <directory>/<name>-<n>.asm with the first free n.
+     */
+    std::vector<job> collect(std::span<const char* const> paths, const settings& s);
+
+    // Disassembles the programs on a work-stealing pool, larger programs are taken first
+    void run(std::vector<job>& jobs, const settings& s);
+
+    /**
+     * ; Files: <count>, failed: <count>
+     * ; Bytes: <count>
+     * ; Instructions: <count>
+     * followed by the reason of every failure. Returns the number of failed programs.
+     */
+    size_t print_summary(printer::writer& out, std::span<const job> jobs);
+
+}
+
+#endif //VM8086_BATCH_H
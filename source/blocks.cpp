@@ -0,0 +1,152 @@
+#include "blocks.h"
+using namespace blocks;
+using simulator::ExecutionError;
+using simulator::Segment;
+
+// Bit of simulator::written_state for CS
+constexpr static u16 WRITES_CS = 1 << (8 + static_cast<u8>(Segment::CS));
+
+// CS:IP
+static u32 block_key(const simulator::machine& m) {
+    return (static_cast<u32>(m.segments[static_cast<u8>(Segment::CS)]) << 16) | m.ip;
+}
+
+block* blocks::cache::find(simulator::machine& m, const u16 end, decoder::DecodingError* decoding_error) {
+    const u32 key = block_key(m);
+    const auto it = blocks.find(key);
+    if (it != blocks.end()) return it->second;
+
+    block* reused = nullptr;
+    if (!free.empty()) {
+        reused = free.back();
+        free.pop_back();
+        reused->instructions.clear();
+        reused->next = nullptr;
+        reused->taken = nullptr;
+        reused->valid = true;
+    }
+    block& b = reused ? *reused : storage.emplace_back();
+    b.key = key;
+    b.ip = m.ip;
+
+    u16 ip = m.ip;
+    while (ip < end && b.instructions.size() < BLOCK_MAX_INSTRUCTIONS) {
+        const u32 address = m.physical(Segment::CS, ip);
+        decoder::Instruction instr{};
+        *decoding_error = decoder::decode({ m.memory.get() + address, MEMORY_SIZE - address }, &instr);
+        if (*decoding_error != decoder::DecodingError::NONE) break;
+
+        const u16 written = simulator::written_state(instr);
+        b.instructions.push_back(predecoded {
+                .handler = simulator::handler(instr.operation),
+                .instr = instr,
+                .written = written,
+        });
+        ip += instr.length;
+        // Next instruction after a write into CS is at another address
+        if (decoder::is_control_transfer(instr.operation) || (written & WRITES_CS)) break;
+    }
+
+    // The very first instruction failed to decode, the error will be reported once we get there
+    if (b.instructions.empty()) {
+        b.valid = false;
+        free.push_back(&b);
+        return nullptr;
+    }
+    *decoding_error = decoder::DecodingError::NONE;
+    b.end_ip = ip;
+
+    b.first_page = m.physical(Segment::CS, b.ip) / CODE_PAGE_SIZE;
+    b.last_page = m.physical(Segment::CS, ip - 1) / CODE_PAGE_SIZE;
+    for (u32 page = b.first_page;; page = (page + 1) % CODE_PAGES) {
+        m.code_pages[page / 64] |= u64{1} << (page % 64);
+        pages[page].push_back(&b);
+        if (page == b.last_page) break;
+    }
+
+    blocks.emplace(key, &b);
+    return &b;
+}
+
+void blocks::cache::invalidate(simulator::machine& m) {
+    for (const u32 page : m.modified_pages) {
+        for (block* b : pages[page]) {
+            if (!b->valid) continue;
+            b->valid = false;
+
+            const auto it = blocks.find(b->key);
+            if (it != blocks.end() && it->second == b) blocks.erase(it);
+
+            // Block can only be reused once it's on no page
+            for (u32 other = b->first_page;; other = (other + 1) % CODE_PAGES) {
+                if (other != page) std::erase(pages[other], b);
+                if (other == b->last_page) break;
+            }
+            free.push_back(b);
+        }
+        pages[page].clear();
+        m.code_pages[page / 64] &= ~(u64{1} << (page % 64));
+    }
+    m.modified_pages.clear();
+    m.code_modified = false;
+}
+
+// Recording is a template parameter, so the loop without a recorder doesn't check for it
+template <bool traced>
+static ExecutionError run_blocks(simulator::machine& m,
+                                 cache& c,
+                                 const u16 end,
+                                 const u64 limit,
+                                 decoder::DecodingError* decoding_error,
+                                 trace::recorder* recorder) {
+    // Memory could be changed between the runs, for example by snapshot::restore
+    if (m.code_modified) c.invalidate(m);
+    block* previous = nullptr;
+
+    while (m.ip < end) {
+        // Follow the link of the previous block, so we don't have to look up the next one
+        block* current = nullptr;
+        if (previous) {
+            block* link = m.ip == previous->end_ip ? previous->next : previous->taken;
+            if (link && link->valid && link->key == block_key(m)) current = link;
+        }
+
+        if (!current) {
+            current = c.find(m, end, decoding_error);
+            if (!current) return ExecutionError::DECODING_FAILED;
+            if (previous) {
+                if (m.ip == previous->end_ip) previous->next = current;
+                else previous->taken = current;
+            }
+        }
+
+        for (const predecoded& p : current->instructions) {
+            if (m.executed >= limit) return ExecutionError::INSTRUCTION_LIMIT;
+
+            if constexpr (traced) recorder->before(m, p.instr, p.written);
+            m.ip += p.instr.length;
+            const ExecutionError error = p.handler(m, p.instr);
+            m.executed += 1;
+            if constexpr (traced) recorder->after(m, p.instr);
+            if (error != ExecutionError::NONE) return error;
+
+            // Instruction modified cached code, the rest of the block may be different now
+            if (m.code_modified) {
+                c.invalidate(m);
+                if (!current->valid) break;
+            }
+        }
+        previous = current->valid ? current : nullptr;
+    }
+    return ExecutionError::NONE;
+}
+
+ExecutionError blocks::run(simulator::machine& m,
+                           cache& c,
+                           const u16 end,
+                           const u64 limit,
+                           decoder::DecodingError* decoding_error,
+                           trace::recorder* recorder) {
+    if (recorder) return run_blocks<true>(m, c, end, limit, decoding_error, recorder);
+    return run_blocks<false>(m, c, end, limit, decoding_error, nullptr);
+}
@@ -0,0 +1,79 @@
+#ifndef VM8086_BLOCKS_H
+#define VM8086_BLOCKS_H
+
+#define BLOCK_MAX_INSTRUCTIONS 64
+
+#include <utils/types.h>
+#include <utils/collections.h>
+#include <deque>
+#include <vector>
+#include "decoder.h"
+#include "simulator.h"
+#include "trace.h"
+
+namespace blocks {
+
+    struct predecoded {
+        simulator::execute_handler handler;
+        decoder::Instruction instr;
+        // simulator::written_state of the instruction, for the trace
+        u16 written;
+    };
+
+    /**
+     * Sequence of instructions that is always executed from the beginning to the end.
+     * Block ends with a jump, after a write into CS, or before an instruction that failed to decode.
+     */
+    struct block {
+        // CS:IP of the first instruction
+        u32 key;
+        u16 ip;
+        // IP right after the last instruction
+        u16 end_ip;
+        // Pages of memory covered by the block, the last one may wrap around
+        u32 first_page;
+        u32 last_page;
+        bool valid = true;
+        std::vector<predecoded> instructions{};
+
+        // Blocks that were executed after this one, either by falling through or by taking the jump
+        block* next = nullptr;
+        block* taken = nullptr;
+    };
+
+    /**
+     * Decoded blocks of the program keyed by CS:IP. Memory writes into the pages with cached
+     * code invalidate every block on the page. Invalidated blocks are reused for the blocks
+     * decoded later, so self-modifying programs don't grow the storage.
+     */
+    struct cache {
+        umap<u32, block*> blocks{};
+        // Blocks that cover the page of memory, indexed by page
+        std::vector<std::vector<block*>> pages = std::vector<std::vector<block*>>(CODE_PAGES);
+        // Blocks never move, other blocks link to them
+        std::deque<block> storage{};
+        // Invalidated blocks which are on no page. Links to them are still followed only if the block
+        // is valid and starts at CS:IP, so a reused block is either skipped or the right one
+        std::vector<block*> free{};
+
+        // Finds or decodes the block which starts at CS:IP
+        block* find(simulator::machine& m, u16 end, decoder::DecodingError* decoding_error);
+
+        // Invalidates the blocks on pages which were modified by the machine
+        void invalidate(simulator::machine& m);
+    };
+
+    /**
+     * Runs the program until IP leaves [0, end), an error occurs or `limit` instructions are executed.
+     * Every executed instruction is recorded if there is a recorder.
+     */
+    simulator::ExecutionError run(simulator::machine& m,
+                                  cache& c,
+                                  u16 end,
+                                  u64 limit,
+                                  decoder::DecodingError* decoding_error,
+                                  trace::recorder* recorder = nullptr);
+
+}
+
+#endif //VM8086_BLOCKS_H
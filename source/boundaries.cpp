@@ -0,0 +1,170 @@
+#include "boundaries.h"
+#include <algorithm>
+#include <array>
+#include "decoder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BOUNDARIES_X86
+#include <immintrin.h>
+#endif
+
+using namespace boundaries;
+
+// Properties of an opcode packed into a byte, so they can be looked up with a byte shuffle
+enum Property : u8 {
+    // Length without displacement, 0 if the opcode is unknown
+    LENGTH_MASK = 0b00000111,
+    MOD_REG_RM = 1 << 3,
+    // Instruction has to be decoded to know its length
+    SLOW = 1 << 4,
+};
+
+static std::array<u8, 256> make_properties() {
+    std::array<u8, 256> properties{};
+    for (size_t opcode = 0; opcode < properties.size(); opcode++) {
+        const decoder::opcode_length& length = decoder::length_of(static_cast<u8>(opcode));
+        properties[opcode] = static_cast<u8>(length.length | (length.mod_reg_rm ? MOD_REG_RM : 0) | (length.slow ? SLOW : 0));
+    }
+    return properties;
+}
+
+const static std::array<u8, 256> properties = make_properties();
+
+// Displacement length indexed by mod << 2 | (rm == 110)
+alignas(16) const static u8 displacement_length[16] = {
+        0, 2, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 0, 0, 0, 0
+};
+
+// Length of the instruction if it started at `pos`, SLOW is kept as a flag
+static u8 length_at(const std::span<const u8> program, const size_t pos) {
+    const u8 property = properties[program[pos]];
+    u8 length = property & LENGTH_MASK;
+    if (property & MOD_REG_RM) {
+        const u8 mod_reg_rm = pos + 1 < program.size() ? program[pos + 1] : 0;
+        length += displacement_length[((mod_reg_rm >> 4) & 0b1100) | ((mod_reg_rm & 0b111) == 0b110)];
+    }
+    return length | (property & SLOW);
+}
+
+static void lengths_scalar(const std::span<const u8> program, const size_t from, const size_t to, u8* lengths) {
+    for (size_t pos = from; pos < to; pos++) lengths[pos - from] = length_at(program, pos);
+}
+
+#ifdef BOUNDARIES_X86
+
+// Properties of opcodes 0xH0-0xHF in both lanes for every high nibble H
+struct shuffle_rows {
+    alignas(32) u8 rows[16][32];
+
+    shuffle_rows() {
+        for (size_t high = 0; high < 16; high++) {
+            for (size_t low = 0; low < 32; low++) rows[high][low] = properties[high * 16 + low % 16];
+        }
+    }
+};
+
+const static shuffle_rows property_rows{};
+
+__attribute__((target("avx2")))
+static void lengths_avx2(const std::span<const u8> program, const size_t from, const size_t to, u8* lengths) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i displacement = _mm256_broadcastsi128_si256(
+            _mm_load_si128(reinterpret_cast<const __m128i*>(displacement_length)));
+
+    size_t pos = from;
+    // Every vector reads 33 bytes: opcodes and the mod reg rm bytes after them
+    for (; pos + 32 <= to && pos + 33 <= program.size(); pos += 32) {
+        const __m256i opcodes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(program.data() + pos));
+        const __m256i mod_reg_rm = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(program.data() + pos + 1));
+
+        // 256-entry table lookup: shuffle by the low nibble in every row, keep the row of the high nibble
+        const __m256i low = _mm256_and_si256(opcodes, low_nibble);
+        const __m256i high = _mm256_and_si256(_mm256_srli_epi16(opcodes, 4), low_nibble);
+        __m256i property = _mm256_setzero_si256();
+        for (int row = 0; row < 16; row++) {
+            const __m256i values = _mm256_shuffle_epi8(
+                    _mm256_load_si256(reinterpret_cast<const __m256i*>(property_rows.rows[row])), low);
+            const __m256i selected = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(static_cast<char>(row)));
+            property = _mm256_or_si256(property, _mm256_and_si256(values, selected));
+        }
+
+        // mod << 2 | (rm == 110)
+        const __m256i mod = _mm256_and_si256(_mm256_srli_epi16(mod_reg_rm, 4), _mm256_set1_epi8(0b1100));
+        const __m256i rm = _mm256_and_si256(mod_reg_rm, _mm256_set1_epi8(0b111));
+        const __m256i direct = _mm256_and_si256(_mm256_cmpeq_epi8(rm, _mm256_set1_epi8(0b110)), _mm256_set1_epi8(1));
+        const __m256i disp = _mm256_shuffle_epi8(displacement, _mm256_or_si256(mod, direct));
+
+        const __m256i has_mod_reg_rm = _mm256_cmpeq_epi8(_mm256_and_si256(property, _mm256_set1_epi8(MOD_REG_RM)),
+                                                         _mm256_set1_epi8(MOD_REG_RM));
+        const __m256i length = _mm256_add_epi8(_mm256_and_si256(property, _mm256_set1_epi8(LENGTH_MASK)),
+                                               _mm256_and_si256(disp, has_mod_reg_rm));
+        const __m256i result = _mm256_or_si256(length, _mm256_and_si256(property, _mm256_set1_epi8(SLOW)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lengths + (pos - from)), result);
+    }
+    lengths_scalar(program, pos, to, lengths + (pos - from));
+}
+
+#endif
+
+Implementation boundaries::best_implementation() {
+#ifdef BOUNDARIES_X86
+    if (__builtin_cpu_supports("avx2")) return Implementation::AVX2;
+#endif
+    return Implementation::SCALAR;
+}
+
+static void compute_lengths(const std::span<const u8> program,
+                            const Implementation implementation,
+                            const size_t from,
+                            const size_t to,
+                            u8* lengths) {
+#ifdef BOUNDARIES_X86
+    if (implementation == Implementation::AVX2) return lengths_avx2(program, from, to, lengths);
+#endif
+    lengths_scalar(program, from, to, lengths);
+}
+
+// Follows the chain of instructions from the beginning of the program
+template <bool with_bitmap>
+static size_t walk(const std::span<const u8> program, const Implementation implementation, u64* bitmap, size_t* end) {
+    u8 lengths[BOUNDARIES_BLOCK];
+    size_t block = 0;
+    size_t block_end = 0;
+    size_t count = 0;
+    size_t pos = 0;
+
+    while (pos < program.size()) {
+        if (pos >= block_end) {
+            block = pos;
+            block_end = std::min<size_t>(pos + BOUNDARIES_BLOCK, program.size());
+            compute_lengths(program, implementation, block, block_end, lengths);
+        }
+
+        size_t length = lengths[pos - block];
+        if (length & SLOW) {
+            decoder::Instruction instr{};
+            if (decoder::decode(program.subspan(pos), &instr) != decoder::DecodingError::NONE) break;
+            length = instr.length;
+        } else if (length == 0 || length > program.size() - pos) {
+            // Unknown instruction or unexpected end
+            break;
+        }
+
+        if constexpr (with_bitmap) bitmap[pos / 64] |= u64{1} << (pos % 64);
+        count += 1;
+        pos += length;
+    }
+    *end = pos;
+    return count;
+}
+
+result boundaries::find(const std::span<const u8> program, const Implementation implementation) {
+    result r{};
+    r.bitmap.resize((program.size() + 63) / 64);
+    r.count = walk<true>(program, implementation, r.bitmap.data(), &r.end);
+    return r;
+}
+
+size_t boundaries::count(const std::span<const u8> program, const Implementation implementation, size_t* end) {
+    return walk<false>(program, implementation, nullptr, end);
+}
@@ -0,0 +1,54 @@
+#ifndef VM8086_BOUNDARIES_H
+#define VM8086_BOUNDARIES_H
+
+// Lengths are computed for this many positions at a time, so they stay in L1
+#define BOUNDARIES_BLOCK 4096
+
+#include <utils/types.h>
+#include <span>
+#include <vector>
+
+namespace boundaries {
+
+    enum class Implementation : u8 {
+        SCALAR,
+        // 32 positions at a time with vpshufb table lookups
+        AVX2,
+    };
+
+    inline constexpr const char* implementation_name[] = { "scalar", "avx2" };
+
+    // Fastest implementation supported by the CPU
+    Implementation best_implementation();
+
+    /**
+     * Beginnings of the instructions of a program, without decoding them.
+     */
+    struct result {
+        // One bit per byte of the program, set at the first byte of every instruction
+        std::vector<u64> bitmap{};
+        size_t count = 0;
+        // Position after the last instruction. If it's less than the size of the program,
+        // the instruction at this position fails to decode.
+        size_t end = 0;
+
+        bool is_boundary(const size_t pos) const {
+            return (bitmap[pos / 64] >> (pos % 64)) & 1;
+        }
+    };
+
+    /**
+     * Length of an instruction depends only on its first two bytes for almost every opcode.
+     * The lengths are computed for every position of the program as if an instruction started
+     * there, with vector table lookups. Then the chain of instructions is followed from the
+     * beginning of the program using these lengths. Prefixed instructions and groups with
+     * invalid forms are decoded to get their length.
+     */
+    result find(std::span<const u8> program, Implementation implementation);
+
+    // Same as find, but without the bitmap
+    size_t count(std::span<const u8> program, Implementation implementation, size_t* end);
+
+}
+
+#endif //VM8086_BOUNDARIES_H
@@ -0,0 +1,191 @@
+#include "cache.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace cache;
+using decoder::Instruction;
+
+const static char magic[8] = { 'v', 'm', '8', '0', '8', '6', 'd', 'c' };
+
+static_assert(sizeof(header) == 64);
+static_assert(std::is_trivially_copyable_v<Instruction>);
+static_assert(alignof(Instruction) <= alignof(header));
+
+static size_t labels_offset(const u64 instruction_count) {
+    const size_t end = sizeof(header) + instruction_count * sizeof(Instruction);
+    return (end + alignof(u32) - 1) & ~(alignof(u32) - 1);
+}
+
+static u64 read_word(const u8* bytes) {
+    u64 word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static u64 rotate(const u64 value, const int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Murmur3 finalizer
+static u64 mix(u64 value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDull;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+u64 cache::hash(const std::span<const u8> data) {
+    constexpr u64 prime = 0x9E3779B97F4A7C15ull;
+    // Four independent lanes, so the multiplications overlap
+    u64 lanes[4] = { prime, prime * 3, prime * 5, prime * 7 };
+    size_t pos = 0;
+    for (; pos + 32 <= data.size(); pos += 32) {
+        for (int i = 0; i < 4; i++) lanes[i] = rotate((lanes[i] ^ read_word(data.data() + pos + i * 8)) * prime, 31);
+    }
+    u64 result = data.size();
+    for (const u64 lane : lanes) result = mix(result ^ lane);
+    for (; pos < data.size(); pos++) result = (result ^ data[pos]) * prime;
+    return mix(result);
+}
+
+// <directory>/<hash>.cache, returns false if the path is too long
+static bool make_path(char (&path)[PATH_MAX], const char* directory, const u64 hash, const char* suffix) {
+    const int length = std::snprintf(path, sizeof(path), "%s/%016llx.cache%s",
+                                     directory, static_cast<unsigned long long>(hash), suffix);
+    if (length < 0 || static_cast<size_t>(length) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+entry::~entry() {
+    close();
+}
+
+const header& entry::get_header() const {
+    return *reinterpret_cast<const header*>(image);
+}
+
+std::span<const Instruction> entry::instructions() const {
+    return { reinterpret_cast<const Instruction*>(image + sizeof(header)), get_header().instruction_count };
+}
+
+decoder::label_view entry::labels() const {
+    const header& h = get_header();
+    return { { reinterpret_cast<const u32*>(image + labels_offset(h.instruction_count)), h.label_count } };
+}
+
+decoder::DecodingError entry::error() const {
+    return static_cast<decoder::DecodingError>(get_header().error);
+}
+
+size_t entry::end() const {
+    return get_header().end;
+}
+
+bool entry::open(const char* directory, const std::span<const u8> program) {
+    close();
+    const u64 program_hash = hash(program);
+    char path[PATH_MAX];
+    if (!make_path(path, directory, program_hash, "")) return false;
+
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info{};
+    const bool sized = ::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(header);
+    void* address = sized ? ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (address == MAP_FAILED) return false;
+
+    image = static_cast<const u8*>(address);
+    image_size = info.st_size;
+
+    const header& h = get_header();
+    const bool valid = std::memcmp(h.magic, magic, sizeof(magic)) == 0
+            && h.version == CACHE_VERSION
+            && h.instruction_size == sizeof(Instruction)
+            && h.operation_count == static_cast<u32>(decoder::Operation::COUNT)
+            && h.hash == program_hash
+            && h.program_size == program.size()
+            && h.end <= program.size()
+            && h.instruction_count <= program.size()
+            && h.label_count <= program.size()
+            && labels_offset(h.instruction_count) + h.label_count * sizeof(u32) == image_size;
+    if (!valid) close();
+    return valid;
+}
+
+void entry::close() {
+    if (image) ::munmap(const_cast<u8*>(image), image_size);
+    image = nullptr;
+    image_size = 0;
+}
+
+static bool write_all(const int fd, const void* data, size_t size) {
+    const u8* bytes = static_cast<const u8*>(data);
+    while (size > 0) {
+        const ssize_t written = ::write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool cache::store(const char* directory,
+                  const std::span<const u8> program,
+                  const std::span<const Instruction> instructions,
+                  const decoder::label_view labels,
+                  const decoder::DecodingError error,
+                  const size_t end) {
+    header h{};
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = CACHE_VERSION;
+    h.instruction_size = sizeof(Instruction);
+    h.operation_count = static_cast<u32>(decoder::Operation::COUNT);
+    h.error = static_cast<u32>(error);
+    h.hash = hash(program);
+    h.program_size = program.size();
+    h.instruction_count = instructions.size();
+    h.label_count = labels.positions.size();
+    h.end = end;
+
+    char path[PATH_MAX];
+    char temporary[PATH_MAX];
+    if (!make_path(path, directory, h.hash, "")) return false;
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%d", static_cast<int>(::getpid()));
+    if (!make_path(temporary, directory, h.hash, suffix)) return false;
+
+    const int fd = ::open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    const u8 padding[alignof(u32)]{};
+    const size_t padding_size = labels_offset(instructions.size()) - sizeof(header) - instructions.size_bytes();
+    const bool written = write_all(fd, &h, sizeof(h))
+            && write_all(fd, instructions.data(), instructions.size_bytes())
+            && write_all(fd, padding, padding_size)
+            && write_all(fd, labels.positions.data(), labels.positions.size_bytes());
+    const int write_error = errno;
+    ::close(fd);
+
+    if (!written || ::rename(temporary, path) != 0) {
+        const int error_code = written ? errno : write_error;
+        ::unlink(temporary);
+        errno = error_code;
+        return false;
+    }
+    return true;
+}
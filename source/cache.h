@@ -0,0 +1,88 @@
+#ifndef VM8086_CACHE_H
+#define VM8086_CACHE_H
+
+// Has to be incremented on every change of the file layout or of the decoded instructions
+#define CACHE_VERSION 1
+
+#include <utils/types.h>
+#include <span>
+#include "decoder.h"
+
+namespace cache {
+
+    /**
+     * Layout of a cache file, every number is in the byte order of the machine:
+     *   header
+     *   Instruction[instruction_count]
+     *   u32[label_count] - positions of the labels, aligned to 4 bytes
+     */
+    struct header {
+        char magic[8];
+        u32 version;
+        // Guards against changes of the decoder which weren't followed by a new version
+        u32 instruction_size;
+        u32 operation_count;
+        // DecodingError of the instruction at `end`, NONE if the whole program was decoded
+        u32 error;
+        u64 hash;
+        u64 program_size;
+        u64 instruction_count;
+        u64 label_count;
+        // Position after the last decoded instruction
+        u64 end;
+    };
+
+    // 64-bit hash of the contents, the name of the cache file
+    u64 hash(std::span<const u8> data);
+
+    /**
+     * Decoded program mapped from the cache file. Instructions and labels point into the mapping,
+     * so they are valid while the entry is open.
+     */
+    struct entry {
+        entry() = default;
+
+        entry(const entry&) = delete;
+
+        entry& operator=(const entry&) = delete;
+
+        ~entry();
+
+        /**
+         * Maps the cache file of the program from the directory. Returns false if there is no such
+         * file, or it was written by another version, or for another program.
+         */
+        bool open(const char* directory, std::span<const u8> program);
+
+        std::span<const decoder::Instruction> instructions() const;
+
+        decoder::label_view labels() const;
+
+        decoder::DecodingError error() const;
+
+        // Position after the last decoded instruction
+        size_t end() const;
+
+    private:
+        const u8* image = nullptr;
+        size_t image_size = 0;
+
+        const header& get_header() const;
+
+        void close();
+    };
+
+    /**
+     * Writes the decoded program into the directory. The file is written under a temporary name
+     * and renamed, so concurrent runs never see a partial file. Returns false and sets errno on failure.
+     */
+    bool store(const char* directory,
+               std::span<const u8> program,
+               std::span<const decoder::Instruction> instructions,
+               decoder::label_view labels,
+               decoder::DecodingError error,
+               size_t end);
+
+}
+
+#endif //VM8086_CACHE_H
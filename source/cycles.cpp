@@ -0,0 +1,444 @@
+#include "cycles.h"
+#include <algorithm>
+#include <array>
+using namespace cycles;
+using decoder::Instruction;
+using decoder::MemoryMode;
+using decoder::Operand;
+using decoder::OperandKind;
+using decoder::Operation;
+
+// Clocks of the instruction for every combination of operands, memory operands are without EA
+struct operand_timing {
+    u16 reg_reg;
+    u16 reg_mem;
+    u16 mem_reg;
+    u16 reg_imm;
+    u16 mem_imm;
+    // Memory transfers if the destination is in memory
+    u8 mem_dest_transfers;
+};
+
+// Clocks of an instruction with a single reg/mem operand or without operands, memory operands are without EA
+struct single_timing {
+    u16 reg_byte;
+    u16 reg_word;
+    u16 mem_byte;
+    u16 mem_word;
+    // Memory transfers if the operand is in memory
+    u8 mem_transfers;
+    // Words pushed to or popped from the stack
+    u8 stack_transfers;
+};
+
+// Clocks of a string instruction without a prefix, and of every repetition after the REP prefix
+struct string_timing {
+    u16 single;
+    u16 repetition;
+    u8 transfers;
+};
+
+// Clocks of a jump if it's taken and if it's not
+struct jump_timing {
+    u16 taken;
+    u16 not_taken;
+};
+
+// Clocks of a repeated string instruction before the first repetition
+#define REP_CLOCKS 9
+// Additional clocks of a shift or rotation by CL for every bit
+#define SHIFT_BIT_CLOCKS 4
+// LOCK prefix
+#define LOCK_CLOCKS 2
+
+constexpr std::array<operand_timing, 256> make_operand_table() {
+    std::array<operand_timing, 256> table{};
+    table[static_cast<u8>(Operation::MOV)] = { 2, 8, 9, 4, 10, 1 };
+    table[static_cast<u8>(Operation::ADD)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::SUB)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::CMP)] = { 3, 9, 9, 4, 10, 1 };
+    table[static_cast<u8>(Operation::ADC)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::SBB)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::AND)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::OR)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::XOR)] = { 3, 9, 16, 4, 17, 2 };
+    table[static_cast<u8>(Operation::TEST)] = { 3, 9, 9, 5, 11, 1 };
+    table[static_cast<u8>(Operation::XCHG)] = { 4, 17, 17, 0, 0, 2 };
+    return table;
+}
+
+// MUL, IMUL, DIV and IDIV take the upper bound of their range, the rest doesn't depend on the operands
+constexpr std::array<single_timing, 256> make_single_table() {
+    std::array<single_timing, 256> table{};
+    table[static_cast<u8>(Operation::INC)] = { 3, 2, 15, 15, 2, 0 };
+    table[static_cast<u8>(Operation::DEC)] = { 3, 2, 15, 15, 2, 0 };
+    table[static_cast<u8>(Operation::NEG)] = { 3, 3, 16, 16, 2, 0 };
+    table[static_cast<u8>(Operation::NOT)] = { 3, 3, 16, 16, 2, 0 };
+    table[static_cast<u8>(Operation::MUL)] = { 77, 133, 83, 139, 1, 0 };
+    table[static_cast<u8>(Operation::IMUL)] = { 98, 154, 104, 160, 1, 0 };
+    table[static_cast<u8>(Operation::DIV)] = { 90, 162, 96, 168, 1, 0 };
+    table[static_cast<u8>(Operation::IDIV)] = { 112, 184, 118, 190, 1, 0 };
+    // By 1, shifts by CL are adjusted in estimate_instruction
+    for (u8 op = static_cast<u8>(Operation::SHL); op <= static_cast<u8>(Operation::RCR); op++) table[op] = { 2, 2, 15, 15, 2, 0 };
+    // Register, segment registers are adjusted in estimate_instruction
+    table[static_cast<u8>(Operation::PUSH)] = { 11, 11, 16, 16, 1, 1 };
+    table[static_cast<u8>(Operation::POP)] = { 8, 8, 17, 17, 1, 1 };
+    // Fixed port, DX is adjusted in estimate_instruction
+    table[static_cast<u8>(Operation::IN)] = { 10, 10, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::OUT)] = { 10, 10, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::XLAT)] = { 11, 11, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::LEA)] = { 0, 0, 2, 2, 0, 0 };
+    table[static_cast<u8>(Operation::LDS)] = { 0, 0, 16, 16, 2, 0 };
+    table[static_cast<u8>(Operation::LES)] = { 0, 0, 16, 16, 2, 0 };
+    table[static_cast<u8>(Operation::LAHF)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::SAHF)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::PUSHF)] = { 10, 10, 0, 0, 0, 1 };
+    table[static_cast<u8>(Operation::POPF)] = { 8, 8, 0, 0, 0, 1 };
+    table[static_cast<u8>(Operation::AAA)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::DAA)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::AAS)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::DAS)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::AAM)] = { 83, 83, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::AAD)] = { 60, 60, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::CBW)] = { 2, 2, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::CWD)] = { 5, 5, 0, 0, 0, 0 };
+    // Register and direct far target, immediate forms of RET and RETF are adjusted in estimate_instruction
+    table[static_cast<u8>(Operation::CALL)] = { 16, 16, 21, 21, 1, 1 };
+    table[static_cast<u8>(Operation::CALL_FAR)] = { 28, 28, 37, 37, 2, 2 };
+    table[static_cast<u8>(Operation::JMP)] = { 11, 11, 18, 18, 1, 0 };
+    table[static_cast<u8>(Operation::JMP_FAR)] = { 15, 15, 24, 24, 2, 0 };
+    table[static_cast<u8>(Operation::RET)] = { 8, 8, 0, 0, 0, 1 };
+    table[static_cast<u8>(Operation::RETF)] = { 18, 18, 0, 0, 0, 2 };
+    // Flags, CS and IP are pushed and the vector is read
+    table[static_cast<u8>(Operation::INT)] = { 51, 51, 0, 0, 0, 5 };
+    table[static_cast<u8>(Operation::INT3)] = { 52, 52, 0, 0, 0, 5 };
+    // Without overflow, the interrupt is counted like INT
+    table[static_cast<u8>(Operation::INTO)] = { 4, 4, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::IRET)] = { 24, 24, 0, 0, 0, 3 };
+    for (u8 op = static_cast<u8>(Operation::CLC); op <= static_cast<u8>(Operation::HLT); op++) table[op] = { 2, 2, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::WAIT)] = { 3, 3, 0, 0, 0, 0 };
+    table[static_cast<u8>(Operation::ESC)] = { 2, 2, 8, 8, 1, 0 };
+    table[static_cast<u8>(Operation::NOP)] = { 3, 3, 0, 0, 0, 0 };
+    return table;
+}
+
+constexpr std::array<string_timing, 256> make_string_table() {
+    std::array<string_timing, 256> table{};
+    table[static_cast<u8>(Operation::MOVS)] = { 18, 17, 2 };
+    table[static_cast<u8>(Operation::CMPS)] = { 22, 22, 2 };
+    table[static_cast<u8>(Operation::SCAS)] = { 15, 15, 1 };
+    table[static_cast<u8>(Operation::LODS)] = { 12, 13, 1 };
+    table[static_cast<u8>(Operation::STOS)] = { 11, 10, 1 };
+    return table;
+}
+
+constexpr std::array<jump_timing, 256> make_jump_table() {
+    std::array<jump_timing, 256> table{};
+    for (u8 op = static_cast<u8>(Operation::JE); op <= static_cast<u8>(Operation::JNS); op++) table[op] = { 16, 4 };
+    table[static_cast<u8>(Operation::LOOP)] = { 17, 5 };
+    table[static_cast<u8>(Operation::LOOPZ)] = { 18, 6 };
+    table[static_cast<u8>(Operation::LOOPNZ)] = { 19, 5 };
+    table[static_cast<u8>(Operation::JCXZ)] = { 18, 6 };
+    table[static_cast<u8>(Operation::JMP)] = { 15, 15 };
+    table[static_cast<u8>(Operation::CALL)] = { 19, 19 };
+    return table;
+}
+
+constexpr static std::array<operand_timing, 256> operand_table = make_operand_table();
+constexpr static std::array<single_timing, 256> single_table = make_single_table();
+constexpr static std::array<string_timing, 256> string_table = make_string_table();
+constexpr static std::array<jump_timing, 256> jump_table = make_jump_table();
+
+// EA clocks of every register pattern without and with displacement
+const static u16 pattern_clocks[8][2] = {
+        // bx + si, bx + di, bp + si, bp + di
+        { 7, 11 }, { 8, 12 }, { 8, 12 }, { 7, 11 },
+        // si, di, bp, bx
+        { 5, 9 }, { 5, 9 }, { 5, 9 }, { 5, 9 }
+};
+
+u16 cycles::ea_clocks(const Instruction& instr, const Operand& operand) {
+    // Segment override adds 2 clocks to the EA calculation
+    const u16 segment = instr.prefix & decoder::SEGMENT_MASK ? 2 : 0;
+    if (operand.kind == OperandKind::DIRECT_ADDRESS) return 6 + segment;
+    if (operand.kind != OperandKind::MEMORY) return 0;
+    return pattern_clocks[operand.reg][instr.mod == MemoryMode::MEMORY_MODE ? 0 : 1] + segment;
+}
+
+static bool is_memory(const Operand& operand) {
+    return operand.kind == OperandKind::MEMORY || operand.kind == OperandKind::DIRECT_ADDRESS;
+}
+
+// Word at an odd address is transferred in two bus cycles, 8088 always needs two of them
+static u16 transfer_penalty(const Instruction& instr, const u8 transfers, const i64 address, const Model model) {
+    if (!instr.word || transfers == 0) return 0;
+    const bool odd = address >= 0 && (address & 1);
+    return model == Model::I8088 || odd ? transfers * 4 : 0;
+}
+
+static estimate estimate_string(const Instruction& instr, const i64 address, const Model model) {
+    const string_timing& timing = string_table[static_cast<u8>(instr.operation)];
+    // Count of repetitions is in CX, only the clocks of one repetition are known
+    if (instr.prefix & (decoder::REP | decoder::REPNE)) {
+        const u16 penalty = transfer_penalty(instr, timing.transfers, address, model);
+        return estimate { .base = REP_CLOCKS, .ea = 0, .penalty = 0, .repetition = static_cast<u16>(timing.repetition + penalty) };
+    }
+    return estimate { .base = timing.single, .ea = 0, .penalty = transfer_penalty(instr, timing.transfers, address, model) };
+}
+
+static estimate estimate_single(const Instruction& instr, const i64 address, const Model model) {
+    const single_timing& timing = single_table[static_cast<u8>(instr.operation)];
+    const bool dest_memory = is_memory(instr.dest);
+    const Operand& operand = dest_memory ? instr.dest : instr.source;
+    const bool memory = dest_memory || is_memory(instr.source);
+
+    u16 base = memory ? (instr.word ? timing.mem_word : timing.mem_byte) : (instr.word ? timing.reg_word : timing.reg_byte);
+    if (base == 0) return estimate { .base = 0, .ea = 0, .penalty = 0, .known = false };
+    const u8 transfers = memory ? timing.mem_transfers : 0;
+    u16 repetition = 0;
+
+    switch (instr.operation) {
+        case Operation::SHL: case Operation::SHR: case Operation::SAR:
+        case Operation::ROL: case Operation::ROR: case Operation::RCL: case Operation::RCR:
+            if (instr.source.kind == OperandKind::BYTE_REGISTER) {
+                base = memory ? 20 : 8;
+                repetition = SHIFT_BIT_CLOCKS;
+            }
+            break;
+        case Operation::PUSH:
+            if (instr.dest.kind == OperandKind::SEGMENT_REGISTER) base = 10;
+            break;
+        case Operation::IN:
+        case Operation::OUT:
+            if (instr.dest.kind == OperandKind::WORD_REGISTER || instr.source.kind == OperandKind::WORD_REGISTER) base = 8;
+            break;
+        case Operation::RET:
+            if (instr.dest.kind == OperandKind::IMMEDIATE) base = 12;
+            break;
+        case Operation::RETF:
+            if (instr.dest.kind == OperandKind::IMMEDIATE) base = 17;
+            break;
+        default:
+            break;
+    }
+
+    // Stack is word aligned, only 8088 pays for its transfers
+    u16 penalty = transfer_penalty(instr, transfers, address, model);
+    if (model == Model::I8088) penalty += timing.stack_transfers * 4;
+    return estimate { .base = base, .ea = memory ? ea_clocks(instr, operand) : u16(0), .penalty = penalty, .repetition = repetition };
+}
+
+static estimate estimate_operands(const Instruction& instr, const i64 address, const Model model) {
+    const operand_timing& timing = operand_table[static_cast<u8>(instr.operation)];
+    const bool source_memory = is_memory(instr.source);
+    const bool dest_memory = is_memory(instr.dest);
+    const bool source_immediate = instr.source.kind == OperandKind::IMMEDIATE;
+
+    u16 base;
+    u8 transfers = 0;
+    if (dest_memory) {
+        base = source_immediate ? timing.mem_imm : timing.mem_reg;
+        transfers = timing.mem_dest_transfers;
+    } else if (source_memory) {
+        base = timing.reg_mem;
+        transfers = 1;
+    } else {
+        base = source_immediate ? timing.reg_imm : timing.reg_reg;
+    }
+
+    const Operand& memory = dest_memory ? instr.dest : instr.source;
+    u16 ea = ea_clocks(instr, memory);
+    // MOV between the accumulator and a direct address has its own encoding without EA calculation
+    if (instr.operation == Operation::MOV && (instr.opcode & 0b11111100) == 0b10100000) {
+        base = 10;
+        ea = 0;
+    }
+    // So does XCHG with the accumulator
+    if (instr.operation == Operation::XCHG && (instr.opcode & 0b11111000) == 0b10010000) base = 3;
+
+    return estimate { .base = base, .ea = ea, .penalty = transfer_penalty(instr, transfers, address, model) };
+}
+
+estimate cycles::estimate_instruction(const Instruction& instr, const i64 address, const bool taken, const Model model) {
+    estimate clocks;
+    if (instr.dest.kind == OperandKind::RELATIVE) {
+        const jump_timing& timing = jump_table[static_cast<u8>(instr.operation)];
+        clocks = estimate { .base = taken ? timing.taken : timing.not_taken, .ea = 0, .penalty = 0 };
+        if (model == Model::I8088 && instr.operation == Operation::CALL) clocks.penalty = 4;
+    } else if (decoder::is_string(instr.operation)) {
+        clocks = estimate_string(instr, address, model);
+    } else if (operand_table[static_cast<u8>(instr.operation)].reg_reg != 0) {
+        clocks = estimate_operands(instr, address, model);
+    } else {
+        clocks = estimate_single(instr, address, model);
+    }
+    if (clocks.known && (instr.prefix & decoder::LOCK)) clocks.base += LOCK_CLOCKS;
+    return clocks;
+}
+
+cycles::label_summary::label_summary(const decoder::label_view labels): clocks(labels.positions.size() + 1) {}
+
+void cycles::label_summary::add(const decoder::label_view labels, const size_t pos, const estimate& instr_clocks) {
+    if (!instr_clocks.known) {
+        unknown++;
+        return;
+    }
+    if (instr_clocks.repetition != 0) repeated++;
+    // 0 is the beginning of the program, the rest are labels
+    const auto label = std::upper_bound(labels.positions.begin(), labels.positions.end(), pos);
+    clocks[label - labels.positions.begin()] += instr_clocks.total();
+    total += instr_clocks.total();
+}
+
+// <instr> ; Clocks: +<clocks> = <total> (<base> + <ea>ea + <penalty>p + <repetition>n), ? instead of unknown clocks
+void cycles::print_clocks(printer::writer& out, const estimate& clocks, const u64 total) {
+    out.line();
+    if (!clocks.known) {
+        out.write(" ; Clocks: ? = ", 15);
+        out.unsigned_integer(total);
+        return;
+    }
+    out.write(" ; Clocks: +", 12);
+    out.integer(clocks.total());
+    out.write(" = ", 3);
+    out.unsigned_integer(total);
+
+    if (clocks.ea != 0 || clocks.penalty != 0 || clocks.repetition != 0) {
+        out.write(" (", 2);
+        out.integer(clocks.base);
+        if (clocks.ea != 0) {
+            out.write(" + ", 3);
+            out.integer(clocks.ea);
+            out.write("ea", 2);
+        }
+        if (clocks.penalty != 0) {
+            out.write(" + ", 3);
+            out.integer(clocks.penalty);
+            out.put('p');
+        }
+        if (clocks.repetition != 0) {
+            out.write(" + ", 3);
+            out.integer(clocks.repetition);
+            out.put('n');
+        }
+        out.put(')');
+    }
+}
+
+void cycles::print_summary(printer::writer& out, const decoder::label_view labels, const label_summary& summary) {
+    out.line();
+    out.write("\n; Clocks per label:\n", 21);
+    for (size_t i = 0; i < summary.clocks.size(); i++) {
+        if (summary.clocks[i] == 0) continue;
+        out.line();
+        out.write(";   ", 4);
+        if (i == 0) {
+            out.write("(start)", 7);
+        } else {
+            out.write("label_", 6);
+            out.integer(labels.name(i - 1));
+        }
+        out.write(": ", 2);
+        out.unsigned_integer(summary.clocks[i]);
+        out.put('\n');
+    }
+    out.line();
+    out.write("; Total: ", 9);
+    out.unsigned_integer(summary.total);
+    out.write(" clocks\n", 8);
+    if (summary.repeated != 0) {
+        out.line();
+        out.write(";   without repetitions of ", 27);
+        out.unsigned_integer(summary.repeated);
+        out.write(" string instructions and shifts by cl\n", 39);
+    }
+    if (summary.unknown != 0) {
+        out.line();
+        out.write(";   without ", 12);
+        out.unsigned_integer(summary.unknown);
+        out.write(" bytes which aren't instructions\n", 34);
+    }
+}
+
+void cycles::print_program(printer::writer& out,
+                           const std::span<const Instruction> instructions,
+                           const decoder::label_view labels,
+                           const Model model) {
+    label_summary summary{labels};
+    auto label = labels.positions.begin();
+    size_t pos = 0;
+
+    for (const Instruction& instr : instructions) {
+        if (label != labels.positions.end() && *label == pos) {
+            printer::print_label(out, labels.name(label - labels.positions.begin()));
+            ++label;
+        }
+
+        i32 target = -1;
+        i64 address = -1;
+        if (instr.dest.kind == OperandKind::RELATIVE) target = labels.find(decoder::jump_target(instr, pos));
+        if (instr.dest.kind == OperandKind::DIRECT_ADDRESS || instr.source.kind == OperandKind::DIRECT_ADDRESS) {
+            address = static_cast<u16>(instr.displacement);
+        }
+
+        const estimate clocks = estimate_instruction(instr, address, false, model);
+        summary.add(labels, pos, clocks);
+
+        printer::print_operation(out, instr, target);
+        print_clocks(out, clocks, summary.total);
+        out.put('\n');
+        pos += instr.length;
+    }
+
+    if (label != labels.positions.end()) printer::print_label(out, labels.name(label - labels.positions.begin()));
+    print_summary(out, labels, summary);
+}
+
+simulator::ExecutionError cycles::run(printer::writer& out,
+                                      simulator::machine& m,
+                                      const u16 end,
+                                      const u64 limit,
+                                      const decoder::label_table& labels,
+                                      const Model model,
+                                      decoder::DecodingError* decoding_error) {
+    using simulator::ExecutionError;
+    label_summary summary{labels};
+    ExecutionError error = ExecutionError::NONE;
+
+    while (m.ip < end) {
+        if (m.executed >= limit) {
+            error = ExecutionError::INSTRUCTION_LIMIT;
+            break;
+        }
+
+        const u16 ip = m.ip;
+        const u32 code = m.physical(simulator::Segment::CS, ip);
+        Instruction instr{};
+        *decoding_error = decoder::decode({ m.memory.get() + code, MEMORY_SIZE - code }, &instr);
+        if (*decoding_error != decoder::DecodingError::NONE) {
+            error = ExecutionError::DECODING_FAILED;
+            break;
+        }
+
+        // Address has to be calculated before the instruction changes registers
+        i64 address = -1;
+        if (is_memory(instr.dest)) address = simulator::effective_address(m, instr, instr.dest);
+        else if (is_memory(instr.source)) address = simulator::effective_address(m, instr, instr.source);
+
+        m.ip += instr.length;
+        error = simulator::execute(m, instr);
+        if (error != ExecutionError::NONE) break;
+
+        const bool taken = m.ip != static_cast<u16>(ip + instr.length);
+        const estimate clocks = estimate_instruction(instr, address, taken, model);
+        summary.add(labels, ip, clocks);
+
+        const i32 target = instr.dest.kind == OperandKind::RELATIVE ? labels.find(decoder::jump_target(instr, ip)) : -1;
+        printer::print_operation(out, instr, target);
+        print_clocks(out, clocks, summary.total);
+        out.put('\n');
+    }
+
+    print_summary(out, labels, summary);
+    return error;
+}
@@ -0,0 +1,88 @@
+#ifndef VM8086_CYCLES_H
+#define VM8086_CYCLES_H
+
+#include <utils/types.h>
+#include <span>
+#include "decoder.h"
+#include "printer.h"
+#include "simulator.h"
+
+namespace cycles {
+
+    enum class Model : u8 {
+        // 16-bit bus, word transfers at odd addresses take an additional bus cycle
+        I8086,
+        // 8-bit bus, every word transfer takes an additional bus cycle
+        I8088,
+    };
+
+    struct estimate {
+        // Clocks of the instruction itself
+        u16 base;
+        // Effective address calculation
+        u16 ea;
+        // Additional bus cycles of word transfers
+        u16 penalty;
+        // Clocks of every repetition of a string instruction or every bit of a shift by CL, their count
+        // isn't known before execution, so they aren't included in the total
+        u16 repetition = 0;
+        // False for bytes which aren't instructions, their clocks aren't counted
+        bool known = true;
+
+        u16 total() const {
+            return base + ea + penalty;
+        }
+    };
+
+    // Clocks required to calculate the effective address of the memory operand
+    u16 ea_clocks(const decoder::Instruction& instr, const decoder::Operand& operand);
+
+    /**
+     * Estimates clocks of the instruction. `address` is the effective address of the memory operand
+     * if it's known (negative otherwise), `taken` tells if the jump was taken.
+     */
+    estimate estimate_instruction(const decoder::Instruction& instr, i64 address, bool taken, Model model);
+
+    // Clocks of every label (or the beginning of the program) that is followed by executed instructions
+    struct label_summary {
+        std::vector<u64> clocks;
+        u64 total = 0;
+        // Instructions without an estimate
+        size_t unknown = 0;
+        // Instructions whose repetitions or shifted bits aren't counted
+        size_t repeated = 0;
+
+        explicit label_summary(decoder::label_view labels);
+
+        void add(decoder::label_view labels, size_t pos, const estimate& clocks);
+    };
+
+    // <instr> ; Clocks: +<clocks> = <total> (<base> + <ea>ea + <penalty>p + <repetition>n), ? instead of unknown clocks
+    void print_clocks(printer::writer& out, const estimate& clocks, u64 total);
+
+    void print_summary(printer::writer& out, decoder::label_view labels, const label_summary& summary);
+
+    /**
+     * Prints the program with estimated clocks of every instruction. Addresses of memory operands
+     * are only known for direct addressing, jumps are counted as not taken.
+     */
+    void print_program(printer::writer& out,
+                       std::span<const decoder::Instruction> instructions,
+                       decoder::label_view labels,
+                       Model model);
+
+    /**
+     * Executes the program one instruction at a time and prints every executed instruction with its
+     * clocks. Addresses of memory operands and jumps are exact here.
+     */
+    simulator::ExecutionError run(printer::writer& out,
+                                  simulator::machine& m,
+                                  u16 end,
+                                  u64 limit,
+                                  const decoder::label_table& labels,
+                                  Model model,
+                                  decoder::DecodingError* decoding_error);
+
+}
+
+#endif //VM8086_CYCLES_H
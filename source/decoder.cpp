@@ -3,27 +3,28 @@
 //
 
 #include "decoder.h"
-#include "printer.h"
-#include <iostream>
-#include <sstream>
-#include <utils/collections.h>
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <utils/bits.h>
+#include "instrument.h"
 using namespace decoder;
 
-static umap<i32, str> labels{};
+// Bytes of the instruction which is being decoded
+struct byte_reader {
+    std::span<const u8> bytes;
+    size_t pos = 0;
 
-const char* get_label(const io::input_stream& is, const i32 displacement) {
-    const i32 pos = static_cast<i32>(is.pos) + displacement;
-    if (!labels.contains(pos)) {
-        std::stringstream ss{};
-        ss << "label_" << labels.size();
-        labels.emplace(pos, ss.str());
+    // Past the end of the span it returns zeros, decode() reports it once the instruction is complete
+    u8 next_byte() {
+        const u8 byte = pos < bytes.size() ? bytes[pos] : 0;
+        pos += 1;
+        return byte;
     }
-    return labels.at(pos).c_str();
-}
+};
 
 // [ data low ] [ data high ]
-i32 decode_signed_data(const bool word_data, io::input_stream& is) {
+i32 decode_signed_data(const bool word_data, byte_reader& is) {
     if (word_data) {
         const u8 low = is.next_byte();
         const u8 high = is.next_byte();
@@ -35,7 +36,7 @@ i32 decode_signed_data(const bool word_data, io::input_stream& is) {
 }
 
 // [ data low ] [ data high ]
-u32 decode_unsigned_data(const bool word_data, io::input_stream& is) {
+u32 decode_unsigned_data(const bool word_data, byte_reader& is) {
     if (word_data) {
         const u8 low = is.next_byte();
         const u8 high = is.next_byte();
@@ -46,7 +47,7 @@ u32 decode_unsigned_data(const bool word_data, io::input_stream& is) {
 }
 
 // [ mod reg rm ]
-mod_reg_rm decode_mod_reg_rm(io::input_stream& is) {
+mod_reg_rm decode_mod_reg_rm(byte_reader& is) {
     const u8 byte = is.next_byte();
     return mod_reg_rm {
             .mod = static_cast<MemoryMode>(byte >> 6),
@@ -55,66 +56,38 @@ mod_reg_rm decode_mod_reg_rm(io::input_stream& is) {
     };
 }
 
-// [ mod reg rm ] [ disp low ] [ disp high ]
-decoder::DecodingError decode_mod_reg_rm_disp(io::input_stream& is, const char* instr, const bool reg_dest, const bool word) {
-    const mod_reg_rm mrr = decode_mod_reg_rm(is);
-
+// [ disp low ] [ disp high ]
+decoder::DecodingError decode_rm_disp(byte_reader& is, const mod_reg_rm& mrr, Instruction* instr, Operand* rm) {
+    INSTRUMENT_TIME(DECODE_MOD);
+    instr->mod = mrr.mod;
     switch (mrr.mod) {
 
         case MemoryMode::REGISTER_MODE: {
-            const char* reg1 = printer::get_register_name(word, mrr.reg);
-            const char* reg2 = printer::get_register_name(word, mrr.rm);
-
-            // <instr> <reg>, <reg>
-            printer::print_instr_str_str(!reg_dest, instr, reg1, reg2);
+            *rm = Operand { .kind = OperandKind::REGISTER, .reg = mrr.rm };
             return decoder::DecodingError::NONE;
         }
 
         case MemoryMode::MEMORY_MODE: {
             // if R/M field = 110, we should read DIRECT ADDRESS
             if (mrr.rm == 0b00000110) {
-                const i32 address = static_cast<i32>(decode_unsigned_data(true, is));
-                const char* reg = printer::get_register_name(word, mrr.reg);
-
-                // <instr> <reg>, [address]
-                if (reg_dest) printer::print_instr_str_str_int(instr, reg, nullptr, address);
-                // <instr> [address], <reg>
-                else printer::print_instr_str_int_str(instr, nullptr, address, reg);
+                *rm = Operand { .kind = OperandKind::DIRECT_ADDRESS };
+                instr->displacement = static_cast<i16>(decode_unsigned_data(true, is));
             } else {
-                const char* reg_pattern = printer::get_register_pattern(mrr.rm);
-                const char* reg = printer::get_register_name(word, mrr.reg);
-
-                // <instr> <reg>, [pattern]
-                if (reg_dest) printer::print_instr_str_str_int(instr, reg, reg_pattern, 0);
-                // <instr> [pattern], <reg>
-                else printer::print_instr_str_int_str(instr, reg_pattern, 0, reg);
+                *rm = Operand { .kind = OperandKind::MEMORY, .reg = mrr.rm };
+                instr->displacement = 0;
             }
             return decoder::DecodingError::NONE;
         }
 
         case MemoryMode::MEMORY_MODE_8_BIT: {
-            const i32 disp = decode_signed_data(false, is);
-            const char* reg_pattern = printer::get_register_pattern(mrr.rm);
-            const char* reg = printer::get_register_name(word, mrr.reg);
-
-            // <instr> <reg>, [pattern + disp]
-            if (reg_dest) printer::print_instr_str_str_int(instr, reg, reg_pattern, disp);
-            // <instr> [pattern + disp], <reg>
-            else printer::print_instr_str_int_str(instr, reg_pattern, disp, reg);
-
+            *rm = Operand { .kind = OperandKind::MEMORY, .reg = mrr.rm };
+            instr->displacement = static_cast<i16>(decode_signed_data(false, is));
             return decoder::DecodingError::NONE;
         }
 
         case MemoryMode::MEMORY_MODE_16_BIT: {
-            const i32 disp = decode_signed_data(true, is);
-            const char* reg_pattern = printer::get_register_pattern(mrr.rm);
-            const char* reg = printer::get_register_name(word, mrr.reg);
-
-            // <instr> <reg>, [pattern + disp]
-            if (reg_dest) printer::print_instr_str_str_int(instr, reg, reg_pattern, disp);
-            // <instr> [pattern + disp], <reg>
-            else printer::print_instr_str_int_str(instr, reg_pattern, disp, reg);
-
+            *rm = Operand { .kind = OperandKind::MEMORY, .reg = mrr.rm };
+            instr->displacement = static_cast<i16>(decode_signed_data(true, is));
             return decoder::DecodingError::NONE;
         }
     }
@@ -122,281 +95,734 @@ decoder::DecodingError decode_mod_reg_rm_disp(io::input_stream& is, const char*
     return decoder::DecodingError::UNSUPPORTED_INSTRUCTION_TYPE;
 }
 
+// [ mod reg rm ] [ disp low ] [ disp high ]
+decoder::DecodingError decode_mod_reg_rm_disp(byte_reader& is, const bool reg_dest, Instruction* instr) {
+    const mod_reg_rm mrr = decode_mod_reg_rm(is);
+    const Operand reg { .kind = OperandKind::REGISTER, .reg = mrr.reg };
+
+    // <instr> <reg>, <reg/mem>
+    if (reg_dest) {
+        instr->dest = reg;
+        return decode_rm_disp(is, mrr, instr, &instr->source);
+    }
+    // <instr> <reg/mem>, <reg>
+    instr->source = reg;
+    return decode_rm_disp(is, mrr, instr, &instr->dest);
+}
+
 // [ mod <opcode> rm ] [ disp low ] [ disp high] [ data low ] [ data high ]
-decoder::DecodingError decode_mod_opcode_rm_disp_data(io::input_stream& is,
+decoder::DecodingError decode_mod_opcode_rm_disp_data(byte_reader& is,
                                                       const mod_reg_rm& mrr,
-                                                      const char* instr,
                                                       const bool sign,
-                                                      const bool word) {
-
-    switch(mrr.mod) {
-
-        case MemoryMode::REGISTER_MODE: {
-            const char* reg = printer::get_register_name(word, mrr.rm);
-            const i32 data = decode_signed_data(!sign & word, is);
-            // <instr> <reg>, <data>
-            printer::print_instr_str_int(instr, reg, data);
-            return DecodingError::NONE;
-        }
-
-        case MemoryMode::MEMORY_MODE: {
-            // direct address
-            if (mrr.rm == 0b00000110) {
-                const i32 address = static_cast<i32>(decode_unsigned_data(true, is));
-                const i32 data = decode_signed_data(!sign & word, is);
-                // <instr> [ <address> ], <data>
-                printer::print_instr_str_int_int(instr, nullptr, address, data);
-            } else {
-                const char* pattern = printer::get_register_pattern(mrr.rm);
-                const i32 data = decode_signed_data(!sign & word, is);
-                // <instr> [ <pattern> ], <data>
-                printer::print_instr_str_int_int(instr, pattern, 0, data);
-            }
-            return DecodingError::NONE;
-        }
+                                                      const bool word,
+                                                      Instruction* instr) {
+    const decoder::DecodingError error = decode_rm_disp(is, mrr, instr, &instr->dest);
+    if (error != decoder::DecodingError::NONE) return error;
+
+    // <instr> <reg/mem>, <data>
+    instr->source = Operand { .kind = OperandKind::IMMEDIATE };
+    instr->immediate = static_cast<i16>(decode_signed_data(!sign & word, is));
+    return decoder::DecodingError::NONE;
+}
 
-        case MemoryMode::MEMORY_MODE_8_BIT: {
-            const char* pattern = printer::get_register_pattern(mrr.rm);
-            const i32 disp = decode_signed_data(false, is);
-            const i32 data = decode_signed_data(!sign & word, is);
-            // <instr> [ <pattern> + <disp> ], <data>
-            printer::print_instr_str_int_int(instr, pattern, disp, data);
-            return DecodingError::NONE;
+// How the bytes following the opcode are laid out
+enum class Layout : u8 {
+    // Not an 8086 instruction
+    UNKNOWN,
+    // [ opcode ]
+    NONE,
+    // [ opcode ] applies to the next instruction
+    PREFIX,
+    // [ opcode d w ] [ mod reg rm ] [ disp low ] [ disp high ]
+    MOD_REG_RM,
+    // [ opcode d ] [ mod 0 sr rm ] [ disp low ] [ disp high ]
+    MOD_SEGMENT_RM,
+    // [ opcode s w ] [ mod <opcode> rm ] [ disp low ] [ disp high ] [ data low ] [ data high ]
+    GROUP,
+    // [ opcode w reg ] [ data low ] [ data high ]
+    REG_DATA,
+    // [ opcode w ] [ data low ] [ data high ]
+    ACC_DATA,
+    // [ opcode d w ] [ addr low ] [ addr high ]
+    ACC_ADDRESS,
+    // [ opcode w ] [ port ]
+    PORT_DATA,
+    // [ opcode w ], port is in dx
+    PORT_DX,
+    // [ opcode reg ]
+    REG,
+    // [ opcode reg ], exchanged with the accumulator
+    XCHG_ACC,
+    // [ opcode sr ]
+    SEGMENT,
+    // [ opcode w ], no operands, the suffix depends on w
+    STRING,
+    // [ opcode ] [ ip-inc8 ]
+    SHORT_LABEL,
+    // [ opcode ] [ ip-inc low ] [ ip-inc high ]
+    NEAR_LABEL,
+    // [ opcode ] [ ip low ] [ ip high ] [ cs low ] [ cs high ]
+    FAR_ADDRESS,
+    // [ opcode ] [ data ]
+    DATA_8,
+    // [ opcode ] [ data low ] [ data high ]
+    DATA_16,
+    // [ opcode xxx ] [ mod xxx rm ] [ disp low ] [ disp high ]
+    ESCAPE,
+    COUNT
+};
+
+// Instructions which share the first byte and are selected by the reg field of the second byte
+enum class Group : u8 {
+    NONE,
+    IMMEDIATE,
+    SHIFT,
+    UNARY,
+    INC_DEC,
+    INDIRECT,
+    MOV_IMMEDIATE,
+    POP,
+    COUNT
+};
+
+// Operands of an instruction from a group
+enum class GroupForm : u8 {
+    // reg field doesn't select an instruction
+    INVALID,
+    // <instr> <reg/mem>
+    RM,
+    // <instr> <reg/mem>, <data>
+    RM_DATA,
+    // <instr> <reg/mem>, 1 or <instr> <reg/mem>, cl
+    RM_SHIFT,
+    // <instr> far <mem>
+    RM_FAR,
+};
+
+struct group_entry {
+    Operation operation;
+    GroupForm form;
+};
+
+constexpr group_entry group_table[static_cast<u8>(Group::COUNT)][8] = {
+        // NONE
+        {},
+        // IMMEDIATE - 100000sw
+        {
+                { Operation::ADD, GroupForm::RM_DATA }, { Operation::OR, GroupForm::RM_DATA },
+                { Operation::ADC, GroupForm::RM_DATA }, { Operation::SBB, GroupForm::RM_DATA },
+                { Operation::AND, GroupForm::RM_DATA }, { Operation::SUB, GroupForm::RM_DATA },
+                { Operation::XOR, GroupForm::RM_DATA }, { Operation::CMP, GroupForm::RM_DATA },
+        },
+        // SHIFT - 110100vw
+        {
+                { Operation::ROL, GroupForm::RM_SHIFT }, { Operation::ROR, GroupForm::RM_SHIFT },
+                { Operation::RCL, GroupForm::RM_SHIFT }, { Operation::RCR, GroupForm::RM_SHIFT },
+                { Operation::SHL, GroupForm::RM_SHIFT }, { Operation::SHR, GroupForm::RM_SHIFT },
+                { Operation::NONE, GroupForm::INVALID }, { Operation::SAR, GroupForm::RM_SHIFT },
+        },
+        // UNARY - 1111011w
+        {
+                { Operation::TEST, GroupForm::RM_DATA }, { Operation::NONE, GroupForm::INVALID },
+                { Operation::NOT, GroupForm::RM }, { Operation::NEG, GroupForm::RM },
+                { Operation::MUL, GroupForm::RM }, { Operation::IMUL, GroupForm::RM },
+                { Operation::DIV, GroupForm::RM }, { Operation::IDIV, GroupForm::RM },
+        },
+        // INC_DEC - 11111110
+        {
+                { Operation::INC, GroupForm::RM }, { Operation::DEC, GroupForm::RM },
+        },
+        // INDIRECT - 11111111
+        {
+                { Operation::INC, GroupForm::RM }, { Operation::DEC, GroupForm::RM },
+                { Operation::CALL, GroupForm::RM }, { Operation::CALL_FAR, GroupForm::RM_FAR },
+                { Operation::JMP, GroupForm::RM }, { Operation::JMP_FAR, GroupForm::RM_FAR },
+                { Operation::PUSH, GroupForm::RM }, { Operation::NONE, GroupForm::INVALID },
+        },
+        // MOV_IMMEDIATE - 1100011w
+        {
+                { Operation::MOV, GroupForm::RM_DATA },
+        },
+        // POP - 10001111
+        {
+                { Operation::POP, GroupForm::RM },
+        },
+};
+
+struct opcode_entry;
+
+using decode_handler = decoder::DecodingError (*)(byte_reader& is, const opcode_entry& entry, Instruction* instr);
+
+// Everything we know about an instruction just by looking at its first byte
+struct opcode_entry {
+    decode_handler handler;
+    Operation operation;
+    // Register or segment register encoded in the opcode, Prefix flags for prefixes
+    u8 reg;
+    bool prefix;
+};
+
+/**
+ * Decodes everything after the opcode. Fields which are constant for the opcode (w, d, s, v)
+ * are template parameters, so every opcode gets a handler without any runtime field extraction.
+ * D is the d field for reg/mem instructions, s for immediate groups and v for shifts.
+ */
+template <Layout L, bool W, bool D>
+decoder::DecodingError decode_layout(byte_reader& is, const opcode_entry& entry, Instruction* instr) {
+    constexpr Operand accumulator { .kind = OperandKind::REGISTER, .reg = 0 };
+    instr->word = W;
+
+    if constexpr (L == Layout::MOD_REG_RM) {
+        return decode_mod_reg_rm_disp(is, D, instr);
+
+    } else if constexpr (L == Layout::MOD_SEGMENT_RM) {
+        const mod_reg_rm mrr = decode_mod_reg_rm(is);
+        const Operand segment { .kind = OperandKind::SEGMENT_REGISTER, .reg = static_cast<u8>(mrr.reg & bits::LOW_2BIT) };
+        // <instr> <segment>, <reg/mem>
+        if (D) {
+            instr->dest = segment;
+            return decode_rm_disp(is, mrr, instr, &instr->source);
         }
+        // <instr> <reg/mem>, <segment>
+        instr->source = segment;
+        return decode_rm_disp(is, mrr, instr, &instr->dest);
+
+    } else if constexpr (L == Layout::REG_DATA || L == Layout::ACC_DATA) {
+        instr->dest = L == Layout::REG_DATA ? Operand { .kind = OperandKind::REGISTER, .reg = entry.reg } : accumulator;
+        instr->source = Operand { .kind = OperandKind::IMMEDIATE };
+        instr->immediate = static_cast<i16>(decode_signed_data(W, is));
+        return decoder::DecodingError::NONE;
 
-        case MemoryMode::MEMORY_MODE_16_BIT: {
-            const char* pattern = printer::get_register_pattern(mrr.rm);
-            const i32 disp = decode_signed_data(true, is);
-            const i32 data = decode_signed_data(!sign & word, is);
-            // <instr> [ <pattern> + <disp> ], <data>
-            printer::print_instr_str_int_int(instr, pattern, disp, data);
-            return DecodingError::NONE;
-        }
-    }
+    } else if constexpr (L == Layout::ACC_ADDRESS) {
+        // d is inverted here: 0 loads the accumulator, 1 stores it
+        const Operand memory { .kind = OperandKind::DIRECT_ADDRESS };
+        instr->dest = D ? memory : accumulator;
+        instr->source = D ? accumulator : memory;
+        instr->displacement = static_cast<i16>(decode_unsigned_data(true, is));
+        return decoder::DecodingError::NONE;
 
-    return decoder::DecodingError::UNSUPPORTED_INSTRUCTION_TYPE;
-}
+    } else if constexpr (L == Layout::PORT_DATA || L == Layout::PORT_DX) {
+        // Port is the destination for OUT
+        const Operand port = L == Layout::PORT_DATA
+                ? Operand { .kind = OperandKind::IMMEDIATE }
+                : Operand { .kind = OperandKind::WORD_REGISTER, .reg = 2 };
+        instr->dest = D ? port : accumulator;
+        instr->source = D ? accumulator : port;
+        if constexpr (L == Layout::PORT_DATA) instr->immediate = static_cast<i16>(decode_unsigned_data(false, is));
+        return decoder::DecodingError::NONE;
 
+    } else if constexpr (L == Layout::REG) {
+        instr->dest = Operand { .kind = OperandKind::REGISTER, .reg = entry.reg };
+        return decoder::DecodingError::NONE;
 
-decoder::DecodingError decoder::decode(io::input_stream& is) {
-    const u8 byte = is.byte();
+    } else if constexpr (L == Layout::XCHG_ACC) {
+        instr->dest = accumulator;
+        instr->source = Operand { .kind = OperandKind::REGISTER, .reg = entry.reg };
+        return decoder::DecodingError::NONE;
 
-    // TODO: brute-forcing the first byte until we get an instruction is not a good solution
-    //       we want to know which instructions we should check after we read the very first bit
+    } else if constexpr (L == Layout::SEGMENT) {
+        instr->dest = Operand { .kind = OperandKind::SEGMENT_REGISTER, .reg = entry.reg };
+        return decoder::DecodingError::NONE;
 
-    // MOV - register/memory to/from register
-    if ((byte >> 2) == 0b00100010) {
-        const bool reg_dest = (byte >> 1) & bits::LOW_1BIT;
-        const bool word = byte & bits::LOW_1BIT;
-        return decode_mod_reg_rm_disp(is, "mov", reg_dest, word);
-    }
+    } else if constexpr (L == Layout::SHORT_LABEL || L == Layout::NEAR_LABEL) {
+        instr->dest = Operand { .kind = OperandKind::RELATIVE };
+        instr->immediate = static_cast<i16>(decode_signed_data(L == Layout::NEAR_LABEL, is));
+        return decoder::DecodingError::NONE;
 
-    // MOV - immediate to register
-    if ((byte >> 4) == 0b00001011) {
-        const bool word = ((byte >> 3) & bits::LOW_1BIT) != 0;
-        const char* reg = printer::get_register_name(word, byte & bits::LOW_3BIT);
-        const i32 data = decode_signed_data(word, is);
-        printer::print_instr_str_int("mov", reg, data);
+    } else if constexpr (L == Layout::FAR_ADDRESS) {
+        instr->dest = Operand { .kind = OperandKind::FAR };
+        instr->displacement = static_cast<i16>(decode_unsigned_data(true, is));
+        instr->immediate = static_cast<i16>(decode_unsigned_data(true, is));
         return decoder::DecodingError::NONE;
-    }
 
-    // ADD - reg/memory with register to either
-    if ((byte >> 2) == 0) {
-        const bool reg_dest = (byte >> 1) & bits::LOW_1BIT;
-        const bool word = byte & bits::LOW_1BIT;
-        return decode_mod_reg_rm_disp(is, "add", reg_dest, word);
-    }
+    } else if constexpr (L == Layout::DATA_8 || L == Layout::DATA_16) {
+        instr->dest = Operand { .kind = OperandKind::IMMEDIATE };
+        instr->immediate = static_cast<i16>(decode_unsigned_data(L == Layout::DATA_16, is));
+        return decoder::DecodingError::NONE;
 
-    // CMP - reg/memory with register to either
-    if ((byte >> 2) == 0b00001110) {
-        const bool reg_dest = (byte >> 1) & bits::LOW_1BIT;
-        const bool word = byte & bits::LOW_1BIT;
-        return decode_mod_reg_rm_disp(is, "cmp", reg_dest, word);
-    }
+    } else if constexpr (L == Layout::ESCAPE) {
+        // <instr> <external opcode>, <reg/mem>
+        const mod_reg_rm mrr = decode_mod_reg_rm(is);
+        instr->dest = Operand { .kind = OperandKind::IMMEDIATE };
+        instr->immediate = static_cast<i16>(((instr->opcode & bits::LOW_3BIT) << 3) | mrr.reg);
+        return decode_rm_disp(is, mrr, instr, &instr->source);
 
-    // ADD - immediate to accumulator
-    if ((byte >> 1) == 0b00000010) {
-        const bool word = byte & bits::LOW_1BIT;
-        const i32 data = decode_signed_data(word, is);
-        printer::print_instr_str_int("add", printer::get_register_name(word, 0), data);
+    } else if constexpr (L == Layout::NONE || L == Layout::STRING || L == Layout::PREFIX) {
         return decoder::DecodingError::NONE;
-    }
 
-    // SUB - immediate from accumulator
-    if ((byte >> 1) == 0b00010110) {
-        const bool word = byte & bits::LOW_1BIT;
-        const i32 data = decode_signed_data(word, is);
-        printer::print_instr_str_int("sub", printer::get_register_name(word, 0), data);
-        return decoder::DecodingError::NONE;
+    } else {
+        return decoder::DecodingError::UNKNOWN_INSTRUCTION;
     }
+}
 
-    // CMP - immediate with accumulator
-    if ((byte >> 1) == 0b00011110) {
-        const bool word = byte & bits::LOW_1BIT;
-        const i32 data = decode_signed_data(word, is);
-        printer::print_instr_str_int("cmp", printer::get_register_name(word, 0), data);
-        return decoder::DecodingError::NONE;
-    }
+// [ opcode s w ] [ mod <opcode> rm ] [ disp low ] [ disp high ] [ data low ] [ data high ]
+template <Group G, bool W, bool D>
+decoder::DecodingError decode_group(byte_reader& is, const opcode_entry&, Instruction* instr) {
+    const mod_reg_rm mrr = decode_mod_reg_rm(is);
+    const group_entry& entry = group_table[static_cast<u8>(G)][mrr.reg];
+    instr->operation = entry.operation;
+    instr->word = W;
+
+    switch (entry.form) {
+        case GroupForm::RM:
+        case GroupForm::RM_FAR:
+            return decode_rm_disp(is, mrr, instr, &instr->dest);
+
+        case GroupForm::RM_DATA:
+            return decode_mod_opcode_rm_disp_data(is, mrr, D, W, instr);
+
+        case GroupForm::RM_SHIFT: {
+            const decoder::DecodingError error = decode_rm_disp(is, mrr, instr, &instr->dest);
+            // v = 1 shifts by cl, otherwise by 1
+            if (D) {
+                instr->source = Operand { .kind = OperandKind::BYTE_REGISTER, .reg = 1 };
+            } else {
+                instr->source = Operand { .kind = OperandKind::IMMEDIATE };
+                instr->immediate = 1;
+            }
+            return error;
+        }
 
-    // SUB - reg/memory and register to either
-    if ((byte >> 2) == 0b00001010) {
-        const bool reg_dest = (byte >> 1) & bits::LOW_1BIT;
-        const bool word = byte & bits::LOW_1BIT;
-        return decode_mod_reg_rm_disp(is, "sub", reg_dest, word);
+        case GroupForm::INVALID:
+            break;
     }
+    return decoder::DecodingError::UNKNOWN_INSTRUCTION;
+}
 
-    if ((byte >> 2) == 0b00100000) {
-        const bool sign = (byte >> 1) & bits::LOW_1BIT;
-        const bool word = byte & bits::LOW_1BIT;
-        const mod_reg_rm mrr = decode_mod_reg_rm(is);
+// Instantiations for every combination of template parameters, indexed by [layout][w][d]
+template <size_t... I>
+constexpr std::array<decode_handler, sizeof...(I)> make_layout_handlers(std::index_sequence<I...>) {
+    return { &decode_layout<static_cast<Layout>(I / 4), ((I >> 1) & 1) != 0, (I & 1) != 0>... };
+}
 
-        // ADD - immediate to register/memory
-        if (mrr.reg == 0b00000000) return decode_mod_opcode_rm_disp_data(is, mrr, "add", sign, word);
-        // SUB - immediate from register/memory
-        if (mrr.reg == 0b00000101) return decode_mod_opcode_rm_disp_data(is, mrr, "sub", sign, word);
-        // CMP - immediate with register/memory
-        if (mrr.reg == 0b00000111) return decode_mod_opcode_rm_disp_data(is, mrr, "cmp", sign, word);
-    }
+// Instantiations for every combination of template parameters, indexed by [group][w][d]
+template <size_t... I>
+constexpr std::array<decode_handler, sizeof...(I)> make_group_handlers(std::index_sequence<I...>) {
+    return { &decode_group<static_cast<Group>(I / 4), ((I >> 1) & 1) != 0, (I & 1) != 0>... };
+}
 
-    // JE/JZ - jump on equal zero
-    if (byte == 0b01110100) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("je", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+constexpr auto layout_handlers = make_layout_handlers(std::make_index_sequence<static_cast<size_t>(Layout::COUNT) * 4>{});
+
+constexpr auto group_handlers = make_group_handlers(std::make_index_sequence<static_cast<size_t>(Group::COUNT) * 4>{});
+
+/**
+ * Description of an instruction encoding. The bits of the first byte are written as in the
+ * 8086 manual: 0 and 1 are fixed, d, w, s and v are single bit fields, r is a register,
+ * g is a segment register and x is a part of the external opcode of ESC.
+ */
+struct encoding {
+    const char* bits;
+    Layout layout;
+    Operation operation = Operation::NONE;
+    Group group = Group::NONE;
+    // Values of w and d for encodings which don't have these fields
+    bool word = false;
+    bool d = false;
+    // Prefix flags of a prefix byte
+    u8 prefix = 0;
+};
+
+constexpr encoding encodings[] = {
+        // Data transfer
+        { "100010dw", Layout::MOD_REG_RM, Operation::MOV },                         // MOV - reg/memory to/from register
+        { "1100011w", Layout::GROUP, Operation::NONE, Group::MOV_IMMEDIATE },       // MOV - immediate to reg/memory
+        { "1011wrrr", Layout::REG_DATA, Operation::MOV },                           // MOV - immediate to register
+        { "101000dw", Layout::ACC_ADDRESS, Operation::MOV },                        // MOV - memory to/from accumulator
+        { "100011d0", Layout::MOD_SEGMENT_RM, Operation::MOV, Group::NONE, true },  // MOV - reg/memory to/from segment
+        { "11111111", Layout::GROUP, Operation::NONE, Group::INDIRECT, true },      // INC/DEC/CALL/JMP/PUSH - reg/memory
+        { "01010rrr", Layout::REG, Operation::PUSH, Group::NONE, true },            // PUSH - register
+        { "000gg110", Layout::SEGMENT, Operation::PUSH, Group::NONE, true },        // PUSH - segment register
+        { "10001111", Layout::GROUP, Operation::NONE, Group::POP, true },           // POP - reg/memory
+        { "01011rrr", Layout::REG, Operation::POP, Group::NONE, true },             // POP - register
+        { "000gg111", Layout::SEGMENT, Operation::POP, Group::NONE, true },         // POP - segment register
+        { "1000011w", Layout::MOD_REG_RM, Operation::XCHG },                        // XCHG - reg/memory with register
+        { "10010000", Layout::NONE, Operation::NOP },                               // NOP - xchg ax, ax
+        { "10010rrr", Layout::XCHG_ACC, Operation::XCHG, Group::NONE, true },       // XCHG - register with accumulator
+        { "1110010w", Layout::PORT_DATA, Operation::IN },                           // IN - fixed port
+        { "1110110w", Layout::PORT_DX, Operation::IN },                             // IN - variable port
+        { "1110011w", Layout::PORT_DATA, Operation::OUT, Group::NONE, false, true },// OUT - fixed port
+        { "1110111w", Layout::PORT_DX, Operation::OUT, Group::NONE, false, true },  // OUT - variable port
+        { "11010111", Layout::NONE, Operation::XLAT },                              // XLAT - translate byte to al
+        { "10001101", Layout::MOD_REG_RM, Operation::LEA, Group::NONE, true, true },// LEA - load EA to register
+        { "11000101", Layout::MOD_REG_RM, Operation::LDS, Group::NONE, true, true },// LDS - load pointer to ds
+        { "11000100", Layout::MOD_REG_RM, Operation::LES, Group::NONE, true, true },// LES - load pointer to es
+        { "10011111", Layout::NONE, Operation::LAHF },                              // LAHF - load ah with flags
+        { "10011110", Layout::NONE, Operation::SAHF },                              // SAHF - store ah into flags
+        { "10011100", Layout::NONE, Operation::PUSHF },                             // PUSHF - push flags
+        { "10011101", Layout::NONE, Operation::POPF },                              // POPF - pop flags
+
+        // Arithmetic
+        { "000000dw", Layout::MOD_REG_RM, Operation::ADD },                         // ADD - reg/memory with register to either
+        { "100000sw", Layout::GROUP, Operation::NONE, Group::IMMEDIATE },           // ADD/OR/ADC/SBB/AND/SUB/XOR/CMP - immediate
+        { "0000010w", Layout::ACC_DATA, Operation::ADD },                           // ADD - immediate to accumulator
+        { "000100dw", Layout::MOD_REG_RM, Operation::ADC },                         // ADC - reg/memory with register to either
+        { "0001010w", Layout::ACC_DATA, Operation::ADC },                           // ADC - immediate to accumulator
+        { "11111110", Layout::GROUP, Operation::NONE, Group::INC_DEC },             // INC/DEC - reg/memory
+        { "01000rrr", Layout::REG, Operation::INC, Group::NONE, true },             // INC - register
+        { "00110111", Layout::NONE, Operation::AAA },                               // AAA - ASCII adjust for add
+        { "00100111", Layout::NONE, Operation::DAA },                               // DAA - decimal adjust for add
+        { "001010dw", Layout::MOD_REG_RM, Operation::SUB },                         // SUB - reg/memory and register to either
+        { "0010110w", Layout::ACC_DATA, Operation::SUB },                           // SUB - immediate from accumulator
+        { "000110dw", Layout::MOD_REG_RM, Operation::SBB },                         // SBB - reg/memory and register to either
+        { "0001110w", Layout::ACC_DATA, Operation::SBB },                           // SBB - immediate from accumulator
+        { "01001rrr", Layout::REG, Operation::DEC, Group::NONE, true },             // DEC - register
+        { "001110dw", Layout::MOD_REG_RM, Operation::CMP },                         // CMP - reg/memory and register
+        { "0011110w", Layout::ACC_DATA, Operation::CMP },                           // CMP - immediate with accumulator
+        { "00111111", Layout::NONE, Operation::AAS },                               // AAS - ASCII adjust for subtract
+        { "00101111", Layout::NONE, Operation::DAS },                               // DAS - decimal adjust for subtract
+        { "1111011w", Layout::GROUP, Operation::NONE, Group::UNARY },               // TEST/NOT/NEG/MUL/IMUL/DIV/IDIV
+        { "11010100", Layout::DATA_8, Operation::AAM },                             // AAM - ASCII adjust for multiply
+        { "11010101", Layout::DATA_8, Operation::AAD },                             // AAD - ASCII adjust for divide
+        { "10011000", Layout::NONE, Operation::CBW },                               // CBW - convert byte to word
+        { "10011001", Layout::NONE, Operation::CWD },                               // CWD - convert word to double word
+
+        // Logic
+        { "110100vw", Layout::GROUP, Operation::NONE, Group::SHIFT },               // ROL/ROR/RCL/RCR/SHL/SHR/SAR
+        { "001000dw", Layout::MOD_REG_RM, Operation::AND },                         // AND - reg/memory and register to either
+        { "0010010w", Layout::ACC_DATA, Operation::AND },                           // AND - immediate to accumulator
+        { "1000010w", Layout::MOD_REG_RM, Operation::TEST },                        // TEST - reg/memory and register
+        { "1010100w", Layout::ACC_DATA, Operation::TEST },                          // TEST - immediate and accumulator
+        { "000010dw", Layout::MOD_REG_RM, Operation::OR },                          // OR - reg/memory and register to either
+        { "0000110w", Layout::ACC_DATA, Operation::OR },                            // OR - immediate to accumulator
+        { "001100dw", Layout::MOD_REG_RM, Operation::XOR },                         // XOR - reg/memory and register to either
+        { "0011010w", Layout::ACC_DATA, Operation::XOR },                           // XOR - immediate to accumulator
+
+        // String manipulation
+        { "11110011", Layout::PREFIX, Operation::NONE, Group::NONE, false, false, REP },    // REP/REPE/REPZ
+        { "11110010", Layout::PREFIX, Operation::NONE, Group::NONE, false, false, REPNE },  // REPNE/REPNZ
+        { "1010010w", Layout::STRING, Operation::MOVS },                            // MOVS - move byte/word
+        { "1010011w", Layout::STRING, Operation::CMPS },                            // CMPS - compare byte/word
+        { "1010111w", Layout::STRING, Operation::SCAS },                            // SCAS - scan byte/word
+        { "1010110w", Layout::STRING, Operation::LODS },                            // LODS - load byte/word to al/ax
+        { "1010101w", Layout::STRING, Operation::STOS },                            // STOS - store byte/word from al/ax
+
+        // Control transfer
+        { "11101000", Layout::NEAR_LABEL, Operation::CALL },                        // CALL - direct within segment
+        { "10011010", Layout::FAR_ADDRESS, Operation::CALL },                       // CALL - direct intersegment
+        { "11101001", Layout::NEAR_LABEL, Operation::JMP },                         // JMP - direct within segment
+        { "11101011", Layout::SHORT_LABEL, Operation::JMP },                        // JMP - direct within segment-short
+        { "11101010", Layout::FAR_ADDRESS, Operation::JMP },                        // JMP - direct intersegment
+        { "11000011", Layout::NONE, Operation::RET },                               // RET - within segment
+        { "11000010", Layout::DATA_16, Operation::RET },                            // RET - within segment adding to sp
+        { "11001011", Layout::NONE, Operation::RETF },                              // RET - intersegment
+        { "11001010", Layout::DATA_16, Operation::RETF },                           // RET - intersegment adding to sp
+        { "01110100", Layout::SHORT_LABEL, Operation::JE },                         // JE/JZ - jump on equal zero
+        { "01111100", Layout::SHORT_LABEL, Operation::JL },                         // JL/JNGE - jump on less/not greater or equal
+        { "01111110", Layout::SHORT_LABEL, Operation::JLE },                        // JLE/JNG - jump on less or equal/not greater
+        { "01110010", Layout::SHORT_LABEL, Operation::JB },                         // JB/JNAE - jump on below/not above or equal
+        { "01110110", Layout::SHORT_LABEL, Operation::JBE },                        // JBE/JNA - jump on below or equal/not above
+        { "01111010", Layout::SHORT_LABEL, Operation::JP },                         // JP/JPE - jump on parity/parity even
+        { "01110000", Layout::SHORT_LABEL, Operation::JO },                         // JO - jump on overflow
+        { "01111000", Layout::SHORT_LABEL, Operation::JS },                         // JS - jump on sign
+        { "01110101", Layout::SHORT_LABEL, Operation::JNE },                        // JNE/JNZ - jump on not equal/not zero
+        { "01111101", Layout::SHORT_LABEL, Operation::JNL },                        // JNL/JGE - jump on not less/greater or equal
+        { "01111111", Layout::SHORT_LABEL, Operation::JNLE },                       // JNLE/JG - jump on not less or equal/greater
+        { "01110011", Layout::SHORT_LABEL, Operation::JNB },                        // JNB/JAE - jump on not below/above or equal
+        { "01110111", Layout::SHORT_LABEL, Operation::JNBE },                       // JNBE/JA - jump on not below or equal/above
+        { "01111011", Layout::SHORT_LABEL, Operation::JNP },                        // JNP/JPO - jump on not par/par odd
+        { "01110001", Layout::SHORT_LABEL, Operation::JNO },                        // JNO - jump on not overflow
+        { "01111001", Layout::SHORT_LABEL, Operation::JNS },                        // JNS - jump on not sign
+        { "11100010", Layout::SHORT_LABEL, Operation::LOOP },                       // LOOP - loop CX times
+        { "11100001", Layout::SHORT_LABEL, Operation::LOOPZ },                      // LOOPZ/LOOPE - loop while zero/equal
+        { "11100000", Layout::SHORT_LABEL, Operation::LOOPNZ },                     // LOOPNZ/LOOPNE - loop while not zero/equal
+        { "11100011", Layout::SHORT_LABEL, Operation::JCXZ },                       // JCXZ - jump on CX zero
+        { "11001101", Layout::DATA_8, Operation::INT },                             // INT - type specified
+        { "11001100", Layout::NONE, Operation::INT3 },                              // INT - type 3
+        { "11001110", Layout::NONE, Operation::INTO },                              // INTO - interrupt on overflow
+        { "11001111", Layout::NONE, Operation::IRET },                              // IRET - interrupt return
+
+        // Processor control
+        { "11111000", Layout::NONE, Operation::CLC },                               // CLC - clear carry
+        { "11110101", Layout::NONE, Operation::CMC },                               // CMC - complement carry
+        { "11111001", Layout::NONE, Operation::STC },                               // STC - set carry
+        { "11111100", Layout::NONE, Operation::CLD },                               // CLD - clear direction
+        { "11111101", Layout::NONE, Operation::STD },                               // STD - set direction
+        { "11111010", Layout::NONE, Operation::CLI },                               // CLI - clear interrupt
+        { "11111011", Layout::NONE, Operation::STI },                               // STI - set interrupt
+        { "11110100", Layout::NONE, Operation::HLT },                               // HLT - halt
+        { "10011011", Layout::NONE, Operation::WAIT },                              // WAIT - wait
+        { "11011xxx", Layout::ESCAPE, Operation::ESC },                             // ESC - escape to external device
+        { "11110000", Layout::PREFIX, Operation::NONE, Group::NONE, false, false, LOCK },   // LOCK - bus lock prefix
+        { "001gg110", Layout::PREFIX },                                             // SEGMENT - override prefix
+};
+
+// Value of the field marked by `field` in the bits of the encoding, false if there's no such field
+constexpr bool has_field(const char* bits, const char field) {
+    for (int i = 0; i < 8; i++) if (bits[i] == field) return true;
+    return false;
+}
 
-    // JL/JNGE - jump on less/not greater or equal
-    if (byte == 0b01111100) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jl", get_label(is, label));
-        return decoder::DecodingError::NONE;
+constexpr u8 field_value(const char* bits, const char field, const u8 opcode) {
+    u8 value = 0;
+    for (int i = 0; i < 8; i++) {
+        if (bits[i] == field) value = static_cast<u8>((value << 1) | ((opcode >> (7 - i)) & 1));
     }
+    return value;
+}
 
-    // JLE/JNG - jump on less or equal/not greater
-    if (byte == 0b01111110) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jle", get_label(is, label));
-        return decoder::DecodingError::NONE;
+constexpr bool matches(const char* bits, const u8 opcode) {
+    for (int i = 0; i < 8; i++) {
+        const bool bit = (opcode >> (7 - i)) & 1;
+        if ((bits[i] == '0' && bit) || (bits[i] == '1' && !bit)) return false;
     }
+    return true;
+}
 
-    // JB/JNAE - jump on below/not above or equal
-    if (byte == 0b01110010) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jb", get_label(is, label));
-        return decoder::DecodingError::NONE;
+// Encoding of the opcode, the first matching one wins, this is how NOP takes over xchg ax, ax
+constexpr const encoding* find_encoding(const u8 opcode) {
+    for (const encoding& e : encodings) {
+        if (matches(e.bits, opcode)) return &e;
     }
+    return nullptr;
+}
 
-    // JBE/JNA - jump on below or equal/not above
-    if (byte == 0b01110110) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jbe", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+constexpr bool encoding_w(const encoding& e, const u8 opcode) {
+    return has_field(e.bits, 'w') ? field_value(e.bits, 'w', opcode) : e.word;
+}
 
-    // JP/JPE - jump on parity/parity even
-    if (byte == 0b01111010) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jp", get_label(is, label));
-        return decoder::DecodingError::NONE;
+// d, s or v field, whichever the encoding has
+constexpr bool encoding_d(const encoding& e, const u8 opcode) {
+    bool d = e.d;
+    for (const char field : { 'd', 's', 'v' }) {
+        if (has_field(e.bits, field)) d = field_value(e.bits, field, opcode);
     }
+    return d;
+}
 
-    // JO - jump on overflow
-    if (byte == 0b01110000) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jo", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+constexpr opcode_entry make_opcode_entry(const encoding& e, const u8 opcode) {
+    const size_t index = encoding_w(e, opcode) * 2 + encoding_d(e, opcode);
 
-    // JS - jump on sign
-    if (byte == 0b01111000) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("js", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+    opcode_entry entry { .operation = e.operation, .reg = field_value(e.bits, 'r', opcode) };
+    if (has_field(e.bits, 'g')) entry.reg = field_value(e.bits, 'g', opcode);
 
-    // JNE/JNZ - jump on not equal/not zero
-    if (byte == 0b01110101) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jne", get_label(is, label));
-        return decoder::DecodingError::NONE;
+    if (e.layout == Layout::GROUP) {
+        entry.handler = group_handlers[static_cast<size_t>(e.group) * 4 + index];
+    } else {
+        entry.handler = layout_handlers[static_cast<size_t>(e.layout) * 4 + index];
     }
-
-    // JNL/JGE - jump on not less/greater or equal
-    if (byte == 0b01111101) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jnl", get_label(is, label));
-        return decoder::DecodingError::NONE;
+    if (e.layout == Layout::PREFIX) {
+        entry.prefix = true;
+        // Segment override stores the segment register + 1
+        entry.reg = has_field(e.bits, 'g') ? entry.reg + 1 : e.prefix;
     }
+    return entry;
+}
 
-    // JNLE/JG - jump on not less or equal/greater
-    if (byte == 0b01111111) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jnle", get_label(is, label));
-        return decoder::DecodingError::NONE;
+constexpr std::array<opcode_entry, 256> make_opcode_table() {
+    std::array<opcode_entry, 256> table{};
+    for (size_t opcode = 0; opcode < table.size(); opcode++) {
+        const encoding* e = find_encoding(static_cast<u8>(opcode));
+        table[opcode] = e
+                ? make_opcode_entry(*e, static_cast<u8>(opcode))
+                : opcode_entry { .handler = layout_handlers[static_cast<size_t>(Layout::UNKNOWN) * 4] };
     }
+    return table;
+}
 
-    // JNB/JAE - jump on not below/above or equal
-    if (byte == 0b01110011) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jnb", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+// Maps the first byte of an instruction to the way it should be decoded
+constexpr static std::array<opcode_entry, 256> opcode_table = make_opcode_table();
+
+constexpr opcode_length make_opcode_length(const encoding& e, const u8 opcode) {
+    const u8 data = encoding_w(e, opcode) ? 2 : 1;
+    switch (e.layout) {
+        case Layout::NONE:
+        case Layout::STRING:
+        case Layout::PORT_DX:
+        case Layout::REG:
+        case Layout::XCHG_ACC:
+        case Layout::SEGMENT:
+            return { .length = 1 };
+        case Layout::REG_DATA:
+        case Layout::ACC_DATA:
+            return { .length = static_cast<u8>(1 + data) };
+        case Layout::ACC_ADDRESS:
+        case Layout::NEAR_LABEL:
+        case Layout::DATA_16:
+            return { .length = 3 };
+        case Layout::PORT_DATA:
+        case Layout::SHORT_LABEL:
+        case Layout::DATA_8:
+            return { .length = 2 };
+        case Layout::FAR_ADDRESS:
+            return { .length = 5 };
+        case Layout::MOD_REG_RM:
+        case Layout::MOD_SEGMENT_RM:
+        case Layout::ESCAPE:
+            return { .length = 2, .mod_reg_rm = true };
+        case Layout::GROUP:
+            // Every reg of the immediate group is valid and has the same data, the other groups differ
+            if (e.group == Group::IMMEDIATE) {
+                const bool word_data = encoding_w(e, opcode) && !encoding_d(e, opcode);
+                return { .length = static_cast<u8>(word_data ? 4 : 3), .mod_reg_rm = true };
+            }
+            return { .length = 2, .mod_reg_rm = true, .slow = true };
+        case Layout::PREFIX:
+            return { .length = 1, .slow = true };
+        case Layout::UNKNOWN:
+        case Layout::COUNT:
+            break;
+    }
+    return {};
+}
 
-    // JNBE/JA - jump on not below or equal/above
-    if (byte == 0b01110111) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jnbe", get_label(is, label));
-        return decoder::DecodingError::NONE;
+constexpr std::array<opcode_length, 256> make_length_table() {
+    std::array<opcode_length, 256> table{};
+    for (size_t opcode = 0; opcode < table.size(); opcode++) {
+        const encoding* e = find_encoding(static_cast<u8>(opcode));
+        if (e) table[opcode] = make_opcode_length(*e, static_cast<u8>(opcode));
     }
+    return table;
+}
 
-    // JNP/JPO - jump on not par/par odd
-    if (byte == 0b01111011) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jnp", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+constexpr static std::array<opcode_length, 256> length_table = make_length_table();
 
-    // JNO - jump on not overflow
-    if (byte == 0b01110001) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jno", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+const decoder::opcode_length& decoder::length_of(const u8 opcode) {
+    return length_table[opcode];
+}
 
-    // JNS - jump on not sign
-    if (byte == 0b01111001) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jns", get_label(is, label));
-        return decoder::DecodingError::NONE;
+// Operation of every opcode for every value of the reg field
+constexpr std::array<std::array<Operation, 8>, 256> make_operation_table() {
+    std::array<std::array<Operation, 8>, 256> table{};
+    for (size_t opcode = 0; opcode < table.size(); opcode++) {
+        const encoding* e = find_encoding(static_cast<u8>(opcode));
+        if (!e) continue;
+        for (size_t reg = 0; reg < 8; reg++) {
+            table[opcode][reg] = e->layout == Layout::GROUP
+                    ? group_table[static_cast<size_t>(e->group)][reg].operation
+                    : e->operation;
+        }
     }
+    return table;
+}
 
-    // LOOP - loop CX times
-    if (byte == 0b11100010) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("loop", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+constexpr static std::array<std::array<Operation, 8>, 256> operation_table = make_operation_table();
 
-    // LOOPZ/LOOPE - loop while zero/equal
-    if (byte == 0b11100001) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("loopz", get_label(is, label));
-        return decoder::DecodingError::NONE;
-    }
+Operation decoder::operation_of(const u8 opcode, const u8 mod_reg_rm) {
+    return operation_table[opcode][(mod_reg_rm >> 3) & bits::LOW_3BIT];
+}
 
-    // LOOPNZ/LOOPNE - lopp while zero/equal
-    if (byte == 0b11100000) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("loopnz", get_label(is, label));
-        return decoder::DecodingError::NONE;
+bool decoder::is_control_transfer(const Operation operation) {
+    switch (operation) {
+        case Operation::CALL:
+        case Operation::CALL_FAR:
+        case Operation::JMP:
+        case Operation::JMP_FAR:
+        case Operation::RET:
+        case Operation::RETF:
+        case Operation::INT:
+        case Operation::INT3:
+        case Operation::INTO:
+        case Operation::IRET:
+        case Operation::HLT:
+            return true;
+        default:
+            return is_conditional(operation);
     }
+}
 
-    // JCXZ - jump on CX zero
-    if (byte == 0b11100011) {
-        const i32 label = static_cast<i32>(decode_signed_data(false, is));
-        printer::print_instr_str("jcxz", get_label(is, label));
-        return decoder::DecodingError::NONE;
+decoder::DecodingError decoder::decode(const std::span<const u8> bytes, Instruction* instr) {
+    INSTRUMENT_TIME(DECODE);
+    *instr = Instruction { .mod = MemoryMode::REGISTER_MODE };
+    byte_reader is { .bytes = bytes };
+    const opcode_entry* entry;
+
+    while (true) {
+        if (is.pos >= bytes.size()) return decoder::DecodingError::UNEXPECTED_END;
+        instr->opcode = is.next_byte();
+        entry = &opcode_table[instr->opcode];
+        if (!entry->prefix) break;
+
+        // Instruction can't be longer than MAX_INSTRUCTION_LENGTH, prefixes included
+        if (is.pos >= MAX_INSTRUCTION_LENGTH) return decoder::DecodingError::UNKNOWN_INSTRUCTION;
+        // Later prefix of the same kind replaces the earlier one
+        const u8 kind = entry->reg & SEGMENT_MASK ? SEGMENT_MASK : entry->reg & (REP | REPNE) ? REP | REPNE : 0;
+        instr->prefix = (instr->prefix & ~kind) | entry->reg;
+    }
+
+    instr->operation = entry->operation;
+    const decoder::DecodingError error = entry->handler(is, *entry, instr);
+    if (error != decoder::DecodingError::NONE) return error;
+    if (is.pos > bytes.size()) return decoder::DecodingError::UNEXPECTED_END;
+
+    instr->length = static_cast<u8>(is.pos);
+    INSTRUMENT_INSTRUCTION(*instr);
+    return decoder::DecodingError::NONE;
+}
+
+// Decodes instructions until the end of the program or the first error
+static decoder::DecodingError decode_until_error(const std::span<const u8> program,
+                                                 std::vector<Instruction>& instructions,
+                                                 size_t* pos) {
+    Instruction instr{};
+    for (*pos = 0; *pos < program.size(); *pos += instr.length) {
+        const DecodingError error = decode(program.subspan(*pos), &instr);
+        if (error != DecodingError::NONE) return error;
+        instructions.push_back(instr);
+    }
+    return DecodingError::NONE;
+}
+
+decoder::DecodingError decoder::decode_program(const std::span<const u8> program,
+                                               std::vector<Instruction>& instructions,
+                                               size_t* pos) {
+    // Most of the instructions are 2-4 bytes long
+    instructions.reserve(instructions.size() + program.size() / 3);
+    return decode_until_error(program, instructions, pos);
+}
+
+void decoder::decode_program_resilient(const std::span<const u8> program,
+                                       std::vector<Instruction>& instructions,
+                                       error_summary* summary) {
+    instructions.reserve(instructions.size() + program.size() / 3);
+    size_t start = 0;
+    while (start < program.size()) {
+        size_t pos;
+        const DecodingError error = decode_until_error(program.subspan(start), instructions, &pos);
+        if (error == DecodingError::NONE) break;
+
+        // Resynchronize at the next byte, the failed one is kept as data
+        start += pos;
+        summary->add(error, start);
+        instructions.push_back(Instruction {
+                .opcode = program[start], .operation = Operation::DB, .length = 1,
+                .mod = MemoryMode::REGISTER_MODE, .immediate = program[start]
+        });
+        start += 1;
     }
+}
 
-    return decoder::DecodingError::UNKNOWN_INSTRUCTION;
+i32 decoder::label_table::find(const i64 position) const {
+    return label_view(*this).find(position);
+}
+
+i32 decoder::label_view::find(const i64 position) const {
+    if (position < 0) return -1;
+    const auto it = std::lower_bound(positions.begin(), positions.end(), position);
+    if (it == positions.end() || *it != position) return -1;
+    return name(static_cast<size_t>(it - positions.begin()));
+}
+
+decoder::label_table decoder::find_labels(const std::span<const Instruction> instructions) {
+    std::vector<i64> targets{};
+    size_t pos = 0;
+    for (const Instruction& instr : instructions) {
+        if (instr.dest.kind == OperandKind::RELATIVE) targets.push_back(jump_target(instr, pos));
+        pos += instr.length;
+    }
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+    // Only targets at the beginning of an instruction can be labeled
+    label_table table{};
+    table.positions.reserve(targets.size());
+    auto target = targets.begin();
+    pos = 0;
+    for (size_t i = 0; i <= instructions.size(); i++) {
+        while (target != targets.end() && *target < static_cast<i64>(pos)) ++target;
+        if (target == targets.end()) break;
+        if (*target == static_cast<i64>(pos)) table.positions.push_back(static_cast<u32>(pos));
+        // The end of the program is a valid target as well
+        if (i < instructions.size()) pos += instructions[i].length;
+    }
+    return table;
 }
@@ -5,8 +5,11 @@
 #ifndef VM8086_DECODER_H
 #define VM8086_DECODER_H
 
+#define MAX_INSTRUCTION_LENGTH 15
+
 #include <utils/types.h>
-#include "io.h"
+#include <span>
+#include <vector>
 
 namespace decoder {
 
@@ -29,18 +32,220 @@ namespace decoder {
         const char* rm_pattern() const;
     };
 
+    enum class Operation : u8 {
+        NONE,
+        MOV, ADD, SUB, CMP,
+        JE, JL, JLE, JB, JBE, JP, JO, JS, JNE, JNL, JNLE, JNB, JNBE, JNP, JNO, JNS,
+        LOOP, LOOPZ, LOOPNZ, JCXZ,
+        // Data transfer
+        PUSH, POP, XCHG, IN, OUT, XLAT, LEA, LDS, LES, LAHF, SAHF, PUSHF, POPF,
+        // Arithmetic
+        ADC, INC, AAA, DAA, SBB, DEC, NEG, AAS, DAS, MUL, IMUL, AAM, DIV, IDIV, AAD, CBW, CWD,
+        // Logic
+        NOT, SHL, SHR, SAR, ROL, ROR, RCL, RCR, AND, TEST, OR, XOR,
+        // String manipulation
+        MOVS, CMPS, SCAS, LODS, STOS,
+        // Control transfer
+        CALL, CALL_FAR, JMP, JMP_FAR, RET, RETF, INT, INT3, INTO, IRET,
+        // Processor control
+        CLC, CMC, STC, CLD, STD, CLI, STI, HLT, WAIT, ESC, NOP,
+        // Byte which isn't an instruction, the value is in immediate
+        DB,
+        COUNT
+    };
+
+    inline constexpr const char* operation_name[] = {
+            "none",
+            "mov", "add", "sub", "cmp",
+            "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js", "jne", "jnl", "jnle", "jnb", "jnbe", "jnp", "jno", "jns",
+            "loop", "loopz", "loopnz", "jcxz",
+            "push", "pop", "xchg", "in", "out", "xlatb", "lea", "lds", "les", "lahf", "sahf", "pushf", "popf",
+            "adc", "inc", "aaa", "daa", "sbb", "dec", "neg", "aas", "das", "mul", "imul", "aam", "div", "idiv", "aad",
+            "cbw", "cwd",
+            "not", "shl", "shr", "sar", "rol", "ror", "rcl", "rcr", "and", "test", "or", "xor",
+            "movs", "cmps", "scas", "lods", "stos",
+            "call", "call far", "jmp", "jmp far", "ret", "retf", "int", "int3", "into", "iret",
+            "clc", "cmc", "stc", "cld", "std", "cli", "sti", "hlt", "wait", "esc", "nop",
+            "db",
+    };
+
+    static_assert(sizeof(operation_name) / sizeof(operation_name[0]) == static_cast<size_t>(Operation::COUNT));
+
+    // String instructions are printed with a b/w suffix
+    inline bool is_string(const Operation operation) {
+        return operation >= Operation::MOVS && operation <= Operation::STOS;
+    }
+
+    // Conditional jumps, loops and jcxz continue with the next instruction if they aren't taken
+    inline bool is_conditional(const Operation operation) {
+        return operation >= Operation::JE && operation <= Operation::JCXZ;
+    }
+
+    // Instruction may continue execution somewhere else than at the next instruction
+    bool is_control_transfer(Operation operation);
+
+    enum class OperandKind : u8 {
+        NONE,
+        // reg: register index, size of the register is defined by the instruction
+        REGISTER,
+        // reg: register pattern, address is [pattern + displacement]
+        MEMORY,
+        // address is [displacement]
+        DIRECT_ADDRESS,
+        // value is in immediate
+        IMMEDIATE,
+        // immediate is an offset relative to the end of the instruction
+        RELATIVE,
+        // reg: segment register (es, cs, ss, ds)
+        SEGMENT_REGISTER,
+        // reg: register index, always a byte register (cl for shifts)
+        BYTE_REGISTER,
+        // reg: register index, always a word register (dx for in/out)
+        WORD_REGISTER,
+        // immediate:displacement is the segment:offset of the target
+        FAR,
+    };
+
+    enum Prefix : u8 {
+        // Segment override, 0 if there is none, otherwise segment register + 1
+        SEGMENT_MASK = 0b00000111,
+        LOCK = 1 << 3,
+        REP = 1 << 4,
+        REPNE = 1 << 5,
+    };
+
+    struct Operand {
+        OperandKind kind;
+        u8 reg;
+    };
+
+    /**
+     * Decoded instruction. Contains everything that is required to either print
+     * or execute the instruction without looking at its bytes again.
+     */
+    struct Instruction {
+        u8 opcode;
+        Operation operation;
+        u8 length;
+        bool word;
+        // Addressing mode of the reg/mem operand
+        MemoryMode mod;
+        // Combination of Prefix flags
+        u8 prefix;
+        Operand dest;
+        Operand source;
+        i16 displacement;
+        i16 immediate;
+    };
+
     enum struct DecodingError {
         NONE = 99,
         UNKNOWN_INSTRUCTION = 0,
         UNSUPPORTED_INSTRUCTION_TYPE = 1,
+        UNEXPECTED_END = 2,
     };
 
-    const static char* decoding_error_message[] = {
+    inline constexpr const char* decoding_error_message[] = {
             "Unknown instruction",
-            "This type of instruction is not supported"
+            "This type of instruction is not supported",
+            "Unexpected end of the instruction stream"
     };
 
-    DecodingError decode(io::input_stream &is);
+    /**
+     * Decodes a single instruction which starts at the first byte of the provided span.
+     */
+    DecodingError decode(std::span<const u8> bytes, Instruction* instr);
+
+    /**
+     * Decoding errors which were skipped by decode_program_resilient.
+     */
+    struct error_summary {
+        struct skipped {
+            u32 pos;
+            DecodingError error;
+        };
+
+        // Indexed by the error
+        u64 counts[3]{};
+        std::vector<skipped> errors{};
+
+        void add(const DecodingError error, const size_t pos) {
+            counts[static_cast<int>(error)] += 1;
+            errors.push_back({ static_cast<u32>(pos), error });
+        }
+    };
+
+    /**
+     * Same as decode_program, but a byte which fails to decode becomes a DB instruction and decoding
+     * continues with the next byte. Clean programs go through the same loop as decode_program.
+     */
+    void decode_program_resilient(std::span<const u8> program, std::vector<Instruction>& instructions, error_summary* summary);
+
+    /**
+     * What the length of an instruction depends on, derived from the encoding of its first byte.
+     * The full length is `length` plus the displacement selected by the mod and rm fields.
+     */
+    struct opcode_length {
+        // Opcode, mod reg rm and data bytes, 0 if the opcode is unknown
+        u8 length;
+        // Second byte is mod reg rm, it may be followed by a displacement
+        bool mod_reg_rm;
+        // Length or validity depends on more than the first two bytes: prefixes and groups
+        // selected by reg, such instructions have to be decoded to know their length
+        bool slow;
+    };
+
+    const opcode_length& length_of(u8 opcode);
+
+    // Operation of the instruction without decoding it, the second byte only matters for groups.
+    // NONE for unknown opcodes, prefixes and invalid group forms
+    Operation operation_of(u8 opcode, u8 mod_reg_rm);
+
+    /**
+     * Decodes the whole program into a flat array of instructions. Stops on the first error,
+     * in this case `pos` is the position of the instruction that failed to decode.
+     */
+    DecodingError decode_program(std::span<const u8> program, std::vector<Instruction>& instructions, size_t* pos);
+
+    /**
+     * Sorted label positions which are owned by someone else: a label_table or a mapped cache file.
+     */
+    struct label_view {
+        std::span<const u32> positions{};
+        // Numbers of the labels in the order of the positions, empty if labels are numbered by their index
+        std::span<const u32> names{};
+
+        // Number of the label at the position or -1 if there is no label
+        i32 find(i64 position) const;
+
+        // Number of the label with the index, "label_<number>"
+        i32 name(const size_t index) const {
+            return static_cast<i32>(names.empty() ? index : names[index]);
+        }
+    };
+
+    /**
+     * Jump targets that point to the beginning of an instruction, sorted by position.
+     * Label is named after its index in the table: "label_<index>", unless it has a name.
+     */
+    struct label_table {
+        std::vector<u32> positions{};
+        std::vector<u32> names{};
+
+        // Number of the label at the position or -1 if there is no label
+        i32 find(i64 position) const;
+
+        operator label_view() const {
+            return { positions, names };
+        }
+    };
+
+    label_table find_labels(std::span<const Instruction> instructions);
+
+    // Position the relative operand of the instruction points to
+    inline i64 jump_target(const Instruction& instr, const size_t pos) {
+        return static_cast<i64>(pos) + instr.length + instr.immediate;
+    }
 
 }
 
@@ -0,0 +1,214 @@
+#include "flow.h"
+#include <algorithm>
+using namespace flow;
+using decoder::DecodingError;
+using decoder::Instruction;
+using decoder::Operation;
+
+// Execution never continues with the next instruction
+static bool ends_path(const Operation operation) {
+    switch (operation) {
+        case Operation::JMP:
+        case Operation::JMP_FAR:
+        case Operation::RET:
+        case Operation::RETF:
+        case Operation::IRET:
+        case Operation::HLT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// One bit per byte of the program
+struct byte_set {
+    std::vector<u64> bits;
+
+    explicit byte_set(const size_t size): bits((size + 63) / 64) {}
+
+    bool test(const size_t pos) const {
+        return (bits[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    void set(const size_t pos) {
+        bits[pos / 64] |= u64{1} << (pos % 64);
+    }
+};
+
+struct located {
+    u32 pos;
+    Instruction instr;
+};
+
+i32 flow::graph::find_block(const i64 pos) const {
+    const auto it = std::lower_bound(blocks.begin(), blocks.end(), pos, [](const basic_block& b, const i64 p) {
+        return b.begin < p;
+    });
+    if (it == blocks.end() || it->begin != pos) return -1;
+    return static_cast<i32>(it - blocks.begin());
+}
+
+graph flow::build(const std::span<const u8> program, const u32 entry) {
+    graph g{};
+    byte_set visited{program.size()};
+    byte_set leaders{program.size()};
+    std::vector<located> found{};
+    std::vector<u32> worklist{};
+
+    const auto push = [&](const i64 target) {
+        if (target < 0 || target >= static_cast<i64>(program.size())) return;
+        leaders.set(target);
+        worklist.push_back(static_cast<u32>(target));
+    };
+    push(entry);
+
+    while (!worklist.empty()) {
+        u32 pos = worklist.back();
+        worklist.pop_back();
+
+        // Linear sweep until the path ends or reaches code which was already decoded
+        while (pos < program.size() && !visited.test(pos)) {
+            Instruction instr{};
+            const DecodingError error = decoder::decode(program.subspan(pos), &instr);
+            if (error != DecodingError::NONE) {
+                g.errors.push_back({ pos, error });
+                break;
+            }
+
+            bool overlaps = false;
+            for (u32 i = 1; i < instr.length; i++) overlaps |= visited.test(pos + i);
+            if (overlaps) break;
+            for (u32 i = 0; i < instr.length; i++) visited.set(pos + i);
+
+            found.push_back({ pos, instr });
+            if (instr.dest.kind == decoder::OperandKind::RELATIVE) push(decoder::jump_target(instr, pos));
+            if (ends_path(instr.operation)) break;
+            pos += instr.length;
+        }
+    }
+
+    std::sort(found.begin(), found.end(), [](const located& a, const located& b) { return a.pos < b.pos; });
+    std::sort(g.errors.begin(), g.errors.end(), [](const error& a, const error& b) { return a.pos < b.pos; });
+    g.errors.erase(std::unique(g.errors.begin(), g.errors.end(), [](const error& a, const error& b) {
+        return a.pos == b.pos;
+    }), g.errors.end());
+
+    g.positions.reserve(found.size());
+    g.instructions.reserve(found.size());
+    for (u32 i = 0; i < found.size(); i++) {
+        const located& l = found[i];
+        // Block starts at a jump target, after a control transfer and after a gap
+        const bool starts = i == 0
+                || leaders.test(l.pos)
+                || decoder::is_control_transfer(found[i - 1].instr.operation)
+                || found[i - 1].pos + found[i - 1].instr.length != l.pos;
+        if (starts) g.blocks.push_back(basic_block { .begin = l.pos, .first = i });
+
+        basic_block& block = g.blocks.back();
+        block.end = l.pos + l.instr.length;
+        block.last = i + 1;
+        g.positions.push_back(l.pos);
+        g.instructions.push_back(l.instr);
+    }
+
+    for (u32 b = 0; b < g.blocks.size(); b++) {
+        const basic_block& block = g.blocks[b];
+        const Instruction& instr = g.instructions[block.last - 1];
+        const u32 pos = g.positions[block.last - 1];
+
+        if (instr.dest.kind == decoder::OperandKind::RELATIVE) {
+            const i32 target = g.find_block(decoder::jump_target(instr, pos));
+            const EdgeKind kind = instr.operation == Operation::CALL ? EdgeKind::CALL : EdgeKind::TAKEN;
+            if (target >= 0) g.edges.push_back({ b, static_cast<u32>(target), kind });
+        }
+        if (!ends_path(instr.operation)) {
+            const i32 next = g.find_block(block.end);
+            if (next >= 0) g.edges.push_back({ b, static_cast<u32>(next), EdgeKind::FALLTHROUGH });
+        }
+    }
+    return g;
+}
+
+decoder::label_table flow::find_labels(const graph& g) {
+    std::vector<i64> targets{};
+    for (size_t i = 0; i < g.instructions.size(); i++) {
+        const Instruction& instr = g.instructions[i];
+        if (instr.dest.kind == decoder::OperandKind::RELATIVE) targets.push_back(decoder::jump_target(instr, g.positions[i]));
+    }
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+    // Only targets at the beginning of a reachable instruction can be labeled
+    decoder::label_table table{};
+    for (const i64 target : targets) {
+        if (std::binary_search(g.positions.begin(), g.positions.end(), target)) {
+            table.positions.push_back(static_cast<u32>(target));
+        }
+    }
+    return table;
+}
+
+// db lines for the bytes [from, to)
+static void print_gap(printer::writer& out, const std::span<const u8> program, size_t from, const size_t to) {
+    for (; from < to; from += FLOW_DATA_LINE) {
+        printer::print_data(out, program.subspan(from, std::min<size_t>(FLOW_DATA_LINE, to - from)));
+    }
+}
+
+void flow::print_program(printer::writer& out,
+                         const std::span<const u8> program,
+                         const graph& g,
+                         const decoder::label_table& labels) {
+    const std::span<const Instruction> instructions = g.instructions;
+    size_t pos = 0;
+    for (const basic_block& block : g.blocks) {
+        print_gap(out, program, pos, block.begin);
+        pos = printer::print_instructions(out, instructions.subspan(block.first, block.last - block.first), labels, block.begin);
+    }
+    print_gap(out, program, pos, program.size());
+}
+
+// block_<index>
+static void print_block_name(printer::writer& out, const u32 block) {
+    out.write("block_", 6);
+    out.unsigned_integer(block);
+}
+
+void flow::print_graph(printer::writer& out, const graph& g) {
+    out.line();
+    out.write("; Control flow graph: ", 22);
+    out.unsigned_integer(g.blocks.size());
+    out.write(" blocks, ", 9);
+    out.unsigned_integer(g.edges.size());
+    out.write(" edges\n", 7);
+
+    auto e = g.edges.begin();
+    for (u32 b = 0; b < g.blocks.size(); b++) {
+        out.line();
+        out.write("; ", 2);
+        print_block_name(out, b);
+        out.write(": [", 3);
+        out.unsigned_integer(g.blocks[b].begin);
+        out.write(", ", 2);
+        out.unsigned_integer(g.blocks[b].end);
+        out.put(')');
+
+        for (bool first = true; e != g.edges.end() && e->from == b; ++e, first = false) {
+            out.line();
+            out.write(first ? " -> " : ", ", first ? 4 : 2);
+            print_block_name(out, e->to);
+            out.put(' ');
+            out.str(edge_kind_name[static_cast<u8>(e->kind)]);
+        }
+        out.put('\n');
+    }
+
+    for (const error& err : g.errors) {
+        out.line();
+        out.write("; Decoding failed at ", 21);
+        out.unsigned_integer(err.pos);
+        out.write(": ", 2);
+        out.str(decoder::decoding_error_message[static_cast<int>(err.error)]);
+        out.put('\n');
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef VM8086_FLOW_H
+#define VM8086_FLOW_H
+
+// Bytes of unreachable data printed on a single db line
+#define FLOW_DATA_LINE 16
+
+#include <utils/types.h>
+#include <span>
+#include <vector>
+#include "decoder.h"
+#include "printer.h"
+
+namespace flow {
+
+    enum class EdgeKind : u8 {
+        // Execution continues with the next instruction
+        FALLTHROUGH,
+        // Jump, loop or conditional jump is taken
+        TAKEN,
+        // Near call, the callee returns to the fallthrough block
+        CALL,
+    };
+
+    inline constexpr const char* edge_kind_name[] = { "fallthrough", "taken", "call" };
+
+    struct edge {
+        // Indices of the blocks
+        u32 from;
+        u32 to;
+        EdgeKind kind;
+    };
+
+    /**
+     * Instructions which are always executed together: only the first one is a jump target
+     * and only the last one transfers control.
+     */
+    struct basic_block {
+        // Bytes of the block in the program [begin, end)
+        u32 begin;
+        u32 end;
+        // Instructions of the block in the graph [first, last)
+        u32 first;
+        u32 last;
+    };
+
+    // Reachable instruction that failed to decode
+    struct error {
+        u32 pos;
+        decoder::DecodingError error;
+    };
+
+    /**
+     * Reachable instructions of the program in the order of their positions, grouped into basic blocks.
+     */
+    struct graph {
+        std::vector<u32> positions{};
+        std::vector<decoder::Instruction> instructions{};
+        std::vector<basic_block> blocks{};
+        // Sorted by the source block
+        std::vector<edge> edges{};
+        std::vector<error> errors{};
+
+        // Index of the block which starts at the position or -1
+        i32 find_block(i64 pos) const;
+    };
+
+    /**
+     * Decodes only the instructions reachable from the entry point. Targets of relative jumps,
+     * loops and calls are added to a worklist, and every byte is decoded at most once, so data
+     * between the code is never touched. Jumps to the middle of a decoded instruction are ignored.
+     */
+    graph build(std::span<const u8> program, u32 entry);
+
+    // Jump targets which are reachable instructions, the same labels as for the linear sweep
+    decoder::label_table find_labels(const graph& g);
+
+    /**
+     * Prints the reachable instructions with their labels. Bytes which weren't reached are printed
+     * as data, so the output is assembled back into the same program.
+     */
+    void print_program(printer::writer& out, std::span<const u8> program, const graph& g, const decoder::label_table& labels);
+
+    // ; block_<index>: [<begin>, <end>) -> block_<index> <kind>, ...
+    void print_graph(printer::writer& out, const graph& g);
+
+}
+
+#endif //VM8086_FLOW_H
@@ -0,0 +1,528 @@
+#include "format.h"
+#include <cstring>
+#include <string>
+using namespace format;
+using decoder::Instruction;
+using decoder::Operand;
+using decoder::OperandKind;
+using decoder::Operation;
+
+constexpr fragment frag(const char* data) {
+    return { data, static_cast<u8>(std::char_traits<char>::length(data)) };
+}
+
+// Segment override as a separate prefix, the same in every syntax
+const static fragment prefix_segments[] = { frag("es"), frag("cs"), frag("ss"), frag("ds") };
+
+// Mnemonic of the operation in the syntax
+static const char* mnemonic(const syntax& s, const Operation operation) {
+    const char* name = s.mnemonics[static_cast<size_t>(operation)];
+    return name ? name : decoder::operation_name[static_cast<size_t>(operation)];
+}
+
+static syntax make_nasm() {
+    syntax s {
+            .id = Syntax::NASM,
+            .byte_registers = { frag("al"), frag("cl"), frag("dl"), frag("bl"), frag("ah"), frag("ch"), frag("dh"), frag("bh") },
+            .word_registers = { frag("ax"), frag("cx"), frag("dx"), frag("bx"), frag("sp"), frag("bp"), frag("si"), frag("di") },
+            .segments = { frag("es"), frag("cs"), frag("ss"), frag("ds") },
+            .patterns = {
+                    frag("bx + si"), frag("bx + di"), frag("bp + si"), frag("bp + di"),
+                    frag("si"), frag("di"), frag("bp"), frag("bx")
+            },
+            .word_size = frag("word "),
+            .byte_size = frag("byte "),
+            // Far operations have "far" in their name
+            .dword_size = frag(""),
+            .immediate = frag(""),
+            .here = frag("$"),
+            .indirect = frag(""),
+            .mnemonics = {},
+            .att = false,
+    };
+    return s;
+}
+
+static syntax make_masm() {
+    syntax s = make_nasm();
+    s.id = Syntax::MASM;
+    s.word_size = frag("word ptr ");
+    s.byte_size = frag("byte ptr ");
+    s.dword_size = frag("dword ptr ");
+    s.mnemonics[static_cast<size_t>(Operation::CALL_FAR)] = "call";
+    s.mnemonics[static_cast<size_t>(Operation::JMP_FAR)] = "jmp";
+    return s;
+}
+
+static syntax make_att() {
+    syntax s {
+            .id = Syntax::ATT,
+            .byte_registers = {
+                    frag("%al"), frag("%cl"), frag("%dl"), frag("%bl"), frag("%ah"), frag("%ch"), frag("%dh"), frag("%bh")
+            },
+            .word_registers = {
+                    frag("%ax"), frag("%cx"), frag("%dx"), frag("%bx"), frag("%sp"), frag("%bp"), frag("%si"), frag("%di")
+            },
+            .segments = { frag("%es"), frag("%cs"), frag("%ss"), frag("%ds") },
+            .patterns = {
+                    frag("%bx,%si"), frag("%bx,%di"), frag("%bp,%si"), frag("%bp,%di"),
+                    frag("%si"), frag("%di"), frag("%bp"), frag("%bx")
+            },
+            // Size is a suffix of the mnemonic
+            .word_size = frag(""),
+            .byte_size = frag(""),
+            .dword_size = frag(""),
+            .immediate = frag("$"),
+            .here = frag("."),
+            .indirect = frag("*"),
+            .mnemonics = {},
+            .att = true,
+    };
+    s.mnemonics[static_cast<size_t>(Operation::CALL_FAR)] = "lcall";
+    s.mnemonics[static_cast<size_t>(Operation::JMP_FAR)] = "ljmp";
+    s.mnemonics[static_cast<size_t>(Operation::RETF)] = "lret";
+    s.mnemonics[static_cast<size_t>(Operation::CBW)] = "cbtw";
+    s.mnemonics[static_cast<size_t>(Operation::CWD)] = "cwtd";
+    s.mnemonics[static_cast<size_t>(Operation::DB)] = ".byte";
+    return s;
+}
+
+static syntax make_json() {
+    // Names of the registers are shared with NASM, the rest of the line is built by the JSON renderer
+    syntax s = make_nasm();
+    s.id = Syntax::JSON;
+    return s;
+}
+
+const static syntax syntaxes[] = { make_nasm(), make_masm(), make_att(), make_json() };
+
+const syntax& format::get(const Syntax id) {
+    return syntaxes[static_cast<size_t>(id)];
+}
+
+bool format::find_syntax(const char* name, Syntax* syntax) {
+    for (size_t i = 0; i < static_cast<size_t>(Syntax::COUNT); i++) {
+        if (std::strcmp(name, syntax_name[i]) == 0) {
+            *syntax = static_cast<Syntax>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t format::unsigned_integer(u64 value, char* buffer) {
+    char digits[20];
+    char* end = digits + sizeof(digits);
+    char* begin = end;
+
+    do {
+        *--begin = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    std::memcpy(buffer, begin, end - begin);
+    return end - begin;
+}
+
+size_t format::integer(const i32 value, char* buffer) {
+    if (value >= 0) return unsigned_integer(static_cast<u32>(value), buffer);
+    buffer[0] = '-';
+    return 1 + unsigned_integer(0u - static_cast<u32>(value), buffer + 1);
+}
+
+size_t format::hex(u32 value, const int digits, char* buffer) {
+    const static char hex_digits[] = "0123456789abcdef";
+    char result[8];
+    char* end = result + sizeof(result);
+    char* begin = end;
+
+    do {
+        *--begin = hex_digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0 || end - begin < digits);
+
+    std::memcpy(buffer, begin, end - begin);
+    return end - begin;
+}
+
+// Caller-provided buffer which is filled from the beginning
+struct line {
+    char* data;
+    size_t size = 0;
+
+    void put(const char c) {
+        data[size++] = c;
+    }
+
+    void write(const char* str, const size_t length) {
+        std::memcpy(data + size, str, length);
+        size += length;
+    }
+
+    void write(const fragment f) {
+        write(f.data, f.size);
+    }
+
+    void str(const char* str) {
+        write(str, std::strlen(str));
+    }
+
+    void integer(const i32 value) {
+        size += format::integer(value, data + size);
+    }
+
+    void unsigned_integer(const u64 value) {
+        size += format::unsigned_integer(value, data + size);
+    }
+
+    void hex(const u32 value, const int digits) {
+        size += format::hex(value, digits, data + size);
+    }
+};
+
+static bool is_memory(const Operand& operand) {
+    return operand.kind == OperandKind::MEMORY || operand.kind == OperandKind::DIRECT_ADDRESS;
+}
+
+static bool is_far(const Operation operation) {
+    return operation == Operation::CALL_FAR || operation == Operation::JMP_FAR;
+}
+
+// Size of a memory operand can't be inferred from an immediate or from the shift count
+static bool needs_size(const Instruction& instr, const Operand& other) {
+    if (other.kind == OperandKind::REGISTER || other.kind == OperandKind::SEGMENT_REGISTER) return false;
+    return !is_far(instr.operation) && instr.operation != Operation::ESC;
+}
+
+static const fragment& register_name(const syntax& s, const bool word, const u8 reg) {
+    return word ? s.word_registers[reg] : s.byte_registers[reg];
+}
+
+// <sign> <disp: int>
+static void print_displacement(line& l, const i32 displacement) {
+    if (displacement > 0) {
+        l.write(" + ", 3);
+        l.integer(displacement);
+    } else if (displacement < 0) {
+        l.write(" - ", 3);
+        l.integer(-displacement);
+    }
+}
+
+// NASM: [<segment>:<pattern> + <disp>], MASM: <segment>:[<pattern> + <disp>]
+static void print_intel_memory(line& l, const syntax& s, const Instruction& instr, const Operand& operand) {
+    const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+    const bool direct = operand.kind == OperandKind::DIRECT_ADDRESS;
+    if (s.id == Syntax::MASM && (segment || direct)) {
+        // MASM reads [<number>] as an immediate, direct addresses always get a segment
+        l.write(s.segments[segment ? segment - 1 : 3]);
+        l.put(':');
+    }
+    l.put('[');
+    if (s.id != Syntax::MASM && segment) {
+        l.write(s.segments[segment - 1]);
+        l.put(':');
+    }
+    if (direct) {
+        l.unsigned_integer(static_cast<u16>(instr.displacement));
+    } else {
+        l.write(s.patterns[operand.reg]);
+        print_displacement(l, instr.displacement);
+    }
+    l.put(']');
+}
+
+// <segment>:<disp>(<base>,<index>) or <segment>:<address>
+static void print_att_memory(line& l, const syntax& s, const Instruction& instr, const Operand& operand) {
+    const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+    if (segment) {
+        l.write(s.segments[segment - 1]);
+        l.put(':');
+    }
+    if (operand.kind == OperandKind::DIRECT_ADDRESS) {
+        l.unsigned_integer(static_cast<u16>(instr.displacement));
+        return;
+    }
+    if (instr.displacement != 0) l.integer(instr.displacement);
+    l.put('(');
+    l.write(s.patterns[operand.reg]);
+    l.put(')');
+}
+
+static void print_operand(line& l,
+                          const syntax& s,
+                          const Instruction& instr,
+                          const Operand& operand,
+                          const Operand& other,
+                          const i32 label) {
+    switch (operand.kind) {
+        case OperandKind::RELATIVE:
+            if (label >= 0) {
+                l.write("label_", 6);
+                l.integer(label);
+            } else {
+                // Offset from the beginning of the current instruction
+                const i32 offset = instr.length + instr.immediate;
+                l.write(s.here);
+                l.put(offset < 0 ? '-' : '+');
+                l.integer(offset < 0 ? -offset : offset);
+            }
+            break;
+
+        case OperandKind::REGISTER:
+            l.write(register_name(s, instr.word, operand.reg));
+            break;
+
+        case OperandKind::BYTE_REGISTER:
+        case OperandKind::WORD_REGISTER:
+            l.write(register_name(s, operand.kind == OperandKind::WORD_REGISTER, operand.reg));
+            break;
+
+        case OperandKind::SEGMENT_REGISTER:
+            l.write(s.segments[operand.reg]);
+            break;
+
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS:
+            if (is_far(instr.operation)) l.write(s.dword_size);
+            else if (needs_size(instr, other)) l.write(instr.word ? s.word_size : s.byte_size);
+            if (s.att) print_att_memory(l, s, instr, operand);
+            else print_intel_memory(l, s, instr, operand);
+            break;
+
+        case OperandKind::IMMEDIATE:
+            l.write(s.immediate);
+            l.integer(instr.immediate);
+            break;
+
+        // <segment>:<offset>, AT&T has them as two immediates
+        case OperandKind::FAR:
+            l.write(s.immediate);
+            l.unsigned_integer(static_cast<u16>(instr.immediate));
+            if (s.att) l.write(", ", 2);
+            else l.put(':');
+            l.write(s.immediate);
+            l.unsigned_integer(static_cast<u16>(instr.displacement));
+            break;
+
+        case OperandKind::NONE:
+            break;
+    }
+}
+
+static size_t text_instruction(const syntax& s, const Instruction& instr, const i32 label, char* buffer) {
+    const Operand& dest = instr.dest;
+    const Operand& source = instr.source;
+    line l { .data = buffer };
+
+    if (instr.operation == Operation::DB) {
+        l.str(mnemonic(s, instr.operation));
+        l.write(" 0x", 3);
+        l.hex(static_cast<u8>(instr.immediate), 2);
+        return l.size;
+    }
+    if (instr.prefix) {
+        if (instr.prefix & decoder::LOCK) l.write("lock ", 5);
+        if (instr.prefix & decoder::REPNE) l.write("repne ", 6);
+        if (instr.prefix & decoder::REP) {
+            // Compare and scan stop on a mismatch, REP means REPE for them
+            const bool compares = instr.operation == Operation::CMPS || instr.operation == Operation::SCAS;
+            if (compares) l.write("repe ", 5);
+            else l.write("rep ", 4);
+        }
+        // Segment override of an instruction without memory operand, string instructions use it for the source
+        const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+        if (segment && !is_memory(dest) && !is_memory(source)) {
+            l.write(prefix_segments[segment - 1]);
+            l.put(' ');
+        }
+    }
+
+    // Direct far jumps and calls are ljmp and lcall
+    if (s.att && dest.kind == OperandKind::FAR) l.put('l');
+    l.str(mnemonic(s, instr.operation));
+    if (decoder::is_string(instr.operation)) l.put(instr.word ? 'w' : 'b');
+    if (dest.kind == OperandKind::NONE) return l.size;
+
+    // AT&T has the size of a memory operand as a suffix of the mnemonic
+    if (s.att && ((is_memory(dest) && needs_size(instr, source)) || (is_memory(source) && needs_size(instr, dest)))) {
+        l.put(instr.word ? 'w' : 'b');
+    }
+    l.put(' ');
+
+    const bool jumps = instr.operation == Operation::CALL || instr.operation == Operation::JMP || is_far(instr.operation);
+    if (jumps && dest.kind != OperandKind::RELATIVE && dest.kind != OperandKind::FAR) l.write(s.indirect);
+
+    const bool reversed = s.att && source.kind != OperandKind::NONE;
+    const Operand& first = reversed ? source : dest;
+    const Operand& second = reversed ? dest : source;
+    print_operand(l, s, instr, first, second, label);
+    if (second.kind == OperandKind::NONE) return l.size;
+
+    l.write(", ", 2);
+    print_operand(l, s, instr, second, first, label);
+    return l.size;
+}
+
+// "<name>":
+static void json_key(line& l, const char* name) {
+    l.put('"');
+    l.str(name);
+    l.write("\":", 2);
+}
+
+// "<name>":"<value>"
+static void json_string(line& l, const char* name, const fragment value) {
+    json_key(l, name);
+    l.put('"');
+    l.write(value);
+    l.put('"');
+}
+
+static void json_operand(line& l, const syntax& s, const Instruction& instr, const Operand& operand, const i32 label, const size_t pos) {
+    l.put('{');
+    switch (operand.kind) {
+        case OperandKind::RELATIVE: {
+            json_string(l, "type", frag("rel"));
+            l.put(',');
+            json_key(l, "target");
+            // Jumps near the beginning of the program may target negative positions
+            const i64 target = decoder::jump_target(instr, pos);
+            if (target < 0) l.put('-');
+            l.unsigned_integer(target < 0 ? -static_cast<u64>(target) : static_cast<u64>(target));
+            if (label >= 0) {
+                l.write(",\"label\":\"label_", 16);
+                l.integer(label);
+                l.put('"');
+            }
+            break;
+        }
+
+        case OperandKind::REGISTER:
+        case OperandKind::BYTE_REGISTER:
+        case OperandKind::WORD_REGISTER: {
+            const bool word = operand.kind == OperandKind::REGISTER ? instr.word : operand.kind == OperandKind::WORD_REGISTER;
+            json_string(l, "type", frag("reg"));
+            l.put(',');
+            json_string(l, "name", register_name(s, word, operand.reg));
+            break;
+        }
+
+        case OperandKind::SEGMENT_REGISTER:
+            json_string(l, "type", frag("sreg"));
+            l.put(',');
+            json_string(l, "name", s.segments[operand.reg]);
+            break;
+
+        case OperandKind::MEMORY:
+            json_string(l, "type", frag("mem"));
+            l.put(',');
+            json_string(l, "base", s.patterns[operand.reg]);
+            l.put(',');
+            json_key(l, "disp");
+            l.integer(instr.displacement);
+            break;
+
+        case OperandKind::DIRECT_ADDRESS:
+            json_string(l, "type", frag("mem"));
+            l.put(',');
+            json_key(l, "address");
+            l.unsigned_integer(static_cast<u16>(instr.displacement));
+            break;
+
+        case OperandKind::IMMEDIATE:
+            json_string(l, "type", frag("imm"));
+            l.put(',');
+            json_key(l, "value");
+            l.integer(instr.immediate);
+            break;
+
+        case OperandKind::FAR:
+            json_string(l, "type", frag("far"));
+            l.put(',');
+            json_key(l, "segment");
+            l.unsigned_integer(static_cast<u16>(instr.immediate));
+            l.put(',');
+            json_key(l, "offset");
+            l.unsigned_integer(static_cast<u16>(instr.displacement));
+            break;
+
+        case OperandKind::NONE:
+            break;
+    }
+    l.put('}');
+}
+
+// {"pos":<pos>,"length":<length>,"op":"<name>","word":<bool>,"prefixes":[...],"segment":"<segment>","operands":[...]}
+static size_t json_instruction(const syntax& s, const Instruction& instr, const i32 label, const size_t pos, char* buffer) {
+    line l { .data = buffer };
+    l.put('{');
+    json_key(l, "pos");
+    l.unsigned_integer(pos);
+    l.put(',');
+    json_key(l, "length");
+    l.unsigned_integer(instr.length);
+    l.put(',');
+    json_string(l, "op", frag(decoder::operation_name[static_cast<size_t>(instr.operation)]));
+    l.put(',');
+    json_key(l, "word");
+    if (instr.word) l.write("true", 4);
+    else l.write("false", 5);
+
+    if (instr.prefix & (decoder::LOCK | decoder::REP | decoder::REPNE)) {
+        l.write(",\"prefixes\":[", 13);
+        bool first = true;
+        const auto prefix = [&](const u8 flag, const fragment name) {
+            if (!(instr.prefix & flag)) return;
+            if (!first) l.put(',');
+            first = false;
+            l.put('"');
+            l.write(name);
+            l.put('"');
+        };
+        prefix(decoder::LOCK, frag("lock"));
+        prefix(decoder::REPNE, frag("repne"));
+        prefix(decoder::REP, frag("rep"));
+        l.put(']');
+    }
+    const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+    if (segment) {
+        l.put(',');
+        json_string(l, "segment", s.segments[segment - 1]);
+    }
+
+    l.write(",\"operands\":[", 13);
+    if (instr.operation == Operation::DB) {
+        // Value of the byte is in the immediate
+        json_operand(l, s, instr, Operand { .kind = OperandKind::IMMEDIATE }, label, pos);
+    } else if (instr.dest.kind != OperandKind::NONE) {
+        json_operand(l, s, instr, instr.dest, label, pos);
+        if (instr.source.kind != OperandKind::NONE) {
+            l.put(',');
+            json_operand(l, s, instr, instr.source, label, pos);
+        }
+    }
+    l.write("]}", 2);
+    return l.size;
+}
+
+size_t format::instruction(const syntax& s, const Instruction& instr, const i32 label, const size_t pos, char* buffer) {
+    if (s.id == Syntax::JSON) return json_instruction(s, instr, label, pos, buffer);
+    return text_instruction(s, instr, label, buffer);
+}
+
+size_t format::label(const syntax& s, const i32 label, const size_t pos, char* buffer) {
+    line l { .data = buffer };
+    if (s.id == Syntax::JSON) {
+        l.write("{\"label\":\"label_", 16);
+        l.integer(label);
+        l.write("\",\"pos\":", 8);
+        l.unsigned_integer(pos);
+        l.put('}');
+    } else {
+        l.write("label_", 6);
+        l.integer(label);
+        l.put(':');
+    }
+    return l.size;
+}
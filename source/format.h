@@ -0,0 +1,84 @@
+#ifndef VM8086_FORMAT_H
+#define VM8086_FORMAT_H
+
+// Longest line any syntax renders, instruction or label
+#define FORMAT_MAX_LINE 240
+
+#include <utils/types.h>
+#include "decoder.h"
+
+namespace format {
+
+    enum class Syntax : u8 {
+        // Default syntax, assembled back into the same program by NASM
+        NASM,
+        // Intel syntax of MASM: word ptr, segment override in front of the brackets
+        MASM,
+        // GNU as: % registers, $ immediates, reversed operands, size suffixes
+        ATT,
+        // One JSON object per line
+        JSON,
+        COUNT
+    };
+
+    inline constexpr const char* syntax_name[] = { "nasm", "masm", "att", "json" };
+
+    static_assert(sizeof(syntax_name) / sizeof(syntax_name[0]) == static_cast<size_t>(Syntax::COUNT));
+
+    // Syntax with the name or false if there is no such syntax
+    bool find_syntax(const char* name, Syntax* syntax);
+
+    struct fragment {
+        const char* data;
+        u8 size;
+    };
+
+    /**
+     * Everything that differs between the text syntaxes, rendering itself is shared.
+     */
+    struct syntax {
+        Syntax id;
+        fragment byte_registers[8];
+        fragment word_registers[8];
+        fragment segments[4];
+        // Base and index registers of a memory operand, selected by rm
+        fragment patterns[8];
+        // In front of a memory operand whose size can't be inferred, empty if the size is a suffix
+        fragment word_size;
+        fragment byte_size;
+        fragment dword_size;
+        // In front of immediate operands
+        fragment immediate;
+        // Beginning of the current instruction in relative operands without a label
+        fragment here;
+        // In front of the operand of an indirect jump or call
+        fragment indirect;
+        // Mnemonics which differ from decoder::operation_name, nullptr otherwise
+        const char* mnemonics[static_cast<size_t>(decoder::Operation::COUNT)];
+        // Source is printed first, memory operand is disp(base,index)
+        bool att;
+    };
+
+    const syntax& get(Syntax id);
+
+    /**
+     * Renders the instruction without the line break into the buffer, which has to hold at least
+     * FORMAT_MAX_LINE bytes. `label` is the index of the label for instructions with a relative
+     * operand, or negative. Returns the length of the rendered instruction.
+     */
+    size_t instruction(const syntax& s, const decoder::Instruction& instr, i32 label, size_t pos, char* buffer);
+
+    // Same as instruction, but for the label at the position, without the line break
+    size_t label(const syntax& s, i32 label, size_t pos, char* buffer);
+
+    // Decimal number, returns the number of characters
+    size_t unsigned_integer(u64 value, char* buffer);
+
+    size_t integer(i32 value, char* buffer);
+
+    // Hexadecimal number with at least `digits` digits
+    size_t hex(u32 value, int digits, char* buffer);
+
+}
+
+#endif //VM8086_FORMAT_H
@@ -0,0 +1,711 @@
+#include "incremental.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cache.h"
+using namespace incremental;
+using decoder::DecodingError;
+using decoder::Instruction;
+using decoder::OperandKind;
+
+const static char magic[8] = { 'v', 'm', '8', '0', '8', '6', 'i', 'n' };
+
+// Farthest a relative jump can reach in either direction
+constexpr static i64 JUMP_REACH = 1 << 15;
+
+static_assert(sizeof(header) == 72);
+
+// Offsets of the sections of a state file
+struct layout {
+    size_t hashes;
+    size_t first;
+    size_t start;
+    size_t instructions;
+    size_t positions;
+    size_t names;
+    size_t size;
+};
+
+static layout make_layout(const u64 blocks, const u64 instructions, const u64 labels) {
+    layout l{};
+    l.hashes = sizeof(header);
+    l.first = l.hashes + blocks * sizeof(u64);
+    l.start = l.first + blocks * sizeof(u32);
+    l.instructions = (l.start + blocks * sizeof(u32) + alignof(u64) - 1) & ~(alignof(u64) - 1);
+    l.positions = (l.instructions + instructions * sizeof(Instruction) + alignof(u32) - 1) & ~(alignof(u32) - 1);
+    l.names = l.positions + labels * sizeof(u32);
+    l.size = l.names + labels * sizeof(u32);
+    return l;
+}
+
+static layout make_layout(const header& h) {
+    return make_layout(h.block_count, h.instruction_count, h.label_count);
+}
+
+static size_t block_count(const size_t program_size) {
+    return (program_size + INCREMENTAL_BLOCK_SIZE - 1) / INCREMENTAL_BLOCK_SIZE;
+}
+
+bool state::open(const char* path) {
+    if (!file.open(path)) return false;
+    const std::span<const u8> data = file.data();
+    if (data.size() < sizeof(header)) return false;
+
+    const header& h = get_header();
+    return std::memcmp(h.magic, magic, sizeof(magic)) == 0
+            && h.version == INCREMENTAL_VERSION
+            && h.instruction_size == sizeof(Instruction)
+            && h.operation_count == static_cast<u32>(decoder::Operation::COUNT)
+            && h.end <= h.program_size
+            && h.block_count == block_count(h.program_size)
+            && h.instruction_count <= h.program_size
+            && h.label_count <= h.program_size + 1
+            && make_layout(h).size == data.size();
+}
+
+const header& state::get_header() const {
+    return *reinterpret_cast<const header*>(file.data().data());
+}
+
+std::span<const u64> state::hashes() const {
+    const header& h = get_header();
+    return { reinterpret_cast<const u64*>(file.data().data() + make_layout(h).hashes), h.block_count };
+}
+
+std::span<const u32> state::block_first() const {
+    const header& h = get_header();
+    return { reinterpret_cast<const u32*>(file.data().data() + make_layout(h).first), h.block_count };
+}
+
+std::span<const u32> state::block_start() const {
+    const header& h = get_header();
+    return { reinterpret_cast<const u32*>(file.data().data() + make_layout(h).start), h.block_count };
+}
+
+std::span<const Instruction> state::instructions() const {
+    const header& h = get_header();
+    return { reinterpret_cast<const Instruction*>(file.data().data() + make_layout(h).instructions), h.instruction_count };
+}
+
+decoder::label_view state::labels() const {
+    const header& h = get_header();
+    const layout l = make_layout(h);
+    return {
+            { reinterpret_cast<const u32*>(file.data().data() + l.positions), h.label_count },
+            { reinterpret_cast<const u32*>(file.data().data() + l.names), h.label_count },
+    };
+}
+
+static bool write_all(const int fd, const void* data, size_t size, size_t offset) {
+    const u8* bytes = static_cast<const u8*>(data);
+    while (size > 0) {
+        const ssize_t written = ::pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static header make_header(const size_t program_size,
+                          const size_t instructions,
+                          const decoder::label_table& labels,
+                          const DecodingError error,
+                          const size_t end,
+                          const u32 next_name) {
+    header h{};
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = INCREMENTAL_VERSION;
+    h.instruction_size = sizeof(Instruction);
+    h.operation_count = static_cast<u32>(decoder::Operation::COUNT);
+    h.error = static_cast<u32>(error);
+    h.program_size = program_size;
+    h.block_count = block_count(program_size);
+    h.instruction_count = instructions;
+    h.label_count = labels.positions.size();
+    h.end = end;
+    h.next_name = next_name;
+    return h;
+}
+
+/**
+ * Writes the whole state under a temporary name and renames it, so the previous state is never
+ * left half written.
+ */
+static bool write_state(const char* path,
+                        const header& h,
+                        const std::span<const u64> hashes,
+                        const std::span<const Instruction> instructions,
+                        const decoder::label_table& labels) {
+    // First instruction which starts in every block or after it
+    std::vector<u32> first(h.block_count);
+    std::vector<u32> start(h.block_count);
+    size_t block = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i <= instructions.size(); i++) {
+        while (block < h.block_count && block * INCREMENTAL_BLOCK_SIZE <= pos) {
+            first[block] = static_cast<u32>(i);
+            start[block] = static_cast<u32>(pos);
+            block += 1;
+        }
+        if (i < instructions.size()) pos += instructions[i].length;
+    }
+    while (block < h.block_count) {
+        first[block] = static_cast<u32>(instructions.size());
+        start[block] = static_cast<u32>(pos);
+        block += 1;
+    }
+
+    char temporary[PATH_MAX];
+    const int length = std::snprintf(temporary, sizeof(temporary), "%s.%d", path, static_cast<int>(::getpid()));
+    if (length < 0 || static_cast<size_t>(length) >= sizeof(temporary)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    const int fd = ::open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    const layout l = make_layout(h);
+    const bool written = ::ftruncate(fd, static_cast<off_t>(l.size)) == 0
+            && write_all(fd, &h, sizeof(h), 0)
+            && write_all(fd, hashes.data(), hashes.size_bytes(), l.hashes)
+            && write_all(fd, first.data(), first.size() * sizeof(u32), l.first)
+            && write_all(fd, start.data(), start.size() * sizeof(u32), l.start)
+            && write_all(fd, instructions.data(), instructions.size_bytes(), l.instructions)
+            && write_all(fd, labels.positions.data(), labels.positions.size() * sizeof(u32), l.positions)
+            && write_all(fd, labels.names.data(), labels.names.size() * sizeof(u32), l.names);
+    const int write_error = errno;
+    ::close(fd);
+
+    if (!written || ::rename(temporary, path) != 0) {
+        const int error_code = written ? errno : write_error;
+        ::unlink(temporary);
+        errno = error_code;
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+    // Changed part of the image, [begin, end) in the positions of the new image
+    struct change {
+        size_t begin;
+        size_t end;
+    };
+
+    // Part of the program which was decoded again
+    struct region {
+        size_t pos;
+        // Position after the last decoded instruction
+        size_t end;
+        // Replaced instructions of the previous decode
+        size_t old_first;
+        size_t old_last;
+        // Decoded instructions in sequence::decoded
+        size_t first;
+        size_t count;
+    };
+
+    /**
+     * New decode of the program: instructions of the previous decode with some of them replaced
+     * by the regions. Instructions outside of the regions keep their positions.
+     */
+    struct sequence {
+        std::span<const Instruction> old;
+        std::span<const u32> block_first;
+        std::span<const u32> block_start;
+        size_t old_end;
+
+        std::vector<region> regions{};
+        std::vector<Instruction> decoded{};
+        // Decoding stopped in the last region, nothing of the previous decode follows it
+        bool stopped = false;
+        // Position after the last instruction
+        size_t end = 0;
+
+        // Last instruction of the previous decode which starts at or before the position
+        void locate(const size_t position, size_t* index, size_t* start) const {
+            size_t i = 0;
+            size_t pos = 0;
+            if (!block_first.empty()) {
+                size_t block = std::min(position / INCREMENTAL_BLOCK_SIZE, block_first.size() - 1);
+                // Instruction from the previous block may cover the position
+                while (block > 0 && block_start[block] > position) block -= 1;
+                i = block_first[block];
+                pos = block_start[block];
+            }
+            while (i < old.size() && pos + old[i].length <= position) pos += old[i++].length;
+            *index = i;
+            *start = pos;
+        }
+
+        // Calls f(pos, instr) for every instruction which starts in [from, to)
+        template <typename F>
+        void visit(const i64 from, const i64 to, F&& f) const {
+            const size_t begin = static_cast<size_t>(std::max<i64>(from, 0));
+            size_t i;
+            size_t pos;
+            locate(begin, &i, &pos);
+            // Region which ends after the position, it may start after the end of the previous decode. The
+            // region where decoding stopped replaces everything after it
+            auto r = std::upper_bound(regions.begin(), regions.end(), begin, [this](const size_t position, const region& g) {
+                return position < g.end || g.old_last == old.size();
+            });
+
+            while (static_cast<i64>(pos) < to) {
+                if (r != regions.end() && i >= r->old_first) {
+                    size_t p = r->pos;
+                    for (size_t k = r->first; k < r->first + r->count && static_cast<i64>(p) < to; k++) {
+                        if (p >= begin) f(p, decoded[k]);
+                        p += decoded[k].length;
+                    }
+                    pos = r->end;
+                    i = r->old_last;
+                    ++r;
+                    continue;
+                }
+                if (i >= old.size()) break;
+                if (pos >= begin) f(pos, old[i]);
+                pos += old[i++].length;
+            }
+        }
+    };
+
+    // Lines of the listing which are printed again
+    struct hunk {
+        size_t pos;
+        size_t end;
+        size_t old_count;
+        size_t count;
+    };
+
+}
+
+static std::vector<change> find_changes(const std::span<const u64> previous,
+                                        const std::span<const u64> current,
+                                        const size_t program_size) {
+    std::vector<change> changes{};
+    const size_t blocks = std::max(previous.size(), current.size());
+    for (size_t i = 0; i < blocks; i++) {
+        if (i < previous.size() && i < current.size() && previous[i] == current[i]) continue;
+
+        // Blocks which were cut off are a change at the end of the new image
+        const size_t begin = std::min(i * INCREMENTAL_BLOCK_SIZE, program_size);
+        const size_t end = std::min((i + 1) * INCREMENTAL_BLOCK_SIZE, program_size);
+        if (!changes.empty() && changes.back().end == begin) changes.back().end = end;
+        else changes.push_back({ begin, end });
+    }
+    return changes;
+}
+
+// Decodes the program from scratch and prints the whole listing
+static bool update_full(const char* path,
+                        const std::span<const u8> program,
+                        const std::span<const u64> hashes,
+                        printer::writer& out,
+                        const format::Syntax syntax,
+                        summary* s) {
+    std::vector<Instruction> instructions{};
+    size_t pos;
+    s->full = true;
+    s->rewritten = true;
+    s->error = decoder::decode_program(program, instructions, &pos);
+    s->end = s->error == DecodingError::NONE ? program.size() : pos;
+    s->changed_blocks = hashes.size();
+    s->decoded_bytes = s->end;
+
+    decoder::label_table labels = decoder::find_labels(instructions);
+    printer::print_program(out, instructions, labels, syntax);
+
+    labels.names.resize(labels.positions.size());
+    for (size_t i = 0; i < labels.names.size(); i++) labels.names[i] = static_cast<u32>(i);
+    const header h = make_header(program.size(), instructions.size(), labels, s->error, s->end, static_cast<u32>(labels.names.size()));
+    return write_state(path, h, hashes, instructions, labels);
+}
+
+/**
+ * Decodes every change from the last instruction which starts before it, until instructions start
+ * at the same positions as in the previous decode again.
+ */
+static void decode_changes(sequence& seq,
+                           const std::span<const u8> program,
+                           const std::span<const change> changes,
+                           const DecodingError old_error,
+                           summary* s) {
+    for (size_t r = 0; r < changes.size() && !seq.stopped; r++) {
+        // Nothing after a decoding error was decoded, and bytes past the longest instruction don't change it
+        if (old_error != DecodingError::NONE && changes[r].begin >= seq.old_end + MAX_INSTRUCTION_LENGTH) break;
+
+        region g{};
+        seq.locate(changes[r].begin, &g.old_first, &g.pos);
+        g.first = seq.decoded.size();
+
+        size_t pos = g.pos;
+        size_t end = changes[r].end;
+        while (true) {
+            if (pos >= program.size()) {
+                s->error = DecodingError::NONE;
+                seq.stopped = true;
+                break;
+            }
+            Instruction instr{};
+            const DecodingError error = decoder::decode(program.subspan(pos), &instr);
+            if (error != DecodingError::NONE) {
+                s->error = error;
+                seq.stopped = true;
+                break;
+            }
+            seq.decoded.push_back(instr);
+            s->decoded_bytes += instr.length;
+            pos += instr.length;
+
+            // Instructions up to the next change would be reused, but we are already past its beginning
+            while (r + 1 < changes.size() && changes[r + 1].begin < pos) end = std::max(end, changes[++r].end);
+            if (pos < end || pos >= seq.old_end || pos >= program.size()) continue;
+
+            // Instructions start at the same positions again
+            size_t start;
+            seq.locate(pos, &g.old_last, &start);
+            if (start == pos) break;
+        }
+        if (seq.stopped) g.old_last = seq.old.size();
+        g.end = pos;
+        g.count = seq.decoded.size() - g.first;
+        seq.regions.push_back(g);
+        if (seq.stopped) seq.end = pos;
+    }
+}
+
+/**
+ * Labels can only appear or disappear at targets of the replaced and the decoded jumps, and
+ * at positions inside of the regions which are targets of any jump. For each of them the jumps
+ * within reach are checked.
+ * Jumps to the labels which changed are added to `reprinted`.
+ */
+static decoder::label_table update_labels(const sequence& seq,
+                                          const decoder::label_view old_labels,
+                                          u32* next_name,
+                                          std::vector<size_t>* reprinted,
+                                          std::vector<u32>* changed) {
+    std::vector<i64> candidates{};
+    for (const region& g : seq.regions) {
+        size_t pos = g.pos;
+        for (size_t i = g.old_first; i < g.old_last; i++) {
+            if (seq.old[i].dest.kind == OperandKind::RELATIVE) candidates.push_back(decoder::jump_target(seq.old[i], pos));
+            pos += seq.old[i].length;
+        }
+        const size_t old_region_end = g.old_last == seq.old.size() ? seq.old_end : pos;
+        pos = g.pos;
+        for (size_t k = g.first; k < g.first + g.count; k++) {
+            if (seq.decoded[k].dest.kind == OperandKind::RELATIVE) candidates.push_back(decoder::jump_target(seq.decoded[k], pos));
+            pos += seq.decoded[k].length;
+        }
+        const auto first = std::lower_bound(old_labels.positions.begin(), old_labels.positions.end(), g.pos);
+        const auto last = std::upper_bound(first, old_labels.positions.end(), old_region_end);
+        candidates.insert(candidates.end(), first, last);
+    }
+    // Instruction boundaries moved inside of the regions, so jumps which didn't change can reach a label there now
+    i64 from = -1;
+    i64 to = -1;
+    for (size_t i = 0; i <= seq.regions.size(); i++) {
+        if (i < seq.regions.size()) {
+            const region& g = seq.regions[i];
+            const i64 begin = static_cast<i64>(g.pos) - JUMP_REACH - MAX_INSTRUCTION_LENGTH;
+            const i64 end = static_cast<i64>(g.end) + JUMP_REACH + 1;
+            if (begin <= to) {
+                to = end;
+                continue;
+            }
+        }
+        if (from < to) {
+            seq.visit(from, to, [&](const size_t pos, const Instruction& instr) {
+                if (instr.dest.kind != OperandKind::RELATIVE) return;
+                const i64 target = decoder::jump_target(instr, pos);
+                const auto g = std::upper_bound(seq.regions.begin(), seq.regions.end(), target, [](const i64 t, const region& r) {
+                    return t < static_cast<i64>(r.end);
+                });
+                if (g != seq.regions.end() && target >= static_cast<i64>(g->pos)) candidates.push_back(target);
+            });
+        }
+        if (i < seq.regions.size()) {
+            from = static_cast<i64>(seq.regions[i].pos) - JUMP_REACH - MAX_INSTRUCTION_LENGTH;
+            to = static_cast<i64>(seq.regions[i].end) + JUMP_REACH + 1;
+        }
+    }
+    candidates.push_back(static_cast<i64>(seq.old_end));
+    candidates.push_back(static_cast<i64>(seq.end));
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    std::vector<u32> added{};
+    std::vector<u32> removed{};
+    std::vector<size_t> jumps{};
+    for (const i64 target : candidates) {
+        if (target < 0 || target > static_cast<i64>(seq.end)) continue;
+        const bool was_label = std::binary_search(old_labels.positions.begin(), old_labels.positions.end(), target);
+
+        bool boundary = target == static_cast<i64>(seq.end);
+        jumps.clear();
+        seq.visit(target - JUMP_REACH - MAX_INSTRUCTION_LENGTH, target + JUMP_REACH + 1, [&](const size_t pos, const Instruction& instr) {
+            if (static_cast<i64>(pos) == target) boundary = true;
+            if (instr.dest.kind == OperandKind::RELATIVE && decoder::jump_target(instr, pos) == target) jumps.push_back(pos);
+        });
+        const bool is_label = boundary && !jumps.empty();
+        if (is_label == was_label) continue;
+
+        (is_label ? added : removed).push_back(static_cast<u32>(target));
+        changed->push_back(static_cast<u32>(target));
+        reprinted->insert(reprinted->end(), jumps.begin(), jumps.end());
+    }
+
+    // Labels past the end are gone, their lines are replaced by the last region
+    const auto beyond = std::upper_bound(old_labels.positions.begin(), old_labels.positions.end(), seq.end);
+    if (beyond != old_labels.positions.end()) {
+        removed.insert(removed.end(), beyond, old_labels.positions.end());
+        const i64 end = static_cast<i64>(seq.end);
+        seq.visit(end - JUMP_REACH - MAX_INSTRUCTION_LENGTH, end, [&](const size_t pos, const Instruction& instr) {
+            if (instr.dest.kind != OperandKind::RELATIVE) return;
+            const i64 target = decoder::jump_target(instr, pos);
+            if (target > end && std::binary_search(beyond, old_labels.positions.end(), target)) reprinted->push_back(pos);
+        });
+    }
+
+    // Previous labels without the removed ones, merged with the added ones
+    decoder::label_table labels{};
+    labels.positions.reserve(old_labels.positions.size() + added.size());
+    labels.names.reserve(old_labels.positions.size() + added.size());
+    size_t a = 0;
+    size_t r = 0;
+    for (size_t i = 0; i <= old_labels.positions.size(); i++) {
+        const u32 pos = i < old_labels.positions.size() ? old_labels.positions[i] : UINT32_MAX;
+        while (a < added.size() && added[a] < pos) {
+            labels.positions.push_back(added[a++]);
+            labels.names.push_back((*next_name)++);
+        }
+        if (i == old_labels.positions.size()) break;
+        if (r < removed.size() && removed[r] == pos) {
+            r++;
+            continue;
+        }
+        labels.positions.push_back(pos);
+        labels.names.push_back(static_cast<u32>(old_labels.name(i)));
+    }
+    return labels;
+}
+
+// Decoded instructions are compared byte by byte
+static_assert(std::has_unique_object_representations_v<Instruction>);
+
+static bool same_instruction(const Instruction& a, const Instruction& b) {
+    return std::memcmp(&a, &b, sizeof(Instruction)) == 0;
+}
+
+/**
+ * Adds a hunk for every run of lines of the region which changed. Previous and new instructions
+ * are walked by position, a run ends where both start at the same position with the same
+ * instruction again. The end of the region where decoding stopped may not line up with the
+ * previous decode, the run which reaches it replaces the label after the end as well.
+ */
+static void diff_region(const sequence& seq, const region& g, const bool last, std::vector<hunk>& hunks) {
+    const size_t old_last = g.old_last;
+    const size_t last_decoded = g.first + g.count;
+    size_t i = g.old_first;
+    size_t k = g.first;
+    size_t old_pos = g.pos;
+    size_t pos = g.pos;
+
+    while (i < old_last || k < last_decoded) {
+        if (i < old_last && k < last_decoded && same_instruction(seq.old[i], seq.decoded[k])) {
+            old_pos += seq.old[i++].length;
+            pos += seq.decoded[k++].length;
+            continue;
+        }
+
+        const size_t start = pos;
+        const size_t old_start = i;
+        const size_t start_decoded = k;
+        do {
+            if (i < old_last && (k == last_decoded || old_pos <= pos)) old_pos += seq.old[i++].length;
+            else pos += seq.decoded[k++].length;
+        } while (!(i == old_last && k == last_decoded)
+                && !(old_pos == pos && i < old_last && k < last_decoded && same_instruction(seq.old[i], seq.decoded[k])));
+
+        const bool at_end = last && i == old_last && k == last_decoded;
+        hunks.push_back({ start, at_end ? seq.end + 1 : pos, i - old_start, k - start_decoded });
+    }
+}
+
+static std::vector<hunk> find_hunks(const sequence& seq, std::vector<size_t>& reprinted, const std::span<const u32> changed) {
+    // Lines of the changed labels, the label after the last instruction is a line of its own
+    reprinted.insert(reprinted.end(), changed.begin(), changed.end());
+    std::sort(reprinted.begin(), reprinted.end());
+    reprinted.erase(std::unique(reprinted.begin(), reprinted.end()), reprinted.end());
+
+    // Lines of the regions which changed, in the order of positions
+    std::vector<hunk> diffs{};
+    for (auto region = seq.regions.begin(); region != seq.regions.end(); ++region) {
+        diff_region(seq, *region, seq.stopped && region + 1 == seq.regions.end(), diffs);
+    }
+
+    std::vector<hunk> hunks{};
+    auto single = reprinted.begin();
+    auto region = diffs.begin();
+    while (single != reprinted.end() || region != diffs.end()) {
+        if (region != diffs.end() && (single == reprinted.end() || region->pos <= *single)) {
+            hunks.push_back(*region);
+            // Lines inside of the region are printed with it
+            while (single != reprinted.end() && *single < region->end) ++single;
+            ++region;
+            continue;
+        }
+        const bool at_end = *single >= seq.end;
+        // Only the label line is printed at the end, there is no instruction
+        hunks.push_back({ *single, *single + 1, at_end ? 0 : 1u, at_end ? 0 : 1u });
+        ++single;
+    }
+    return hunks;
+}
+
+static void print_hunks(printer::writer& out,
+                        const format::Syntax syntax,
+                        const sequence& seq,
+                        const std::span<const hunk> hunks,
+                        const decoder::label_view labels) {
+    for (const hunk& h : hunks) {
+        out.line();
+        out.write("; @@ 0x", 7);
+        out.hex(static_cast<u32>(h.pos), 4);
+        out.write(" -", 2);
+        out.unsigned_integer(h.old_count);
+        out.write(" +", 2);
+        out.unsigned_integer(h.count);
+        out.put('\n');
+
+        seq.visit(static_cast<i64>(h.pos), static_cast<i64>(h.end), [&](const size_t pos, const Instruction& instr) {
+            const i32 label = labels.find(static_cast<i64>(pos));
+            if (label >= 0) printer::print_label(out, syntax, label, pos);
+            const i32 target = instr.dest.kind == OperandKind::RELATIVE ? labels.find(decoder::jump_target(instr, pos)) : -1;
+            printer::print_operation(out, syntax, instr, target, pos);
+            out.put('\n');
+        });
+        if (h.pos <= seq.end && seq.end < h.end) {
+            const i32 label = labels.find(static_cast<i64>(seq.end));
+            if (label >= 0) printer::print_label(out, syntax, label, seq.end);
+        }
+    }
+}
+
+// Regions which decoded into the same instruction lengths don't move anything in the state file
+static bool same_layout(const sequence& seq, const header& previous, const size_t program_size) {
+    if (program_size != previous.program_size || seq.end != seq.old_end) return false;
+    for (const region& g : seq.regions) {
+        if (g.count != g.old_last - g.old_first) return false;
+        for (size_t k = 0; k < g.count; k++) {
+            if (seq.decoded[g.first + k].length != seq.old[g.old_first + k].length) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Patches the state file in place: hashes, replaced instructions and labels. The magic is
+ * cleared while the file is written, so an interrupted update is never mistaken for a state.
+ */
+static bool patch_state(const char* path,
+                        const header& h,
+                        const std::span<const u64> hashes,
+                        const sequence& seq,
+                        const decoder::label_table& labels) {
+    const int fd = ::open(path, O_WRONLY);
+    if (fd < 0) return false;
+
+    const layout l = make_layout(h);
+    const char cleared[sizeof(h.magic)]{};
+    bool written = write_all(fd, cleared, sizeof(cleared), 0)
+            && write_all(fd, hashes.data(), hashes.size_bytes(), l.hashes);
+    for (const region& g : seq.regions) {
+        if (!written) break;
+        written = write_all(fd, seq.decoded.data() + g.first, g.count * sizeof(Instruction),
+                            l.instructions + g.old_first * sizeof(Instruction));
+    }
+    written = written
+            && ::ftruncate(fd, static_cast<off_t>(l.size)) == 0
+            && write_all(fd, labels.positions.data(), labels.positions.size() * sizeof(u32), l.positions)
+            && write_all(fd, labels.names.data(), labels.names.size() * sizeof(u32), l.names)
+            && write_all(fd, &h, sizeof(h), 0);
+    const int write_error = errno;
+    ::close(fd);
+    errno = write_error;
+    return written;
+}
+
+bool incremental::update(const char* path,
+                         const std::span<const u8> program,
+                         printer::writer& out,
+                         const format::Syntax syntax,
+                         summary* s) {
+    std::vector<u64> hashes(block_count(program.size()));
+    for (size_t i = 0; i < hashes.size(); i++) {
+        const size_t begin = i * INCREMENTAL_BLOCK_SIZE;
+        hashes[i] = cache::hash(program.subspan(begin, std::min<size_t>(INCREMENTAL_BLOCK_SIZE, program.size() - begin)));
+    }
+
+    state previous{};
+    if (!previous.open(path)) return update_full(path, program, hashes, out, syntax, s);
+    const header& old_header = previous.get_header();
+
+    sequence seq {
+            .old = previous.instructions(),
+            .block_first = previous.block_first(),
+            .block_start = previous.block_start(),
+            .old_end = old_header.end,
+    };
+    const std::vector<change> changes = find_changes(previous.hashes(), hashes, program.size());
+    for (const change& c : changes) s->changed_blocks += block_count(c.end - c.begin);
+
+    s->error = static_cast<DecodingError>(old_header.error);
+    seq.end = seq.old_end;
+    decode_changes(seq, program, changes, static_cast<DecodingError>(old_header.error), s);
+    s->end = seq.end;
+
+    u32 next_name = static_cast<u32>(old_header.next_name);
+    std::vector<size_t> reprinted{};
+    std::vector<u32> changed{};
+    const decoder::label_table labels = update_labels(seq, previous.labels(), &next_name, &reprinted, &changed);
+
+    const std::vector<hunk> hunks = find_hunks(seq, reprinted, changed);
+    s->hunks = hunks.size();
+    print_hunks(out, syntax, seq, hunks, labels);
+
+    size_t instruction_count = seq.old.size();
+    for (const region& g : seq.regions) instruction_count += g.count - (g.old_last - g.old_first);
+    const header h = make_header(program.size(), instruction_count, labels, s->error, s->end, next_name);
+    if (same_layout(seq, old_header, program.size())) return patch_state(path, h, hashes, seq, labels);
+
+    s->rewritten = true;
+    std::vector<Instruction> instructions{};
+    instructions.reserve(instruction_count);
+    seq.visit(0, static_cast<i64>(seq.end), [&](size_t, const Instruction& instr) { instructions.push_back(instr); });
+    return write_state(path, h, hashes, instructions, labels);
+}
+
+void incremental::print_summary(printer::writer& out, const summary& s) {
+    out.line();
+    out.write("; Changed blocks: ", 18);
+    out.unsigned_integer(s.changed_blocks);
+    out.write(", decoded bytes: ", 17);
+    out.unsigned_integer(s.decoded_bytes);
+    out.write(", hunks: ", 9);
+    out.unsigned_integer(s.hunks);
+    out.put('\n');
+}
@@ -0,0 +1,104 @@
+#ifndef VM8086_INCREMENTAL_H
+#define VM8086_INCREMENTAL_H
+
+// Has to be incremented on every change of the file layout or of the decoded instructions
+#define INCREMENTAL_VERSION 1
+// Images are compared in blocks of this many bytes
+#define INCREMENTAL_BLOCK_SIZE 4096
+
+#include <utils/types.h>
+#include <span>
+#include <vector>
+#include "decoder.h"
+#include "printer.h"
+#include "io.h"
+
+namespace incremental {
+
+    /**
+     * Layout of a state file, every number is in the byte order of the machine:
+     *   header
+     *   u64[block_count] - hashes of the image blocks
+     *   u32[block_count] - index of the first instruction which starts in the block or after it
+     *   u32[block_count] - position of that instruction
+     *   Instruction[instruction_count], aligned to 8 bytes
+     *   u32[label_count] - positions of the labels
+     *   u32[label_count] - numbers of the labels
+     */
+    struct header {
+        char magic[8];
+        u32 version;
+        // Guards against changes of the decoder which weren't followed by a new version
+        u32 instruction_size;
+        u32 operation_count;
+        // DecodingError of the instruction at `end`, NONE if the whole program was decoded
+        u32 error;
+        u64 program_size;
+        u64 block_count;
+        u64 instruction_count;
+        u64 label_count;
+        // Position after the last decoded instruction
+        u64 end;
+        // Number of the next new label
+        u64 next_name;
+    };
+
+    /**
+     * Decode of the previous version of the program, mapped from the state file. Spans point
+     * into the mapping, so they are valid while the state is open.
+     */
+    struct state {
+        // Maps the state file, returns false if there is no such file or it was written by another version
+        bool open(const char* path);
+
+        const header& get_header() const;
+
+        std::span<const u64> hashes() const;
+
+        std::span<const u32> block_first() const;
+
+        std::span<const u32> block_start() const;
+
+        std::span<const decoder::Instruction> instructions() const;
+
+        decoder::label_view labels() const;
+
+    private:
+        io::input_stream file{};
+    };
+
+    struct summary {
+        // Nothing was reused, the whole listing is printed
+        bool full = false;
+        // State file was written from scratch instead of being patched in place
+        bool rewritten = false;
+        size_t changed_blocks = 0;
+        size_t decoded_bytes = 0;
+        size_t hunks = 0;
+        decoder::DecodingError error = decoder::DecodingError::NONE;
+        // Position after the last decoded instruction
+        size_t end = 0;
+    };
+
+    /**
+     * Disassembles the program using the decode of its previous version from the state file, and
+     * updates the file. Only blocks which changed are decoded: from the last instruction which
+     * starts before the change until the instructions start at the same positions as before.
+     * Labels keep their numbers as long as they stay at the same position, new labels get new
+     * numbers.
+     *
+     * Without a usable state the whole listing is printed. Otherwise only the changed lines are,
+     * as hunks of the listing: "; @@ <position> -<previous instructions> +<instructions>" followed
+     * by the new lines, including labels. Instructions of the decoded blocks which didn't change
+     * aren't printed, every run of changed lines is a hunk of its own. A hunk which runs to the
+     * end of the previous listing replaces the label after its last instruction as well. Returns
+     * false and sets errno if the state file couldn't be written.
+     */
+    bool update(const char* path, std::span<const u8> program, printer::writer& out, format::Syntax syntax, summary* s);
+
+    // ; Changed blocks: <blocks>, decoded bytes: <bytes>, hunks: <hunks>
+    void print_summary(printer::writer& out, const summary& s);
+
+}
+
+#endif //VM8086_INCREMENTAL_H
@@ -0,0 +1,237 @@
+#include "instrument.h"
+
+#ifdef VM8086_INSTRUMENT
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include "printer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+using namespace instrument;
+
+constexpr size_t TIMERS = static_cast<size_t>(Timer::COUNT);
+
+// Every thread counts into its own stats, they are added together for the report
+struct stats {
+    // Indexed by [opcode][mod], instructions without a mod reg rm byte are counted as mod 11
+    u64 instructions[256][4]{};
+    u64 bytes = 0;
+    u64 refills = 0;
+    u64 refill_bytes = 0;
+    u64 calls[TIMERS]{};
+    u64 cycles[TIMERS]{};
+    u64 histograms[TIMERS][INSTRUMENT_BUCKETS]{};
+
+    void add(const stats& other) {
+        for (size_t opcode = 0; opcode < 256; opcode++) {
+            for (size_t mod = 0; mod < 4; mod++) instructions[opcode][mod] += other.instructions[opcode][mod];
+        }
+        bytes += other.bytes;
+        refills += other.refills;
+        refill_bytes += other.refill_bytes;
+        for (size_t timer = 0; timer < TIMERS; timer++) {
+            calls[timer] += other.calls[timer];
+            cycles[timer] += other.cycles[timer];
+            for (size_t bucket = 0; bucket < INSTRUMENT_BUCKETS; bucket++) {
+                histograms[timer][bucket] += other.histograms[timer][bucket];
+            }
+        }
+    }
+};
+
+// Never destroyed, threads can still count while the report is printed at exit
+static std::mutex& registry_lock = *new std::mutex{};
+static std::vector<std::unique_ptr<stats>>& registry = *new std::vector<std::unique_ptr<stats>>{};
+static thread_local stats* local = nullptr;
+
+static stats& local_stats() {
+    if (!local) {
+        std::lock_guard<std::mutex> guard{registry_lock};
+        registry.push_back(std::make_unique<stats>());
+        local = registry.back().get();
+    }
+    return *local;
+}
+
+u64 instrument::now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void instrument::record(const Timer timer, const u64 cycles) {
+    stats& s = local_stats();
+    const size_t index = static_cast<size_t>(timer);
+    const size_t bucket = std::min<size_t>(63 - __builtin_clzll(cycles | 1), INSTRUMENT_BUCKETS - 1);
+    s.calls[index] += 1;
+    s.cycles[index] += cycles;
+    s.histograms[index][bucket] += 1;
+}
+
+void instrument::count_instruction(const decoder::Instruction& instr) {
+    stats& s = local_stats();
+    s.instructions[instr.opcode][static_cast<u8>(instr.mod)] += 1;
+    s.bytes += instr.length;
+}
+
+void instrument::count_refill(const size_t bytes) {
+    stats& s = local_stats();
+    s.refills += 1;
+    s.refill_bytes += bytes;
+}
+
+static u64 total_instructions(const stats& s) {
+    u64 total = 0;
+    for (const auto& by_mod : s.instructions) {
+        for (const u64 count : by_mod) total += count;
+    }
+    return total;
+}
+
+// ; <name>: <value>
+static void print_value(printer::writer& out, const char* name, const u64 value) {
+    out.line();
+    out.write("; ", 2);
+    out.str(name);
+    out.write(": ", 2);
+    out.unsigned_integer(value);
+    out.put('\n');
+}
+
+static void print_table(printer::writer& out, const stats& s) {
+    out.line();
+    out.write("; Instrumentation\n", 18);
+    print_value(out, "Instructions", total_instructions(s));
+    print_value(out, "Bytes", s.bytes);
+    print_value(out, "Refills", s.refills);
+    print_value(out, "Refill bytes", s.refill_bytes);
+
+    for (size_t timer = 0; timer < TIMERS; timer++) {
+        if (s.calls[timer] == 0) continue;
+        out.line();
+        out.write("; ", 2);
+        out.str(timer_name[timer]);
+        out.write(": ", 2);
+        out.unsigned_integer(s.calls[timer]);
+        out.write(" calls, ", 8);
+        out.unsigned_integer(s.cycles[timer]);
+        out.write(" cycles, ", 9);
+        out.unsigned_integer(s.cycles[timer] / s.calls[timer]);
+        out.write(" per call\n", 10);
+        for (size_t bucket = 0; bucket < INSTRUMENT_BUCKETS; bucket++) {
+            if (s.histograms[timer][bucket] == 0) continue;
+            out.line();
+            out.write(";   < 2^", 8);
+            out.unsigned_integer(bucket + 1);
+            out.write(": ", 2);
+            out.unsigned_integer(s.histograms[timer][bucket]);
+            out.put('\n');
+        }
+    }
+
+    out.line();
+    out.write("; Opcodes:\n", 11);
+    for (size_t opcode = 0; opcode < 256; opcode++) {
+        for (size_t mod = 0; mod < 4; mod++) {
+            if (s.instructions[opcode][mod] == 0) continue;
+            out.line();
+            out.write(";   0x", 6);
+            out.hex(opcode, 2);
+            out.write(" mod ", 5);
+            out.unsigned_integer(mod);
+            out.write(": ", 2);
+            out.unsigned_integer(s.instructions[opcode][mod]);
+            out.put('\n');
+        }
+    }
+}
+
+// "<name>":<value>
+static void print_field(printer::writer& out, const char* name, const u64 value) {
+    out.line();
+    out.put('"');
+    out.str(name);
+    out.write("\":", 2);
+    out.unsigned_integer(value);
+}
+
+static void print_json(printer::writer& out, const stats& s) {
+    out.line();
+    out.put('{');
+    print_field(out, "instructions", total_instructions(s));
+    out.put(',');
+    print_field(out, "bytes", s.bytes);
+    out.put(',');
+    print_field(out, "refills", s.refills);
+    out.put(',');
+    print_field(out, "refill_bytes", s.refill_bytes);
+    out.write(",\"timers\":{", 11);
+
+    for (size_t timer = 0; timer < TIMERS; timer++) {
+        out.line();
+        if (timer != 0) out.put(',');
+        out.put('"');
+        out.str(timer_name[timer]);
+        out.write("\":{", 3);
+        print_field(out, "calls", s.calls[timer]);
+        out.put(',');
+        print_field(out, "cycles", s.cycles[timer]);
+        out.write(",\"histogram\":[", 14);
+        for (size_t bucket = 0; bucket < INSTRUMENT_BUCKETS; bucket++) {
+            out.line();
+            if (bucket != 0) out.put(',');
+            out.unsigned_integer(s.histograms[timer][bucket]);
+        }
+        out.write("]}", 2);
+    }
+
+    out.write("},\"opcodes\":[", 13);
+    bool first = true;
+    for (size_t opcode = 0; opcode < 256; opcode++) {
+        for (size_t mod = 0; mod < 4; mod++) {
+            if (s.instructions[opcode][mod] == 0) continue;
+            out.line();
+            if (!first) out.put(',');
+            first = false;
+            out.put('{');
+            print_field(out, "opcode", opcode);
+            out.put(',');
+            print_field(out, "mod", mod);
+            out.put(',');
+            print_field(out, "count", s.instructions[opcode][mod]);
+            out.put('}');
+        }
+    }
+    out.write("]}\n", 3);
+}
+
+static void report() {
+    stats total{};
+    {
+        std::lock_guard<std::mutex> guard{registry_lock};
+        for (const std::unique_ptr<stats>& s : registry) total.add(*s);
+    }
+
+    printer::writer out{STDERR_FILENO};
+    const char* format = std::getenv("VM8086_REPORT");
+    if (format && std::strcmp(format, "json") == 0) print_json(out, total);
+    else print_table(out, total);
+}
+
+// Registers the report before main, so it's printed after main returns
+const static int report_registered = std::atexit(report);
+
+#endif
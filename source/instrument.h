@@ -0,0 +1,70 @@
+#ifndef VM8086_INSTRUMENT_H
+#define VM8086_INSTRUMENT_H
+
+/**
+ * Counters and timing histograms of the hot paths, enabled with -DVM8086_INSTRUMENT=ON.
+ * Without it every macro expands to nothing, so the release build is not affected.
+ * The report is printed to stderr at exit, as a table or as JSON with VM8086_REPORT=json.
+ */
+#ifdef VM8086_INSTRUMENT
+
+// Histogram buckets of log2(cycles)
+#define INSTRUMENT_BUCKETS 32
+
+#include <utils/types.h>
+#include "decoder.h"
+
+// Times the rest of the scope, one timer per scope
+#define INSTRUMENT_TIME(timer) const instrument::scoped_timer instrument_timer{instrument::Timer::timer}
+// Counts the decoded instruction by its opcode and mod, and its bytes
+#define INSTRUMENT_INSTRUCTION(instr) instrument::count_instruction(instr)
+// Counts a read of the next block of the input
+#define INSTRUMENT_REFILL(bytes) instrument::count_refill(bytes)
+
+namespace instrument {
+
+    enum class Timer : u8 {
+        // decoder::decode
+        DECODE,
+        // Addressing mode and displacement of the mod reg rm byte
+        DECODE_MOD,
+        // printer::print_operation
+        PRINT,
+        COUNT
+    };
+
+    inline constexpr const char* timer_name[] = { "decode", "decode_mod", "print" };
+
+    static_assert(sizeof(timer_name) / sizeof(timer_name[0]) == static_cast<size_t>(Timer::COUNT));
+
+    // Cycle counter of the CPU, nanoseconds where there is no such counter
+    u64 now();
+
+    void record(Timer timer, u64 cycles);
+
+    void count_instruction(const decoder::Instruction& instr);
+
+    void count_refill(size_t bytes);
+
+    struct scoped_timer {
+        const Timer timer;
+        const u64 start;
+
+        explicit scoped_timer(const Timer timer): timer(timer), start(now()) {}
+
+        ~scoped_timer() {
+            record(timer, now() - start);
+        }
+    };
+
+}
+
+#else
+
+#define INSTRUMENT_TIME(timer) ((void) 0)
+#define INSTRUMENT_INSTRUCTION(instr) ((void) 0)
+#define INSTRUMENT_REFILL(bytes) ((void) 0)
+
+#endif
+
+#endif //VM8086_INSTRUMENT_H
@@ -3,31 +3,84 @@
 //
 
 #include "io.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include "instrument.h"
 
-bool io::input_stream::complete() const {
-    return buffer_pos == buffer_size;
+io::input_stream::~input_stream() {
+    close();
 }
 
-u8 io::input_stream::byte() {
-    if (buffer_pos == buffer_size) {
-        return 0;
+std::span<const u8> io::input_stream::data() const {
+    return { image, image_size };
+}
+
+bool io::input_stream::open(const char* path) {
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    const bool result = open(fd);
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return result;
+}
+
+bool io::input_stream::open(const int fd) {
+    close();
+
+    struct stat info{};
+    // Regular files which are read from the beginning are mapped as a whole
+    if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && ::lseek(fd, 0, SEEK_CUR) == 0) {
+        if (map(fd, static_cast<size_t>(info.st_size))) return true;
     }
-    return buffer[buffer_pos];
+    return read(fd);
 }
 
-u8 io::input_stream::next_byte() {
-    next();
-    return byte();
+bool io::input_stream::map(const int fd, const size_t size) {
+    void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) return false;
+    ::madvise(address, size, MADV_SEQUENTIAL);
+    // The whole file is one refill
+    INSTRUMENT_REFILL(size);
+
+    image = static_cast<const u8*>(address);
+    image_size = size;
+    mapped = true;
+    return true;
 }
 
-void io::input_stream::next() {
-    if (buffer_pos == buffer_size) {
-        const size_t bytes = ::read(0, buffer, BUFFER_SIZE);
-        buffer_size = bytes;
-        buffer_pos = 0;
-    } else {
-        buffer_pos += 1;
+bool io::input_stream::read(const int fd) {
+    buffer.resize(BUFFER_SIZE);
+    size_t size = 0;
+
+    while (true) {
+        if (buffer.size() - size < BUFFER_SIZE) buffer.resize(buffer.size() * 2);
+
+        const ssize_t bytes = ::read(fd, buffer.data() + size, buffer.size() - size);
+        if (bytes == 0) break;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            buffer.clear();
+            return false;
+        }
+        size += bytes;
+        INSTRUMENT_REFILL(bytes);
     }
-    pos += 1;
-}
\ No newline at end of file
+
+    buffer.resize(size);
+    image = buffer.data();
+    image_size = size;
+    return true;
+}
+
+void io::input_stream::close() {
+    if (mapped) ::munmap(const_cast<u8*>(image), image_size);
+    buffer.clear();
+    image = nullptr;
+    image_size = 0;
+    mapped = false;
+}
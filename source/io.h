@@ -5,29 +5,48 @@
 #ifndef VM8086_IO_H
 #define VM8086_IO_H
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (1 << 16)
 
 #include <utils/types.h>
 #include <cstdlib>
+#include <span>
+#include <vector>
 
 namespace io {
 
     /**
-     * Represents stream of encoded instructions.
+     * Represents stream of encoded instructions. The whole program is available as one
+     * contiguous span: regular files are mapped into memory, everything else (pipes, terminals)
+     * is read in large blocks.
      */
     struct input_stream {
-        u8 buffer[BUFFER_SIZE];
-        size_t buffer_pos = BUFFER_SIZE;
-        size_t buffer_size = BUFFER_SIZE;
-        size_t pos = 0;
+        input_stream() = default;
 
-        u8 byte();
+        input_stream(const input_stream&) = delete;
 
-        void next();
+        input_stream& operator=(const input_stream&) = delete;
 
-        u8 next_byte();
+        ~input_stream();
 
-        bool complete() const;
+        // Opens the file at the provided path, returns false and sets errno on failure
+        bool open(const char* path);
+
+        // Maps or reads everything from the file descriptor, returns false and sets errno on failure
+        bool open(int fd);
+
+        std::span<const u8> data() const;
+
+    private:
+        const u8* image = nullptr;
+        size_t image_size = 0;
+        bool mapped = false;
+        std::vector<u8> buffer{};
+
+        bool map(int fd, size_t size);
+
+        bool read(int fd);
+
+        void close();
     };
 
 }
@@ -0,0 +1,588 @@
+#include "lanes.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "blocks.h"
+#include "snapshot.h"
+using namespace lanes;
+using decoder::Instruction;
+using decoder::Operand;
+using decoder::OperandKind;
+using decoder::Operation;
+using simulator::ExecutionError;
+using simulator::FlagOp;
+using simulator::lazy_flags;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LANES_X86
+#include <immintrin.h>
+#endif
+
+static_assert(LANES == 16, "Lanes are 16-bit elements of one 256-bit vector");
+
+// Same as the --vectors mode: the machine is restored from the snapshot before every run
+static summary run_each(const std::span<const u8> program,
+                        const std::span<const simulator::register_file> vectors,
+                        const u64 limit,
+                        const std::span<result> results) {
+    summary s{};
+    simulator::machine m{};
+    blocks::cache cache{};
+    m.load(program);
+    snapshot::snapshot initial{};
+    snapshot::take(m, &initial);
+
+    const u16 end = static_cast<u16>(std::min<size_t>(program.size(), 0xFFFF));
+    for (size_t i = 0; i < vectors.size(); i++) {
+        if (i > 0) snapshot::restore(m, initial);
+        m.regs = vectors[i];
+        decoder::DecodingError decoding_error = decoder::DecodingError::NONE;
+        const ExecutionError error = blocks::run(m, cache, end, limit, &decoding_error);
+        results[i] = result { m.regs, m.ip, m.flags.get(), m.executed, error };
+        s.executed += m.executed;
+    }
+    s.scalar_instructions = s.executed;
+    return s;
+}
+
+#ifdef LANES_X86
+
+namespace {
+
+    enum class Path : u8 {
+        // Register and immediate forms of MOV, ADD, SUB and CMP
+        VECTOR,
+        // Conditional jumps and loops
+        JUMP,
+        // Everything else is executed on the machines of the lanes
+        SCALAR,
+    };
+
+    struct entry {
+        Instruction instr{};
+        simulator::execute_handler handler = nullptr;
+        Path path = Path::SCALAR;
+    };
+
+    /**
+     * Instructions of the program decoded from the initial memory by IP. Lanes which write into
+     * the program are detached, so the program is the same for every lane in the group.
+     */
+    struct program_table {
+        const u8* memory;
+        // Index of the entry, -1 if not decoded yet, -2 if the instruction fails to decode
+        std::vector<i32> at;
+        std::vector<entry> entries{};
+    };
+
+    /**
+     * State of the lanes, one array per register so the register of every lane is one vector.
+     * Lazy flags are kept the same way: `kind` is the FlagOp with the word bit in the high byte,
+     * `carry` is all ones where a word operation carried out of 16 bits.
+     */
+    struct alignas(32) group {
+        u16 regs[8][LANES]{};
+        u16 ip[LANES]{};
+        u16 kind[LANES]{};
+        u16 left[LANES]{};
+        u16 right[LANES]{};
+        u16 result[LANES]{};
+        u16 carry[LANES]{};
+        // All ones once the lane stopped on an error, or when it's free
+        u16 stopped[LANES]{};
+        // Instructions executed since the counters were added up
+        u16 pending[LANES]{};
+
+        u64 executed[LANES]{};
+        ExecutionError error[LANES]{};
+        // Run was finished on the machine of the lane, the final state is there
+        bool detached[LANES]{};
+        // Index of the vector, SIZE_MAX if the lane is free
+        size_t index[LANES]{};
+    };
+
+}
+
+static bool is_register(const Operand& operand) {
+    return operand.kind == OperandKind::REGISTER
+            || operand.kind == OperandKind::BYTE_REGISTER
+            || operand.kind == OperandKind::WORD_REGISTER;
+}
+
+static Path classify(const Instruction& instr) {
+    switch (instr.operation) {
+        case Operation::MOV:
+        case Operation::ADD:
+        case Operation::SUB:
+        case Operation::CMP: {
+            const bool registers = is_register(instr.dest)
+                    && (is_register(instr.source) || instr.source.kind == OperandKind::IMMEDIATE);
+            return registers ? Path::VECTOR : Path::SCALAR;
+        }
+        case Operation::JE: case Operation::JL: case Operation::JLE: case Operation::JB:
+        case Operation::JBE: case Operation::JP: case Operation::JO: case Operation::JS:
+        case Operation::JNE: case Operation::JNL: case Operation::JNLE: case Operation::JNB:
+        case Operation::JNBE: case Operation::JNP: case Operation::JNO: case Operation::JNS:
+        case Operation::LOOP: case Operation::LOOPZ: case Operation::LOOPNZ: case Operation::JCXZ:
+            return Path::JUMP;
+        default:
+            return Path::SCALAR;
+    }
+}
+
+// Entry of the instruction at IP, nullptr if it fails to decode
+static const entry* find(program_table& t, const u16 ip) {
+    if (t.at[ip] == -1) {
+        entry e{};
+        const decoder::DecodingError error = decoder::decode({ t.memory + ip, static_cast<size_t>(MEMORY_SIZE - ip) }, &e.instr);
+        if (error != decoder::DecodingError::NONE) {
+            t.at[ip] = -2;
+        } else {
+            e.handler = simulator::handler(e.instr.operation);
+            e.path = classify(e.instr);
+            t.at[ip] = static_cast<i32>(t.entries.size());
+            t.entries.push_back(e);
+        }
+    }
+    return t.at[ip] < 0 ? nullptr : &t.entries[t.at[ip]];
+}
+
+static lazy_flags lane_flags(const group& g, const size_t lane) {
+    lazy_flags flags{};
+    const u16 kind = g.kind[lane];
+    if ((kind & 0xFF) == static_cast<u8>(FlagOp::NONE)) return flags;
+
+    const bool word = kind >> 8;
+    const u32 carry = word && g.carry[lane] ? 0x10000 : 0;
+    flags.set(static_cast<FlagOp>(kind & 0xFF), word, g.left[lane], g.right[lane], g.result[lane] | carry);
+    return flags;
+}
+
+// Flags derived from the value are only set by the snapshot, and every run starts with them cleared
+static void store_flags(group& g, const size_t lane, const lazy_flags& flags) {
+    g.kind[lane] = static_cast<u16>(static_cast<u8>(flags.op) | flags.word << 8);
+    g.left[lane] = flags.left;
+    g.right[lane] = flags.right;
+    g.result[lane] = static_cast<u16>(flags.result);
+    g.carry[lane] = flags.word && (flags.result >> 16) ? 0xFFFF : 0;
+}
+
+// Condition of the jump, CX is already decremented by the loops
+static bool condition(const Operation operation, const lazy_flags& f, const u16 cx) {
+    switch (operation) {
+        case Operation::JE: return f.zf();
+        case Operation::JL: return f.sf() != f.of();
+        case Operation::JLE: return f.zf() || f.sf() != f.of();
+        case Operation::JB: return f.cf();
+        case Operation::JBE: return f.cf() || f.zf();
+        case Operation::JP: return f.pf();
+        case Operation::JO: return f.of();
+        case Operation::JS: return f.sf();
+        case Operation::JNE: return !f.zf();
+        case Operation::JNL: return f.sf() == f.of();
+        case Operation::JNLE: return !f.zf() && f.sf() == f.of();
+        case Operation::JNB: return !f.cf();
+        case Operation::JNBE: return !f.cf() && !f.zf();
+        case Operation::JNP: return !f.pf();
+        case Operation::JNO: return !f.of();
+        case Operation::JNS: return !f.sf();
+        case Operation::LOOP: return cx != 0;
+        case Operation::LOOPZ: return cx != 0 && f.zf();
+        case Operation::LOOPNZ: return cx != 0 && !f.zf();
+        case Operation::JCXZ: return cx == 0;
+        default: return false;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load(const u16* lanes) {
+    return _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+}
+
+__attribute__((target("avx2")))
+static inline void store(u16* lanes, const __m256i value) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), value);
+}
+
+// Stores the value only into the lanes of the mask
+__attribute__((target("avx2")))
+static inline void store(u16* lanes, const __m256i value, const __m256i mask) {
+    store(lanes, _mm256_blendv_epi8(load(lanes), value, mask));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i splat(const u16 value) {
+    return _mm256_set1_epi16(static_cast<i16>(value));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nonzero(const __m256i value) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi16(value, _mm256_setzero_si256()), splat(0xFFFF));
+}
+
+// Unsigned a < b
+__attribute__((target("avx2")))
+static inline __m256i less(const __m256i a, const __m256i b) {
+    return nonzero(_mm256_xor_si256(_mm256_max_epu16(a, b), a));
+}
+
+__attribute__((target("avx2")))
+static __m256i read(const group& g, const Instruction& instr, const Operand& operand) {
+    switch (operand.kind) {
+        case OperandKind::REGISTER:
+            if (instr.word) return load(g.regs[operand.reg]);
+            [[fallthrough]];
+        case OperandKind::BYTE_REGISTER: {
+            const __m256i word = load(g.regs[operand.reg & 0b011]);
+            return operand.reg & 0b100 ? _mm256_srli_epi16(word, 8) : _mm256_and_si256(word, splat(0x00FF));
+        }
+        case OperandKind::WORD_REGISTER:
+            return load(g.regs[operand.reg]);
+        default:
+            return splat(instr.word ? static_cast<u16>(instr.immediate) : static_cast<u8>(instr.immediate));
+    }
+}
+
+__attribute__((target("avx2")))
+static void write(group& g, const Instruction& instr, const Operand& operand, const __m256i value, const __m256i mask) {
+    if (operand.kind == OperandKind::WORD_REGISTER || (operand.kind == OperandKind::REGISTER && instr.word)) {
+        store(g.regs[operand.reg], value, mask);
+        return;
+    }
+    // High byte registers are the same words as the low ones
+    u16* word = g.regs[operand.reg & 0b011];
+    const __m256i old = load(word);
+    const __m256i merged = operand.reg & 0b100
+            ? _mm256_or_si256(_mm256_and_si256(old, splat(0x00FF)), _mm256_slli_epi16(value, 8))
+            : _mm256_or_si256(_mm256_and_si256(old, splat(0xFF00)), _mm256_and_si256(value, splat(0x00FF)));
+    store(word, merged, mask);
+}
+
+__attribute__((target("avx2")))
+static void set_flags(group& g,
+                      const FlagOp op,
+                      const bool word,
+                      const __m256i left,
+                      const __m256i right,
+                      const __m256i result,
+                      const __m256i mask) {
+    store(g.kind, splat(static_cast<u16>(static_cast<u8>(op) | word << 8)), mask);
+    store(g.left, left, mask);
+    store(g.right, right, mask);
+    store(g.result, result, mask);
+    // Byte operations keep the carry in the high byte of the result
+    __m256i carry = _mm256_setzero_si256();
+    if (word) carry = op == FlagOp::ADD ? less(result, left) : less(left, right);
+    store(g.carry, carry, mask);
+}
+
+__attribute__((target("avx2")))
+static void execute_vector(group& g, const Instruction& instr, const __m256i mask) {
+    if (instr.operation == Operation::MOV) {
+        write(g, instr, instr.dest, read(g, instr, instr.source), mask);
+        return;
+    }
+    const __m256i left = read(g, instr, instr.dest);
+    const __m256i right = read(g, instr, instr.source);
+    if (instr.operation == Operation::ADD) {
+        const __m256i result = _mm256_add_epi16(left, right);
+        set_flags(g, FlagOp::ADD, instr.word, left, right, result, mask);
+        write(g, instr, instr.dest, result, mask);
+        return;
+    }
+    const __m256i result = _mm256_sub_epi16(left, right);
+    set_flags(g, FlagOp::SUB, instr.word, left, right, result, mask);
+    if (instr.operation == Operation::SUB) write(g, instr, instr.dest, result, mask);
+}
+
+/**
+ * Lanes which take the jump, when every lane of the mask got its flags from the same kind of
+ * operation. Returns false if the flags have to be derived lane by lane.
+ */
+__attribute__((target("avx2")))
+static bool vector_condition(const group& g, const Operation operation, const __m256i mask, __m256i* taken) {
+    if (operation == Operation::JP || operation == Operation::JNP) return false;
+
+    const __m256i kinds = load(g.kind);
+    const u16 kind = g.kind[__builtin_ctz(_mm256_movemask_epi8(mask)) / 2];
+    const __m256i different = _mm256_andnot_si256(_mm256_cmpeq_epi16(kinds, splat(kind)), mask);
+    if ((kind & 0xFF) == static_cast<u8>(FlagOp::NONE) || !_mm256_testz_si256(different, different)) return false;
+
+    const bool word = kind >> 8;
+    const __m256i sign = splat(word ? 0x8000 : 0x0080);
+    const __m256i left = load(g.left);
+    const __m256i right = load(g.right);
+    const __m256i result = load(g.result);
+
+    const __m256i zf = _mm256_cmpeq_epi16(_mm256_and_si256(result, splat(word ? 0xFFFF : 0x00FF)), _mm256_setzero_si256());
+    const __m256i sf = nonzero(_mm256_and_si256(result, sign));
+    const __m256i cf = word ? load(g.carry) : nonzero(_mm256_and_si256(result, splat(0xFF00)));
+    const __m256i overflow = (kind & 0xFF) == static_cast<u8>(FlagOp::ADD)
+            ? _mm256_andnot_si256(_mm256_xor_si256(left, right), _mm256_xor_si256(left, result))
+            : _mm256_and_si256(_mm256_xor_si256(left, right), _mm256_xor_si256(left, result));
+    const __m256i of = nonzero(_mm256_and_si256(overflow, sign));
+    const __m256i less_than = _mm256_xor_si256(sf, of);
+    const __m256i ones = splat(0xFFFF);
+    const __m256i cx = nonzero(load(g.regs[static_cast<u8>(simulator::Register::CX)]));
+
+    switch (operation) {
+        case Operation::JE: *taken = zf; break;
+        case Operation::JL: *taken = less_than; break;
+        case Operation::JLE: *taken = _mm256_or_si256(zf, less_than); break;
+        case Operation::JB: *taken = cf; break;
+        case Operation::JBE: *taken = _mm256_or_si256(cf, zf); break;
+        case Operation::JO: *taken = of; break;
+        case Operation::JS: *taken = sf; break;
+        case Operation::JNE: *taken = _mm256_xor_si256(zf, ones); break;
+        case Operation::JNL: *taken = _mm256_xor_si256(less_than, ones); break;
+        case Operation::JNLE: *taken = _mm256_xor_si256(_mm256_or_si256(zf, less_than), ones); break;
+        case Operation::JNB: *taken = _mm256_xor_si256(cf, ones); break;
+        case Operation::JNBE: *taken = _mm256_xor_si256(_mm256_or_si256(cf, zf), ones); break;
+        case Operation::JNO: *taken = _mm256_xor_si256(of, ones); break;
+        case Operation::JNS: *taken = _mm256_xor_si256(sf, ones); break;
+        case Operation::LOOPZ: *taken = _mm256_and_si256(cx, zf); break;
+        case Operation::LOOPNZ: *taken = _mm256_andnot_si256(zf, cx); break;
+        default: return false;
+    }
+    return true;
+}
+
+__attribute__((target("avx2")))
+static void execute_jump(group& g, const Instruction& instr, const __m256i ip, const __m256i mask) {
+    u16* cx = g.regs[static_cast<u8>(simulator::Register::CX)];
+    const Operation operation = instr.operation;
+    const bool loops = operation == Operation::LOOP || operation == Operation::LOOPZ || operation == Operation::LOOPNZ;
+    if (loops) store(cx, _mm256_sub_epi16(load(cx), splat(1)), mask);
+
+    __m256i taken;
+    if (operation == Operation::LOOP) {
+        taken = nonzero(load(cx));
+    } else if (operation == Operation::JCXZ) {
+        taken = _mm256_cmpeq_epi16(load(cx), _mm256_setzero_si256());
+    } else if (!vector_condition(g, operation, mask, &taken)) {
+        alignas(32) u16 lanes[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            lanes[lane] = condition(operation, lane_flags(g, lane), cx[lane]) ? 0xFFFF : 0;
+        }
+        taken = load(lanes);
+    }
+
+    const __m256i next = _mm256_add_epi16(ip, splat(instr.length));
+    const __m256i target = _mm256_add_epi16(next, splat(static_cast<u16>(instr.immediate)));
+    store(g.ip, _mm256_blendv_epi8(next, target, taken), mask);
+}
+
+/**
+ * Executes the instruction on the machine of the lane. A lane which wrote into the program or
+ * changed CS can't follow the others anymore, so it's run to the end on its own.
+ */
+static void execute_scalar(group& g,
+                           simulator::machine& m,
+                           const entry& e,
+                           const size_t lane,
+                           const u16 end,
+                           const u64 limit) {
+    for (u8 reg = 0; reg < 8; reg++) m.regs.set_word(reg, g.regs[reg][lane]);
+    m.flags = lane_flags(g, lane);
+    m.ip = g.ip[lane] + e.instr.length;
+
+    const ExecutionError error = e.handler(m, e.instr);
+    for (u8 reg = 0; reg < 8; reg++) g.regs[reg][lane] = m.regs.word(reg);
+    store_flags(g, lane, m.flags);
+    if (error != ExecutionError::NONE) {
+        g.error[lane] = error;
+        g.stopped[lane] = 0xFFFF;
+        return;
+    }
+
+    if (m.code_modified || m.segments[static_cast<u8>(simulator::Segment::CS)] != 0) {
+        m.executed = g.executed[lane] + g.pending[lane] + 1;
+        decoder::DecodingError decoding_error = decoder::DecodingError::NONE;
+        g.error[lane] = simulator::run(m, end, limit, &decoding_error);
+        // blocks::run decodes the instruction before it checks the limit
+        if (g.error[lane] == ExecutionError::INSTRUCTION_LIMIT) {
+            const u32 address = m.physical(simulator::Segment::CS, m.ip);
+            Instruction instr{};
+            if (decoder::decode({ m.memory.get() + address, MEMORY_SIZE - address }, &instr) != decoder::DecodingError::NONE) {
+                g.error[lane] = ExecutionError::DECODING_FAILED;
+            }
+        }
+        g.detached[lane] = true;
+        g.stopped[lane] = 0xFFFF;
+    }
+}
+
+/**
+ * Executes at most `steps` instructions in every lane. Returns earlier once a lane is finished,
+ * so it can be refilled.
+ */
+__attribute__((target("avx2")))
+static void run_steps(group& g,
+                      program_table& t,
+                      const std::span<std::unique_ptr<simulator::machine>> machines,
+                      const u16 end,
+                      const u64 steps,
+                      const u64 limit,
+                      summary* s) {
+    const __m256i ends = splat(end);
+    u32 running = 0;
+    for (u64 step = 0; step < steps; step++) {
+        const __m256i ip = load(g.ip);
+        const __m256i live = _mm256_andnot_si256(load(g.stopped), less(ip, ends));
+        const u32 live_bits = _mm256_movemask_epi8(live);
+        if (live_bits == 0 || (step > 0 && live_bits != running)) return;
+        running = live_bits;
+
+        // Lowest IP of the live lanes
+        const __m256i candidates = _mm256_or_si256(ip, _mm256_xor_si256(live, splat(0xFFFF)));
+        const __m128i low = _mm_minpos_epu16(_mm256_castsi256_si128(candidates));
+        const __m128i high = _mm_minpos_epu16(_mm256_extracti128_si256(candidates, 1));
+        const u16 position = static_cast<u16>(std::min(_mm_cvtsi128_si32(low) & 0xFFFF, _mm_cvtsi128_si32(high) & 0xFFFF));
+        const __m256i active = _mm256_and_si256(live, _mm256_cmpeq_epi16(ip, splat(position)));
+
+        const entry* e = find(t, position);
+        if (!e) {
+            for (u32 bits = _mm256_movemask_epi8(active) & 0x55555555; bits; bits &= bits - 1) {
+                const size_t lane = __builtin_ctz(bits) / 2;
+                g.error[lane] = ExecutionError::DECODING_FAILED;
+                g.stopped[lane] = 0xFFFF;
+            }
+            continue;
+        }
+
+        switch (e->path) {
+            case Path::VECTOR:
+                execute_vector(g, e->instr, active);
+                s->vector_steps += 1;
+                break;
+            case Path::JUMP:
+                execute_jump(g, e->instr, ip, active);
+                s->vector_steps += 1;
+                break;
+            case Path::SCALAR:
+                for (u32 bits = _mm256_movemask_epi8(active) & 0x55555555; bits; bits &= bits - 1) {
+                    const size_t lane = __builtin_ctz(bits) / 2;
+                    execute_scalar(g, *machines[lane], *e, lane, end, limit);
+                    s->scalar_instructions += 1;
+                }
+                break;
+        }
+        if (e->path != Path::JUMP) store(g.ip, _mm256_add_epi16(ip, splat(e->instr.length)), active);
+        // Active lanes are all ones, subtracting them counts the instruction
+        store(g.pending, _mm256_sub_epi16(load(g.pending), active));
+    }
+}
+
+// Restores the machine of the lane and loads the vector into the lane
+static void start(group& g,
+                  simulator::machine& m,
+                  const snapshot::snapshot& initial,
+                  const size_t lane,
+                  const size_t index,
+                  const simulator::register_file& regs) {
+    snapshot::restore(m, initial);
+    // Every page of the program is marked as code, restored pages are not modified code
+    m.code_modified = false;
+    m.modified_pages.clear();
+
+    for (u8 reg = 0; reg < 8; reg++) g.regs[reg][lane] = regs.word(reg);
+    g.ip[lane] = initial.ip;
+    store_flags(g, lane, initial.flags);
+    g.stopped[lane] = 0;
+    g.pending[lane] = 0;
+    g.executed[lane] = initial.executed;
+    g.error[lane] = ExecutionError::NONE;
+    g.detached[lane] = false;
+    g.index[lane] = index;
+}
+
+static result finish(group& g, program_table& t, const simulator::machine& m, const size_t lane, const u16 end) {
+    result r{};
+    if (g.detached[lane]) {
+        r = result { m.regs, m.ip, m.flags.get(), m.executed, g.error[lane] };
+    } else {
+        for (u8 reg = 0; reg < 8; reg++) r.regs.set_word(reg, g.regs[reg][lane]);
+        r.ip = g.ip[lane];
+        r.flags = lane_flags(g, lane).get();
+        r.executed = g.executed[lane];
+        if (g.stopped[lane]) r.error = g.error[lane];
+        // blocks::run decodes the instruction before it checks the limit
+        else if (g.ip[lane] < end) r.error = find(t, g.ip[lane]) ? ExecutionError::INSTRUCTION_LIMIT : ExecutionError::DECODING_FAILED;
+    }
+    g.index[lane] = SIZE_MAX;
+    g.stopped[lane] = 0xFFFF;
+    return r;
+}
+
+static summary run_lanes(const std::span<const u8> program,
+                         const std::span<const simulator::register_file> vectors,
+                         const u64 limit,
+                         const std::span<result> results) {
+    summary s{};
+    s.avx2 = true;
+    const u16 end = static_cast<u16>(std::min<size_t>(program.size(), 0xFFFF));
+
+    std::vector<std::unique_ptr<simulator::machine>> machines{};
+    snapshot::snapshot initial{};
+    for (size_t lane = 0; lane < LANES; lane++) {
+        simulator::machine& m = *machines.emplace_back(std::make_unique<simulator::machine>());
+        m.load(program);
+        if (lane == 0) snapshot::take(m, &initial);
+
+        // Writes into the program detach the lane, instructions may run past the end of it
+        const u32 last_page = std::min<u32>(end + MAX_INSTRUCTION_LENGTH, MEMORY_SIZE - 1) / CODE_PAGE_SIZE;
+        for (u32 page = 0; page <= last_page; page++) m.code_pages[page / 64] |= u64{1} << (page % 64);
+    }
+
+    program_table t { initial.memory.get(), std::vector<i32>(end, -1) };
+    const std::unique_ptr<group> g = std::make_unique<group>();
+    for (size_t lane = 0; lane < LANES; lane++) {
+        g->index[lane] = SIZE_MAX;
+        g->stopped[lane] = 0xFFFF;
+    }
+
+    size_t next = 0;
+    while (true) {
+        bool busy = false;
+        u64 steps = LANES_FLUSH;
+        for (size_t lane = 0; lane < LANES; lane++) {
+            while (true) {
+                if (g->index[lane] != SIZE_MAX) {
+                    const bool finished = g->stopped[lane] || g->ip[lane] >= end || g->executed[lane] >= limit;
+                    if (!finished) break;
+                    const size_t index = g->index[lane];
+                    if (g->detached[lane]) s.detached += 1;
+                    results[index] = finish(*g, t, *machines[lane], lane, end);
+                    s.executed += results[index].executed;
+                }
+                if (next == vectors.size()) break;
+                start(*g, *machines[lane], initial, lane, next, vectors[next]);
+                next += 1;
+            }
+            if (g->index[lane] == SIZE_MAX) continue;
+            busy = true;
+            // No lane can run past the limit before the counters are checked again
+            steps = std::min(steps, limit - g->executed[lane]);
+        }
+        if (!busy) break;
+
+        run_steps(*g, t, machines, end, steps, limit, &s);
+        for (size_t lane = 0; lane < LANES; lane++) {
+            g->executed[lane] += g->pending[lane];
+            g->pending[lane] = 0;
+        }
+    }
+    return s;
+}
+
+#endif
+
+summary lanes::run(const std::span<const u8> program,
+                   const std::span<const simulator::register_file> vectors,
+                   const u64 limit,
+                   const std::span<result> results) {
+#ifdef LANES_X86
+    if (__builtin_cpu_supports("avx2")) return run_lanes(program, vectors, limit, results);
+#endif
+    return run_each(program, vectors, limit, results);
+}
@@ -0,0 +1,57 @@
+#ifndef VM8086_LANES_H
+#define VM8086_LANES_H
+
+// Machines executed in lockstep, a register of every lane fills one 256-bit vector
+#define LANES 16
+// Lanes count their instructions in 16 bits, the counters are added up after this many steps at most
+#define LANES_FLUSH (1 << 15)
+
+#include <utils/types.h>
+#include <span>
+#include "simulator.h"
+
+namespace lanes {
+
+    // Final state of one run
+    struct result {
+        simulator::register_file regs{};
+        u16 ip = 0;
+        // simulator::FlagBit
+        u16 flags = 0;
+        u64 executed = 0;
+        simulator::ExecutionError error = simulator::ExecutionError::NONE;
+    };
+
+    struct summary {
+        // Instructions executed by all the runs
+        u64 executed = 0;
+        // Vector operations, every one executes an instruction in all lanes at the same IP
+        u64 vector_steps = 0;
+        // Instructions executed one lane at a time
+        u64 scalar_instructions = 0;
+        // Runs which wrote into the program or changed CS, they were finished on their own
+        size_t detached = 0;
+        // Lanes were executed with AVX2, otherwise every run was executed on its own
+        bool avx2 = false;
+    };
+
+    /**
+     * Runs the program once for every vector of initial general purpose registers, with the same
+     * results as running a machine restored from a snapshot before every run.
+     *
+     * LANES machines run in lockstep. Registers and lazy flags are kept as one vector per register,
+     * a lane per machine, so register and immediate forms of MOV, ADD, SUB and CMP are executed
+     * as AVX2 operations on every lane at once, and conditional jumps and loops compute a mask of
+     * the lanes which take them. Lanes at the lowest IP are executed while the others are masked
+     * out, so lanes which diverged join again once they reach the same instruction. A lane which
+     * finished is refilled with the next vector. Instructions with memory or segment operands are
+     * executed lane by lane on the machine of the lane.
+     */
+    summary run(std::span<const u8> program,
+                std::span<const simulator::register_file> vectors,
+                u64 limit,
+                std::span<result> results);
+
+}
+
+#endif //VM8086_LANES_H
@@ -1,25 +1,554 @@
 
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include <utils/bits.h>
 
 #include "decoder.h"
+#include "printer.h"
+#include "simulator.h"
+#include "blocks.h"
+#include "cycles.h"
 #include "io.h"
+#include "parallel.h"
+#include "boundaries.h"
+#include "flow.h"
+#include "cache.h"
+#include "batch.h"
+#include "stats.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "stream.h"
+#include "incremental.h"
+#include "lanes.h"
+#include "translate.h"
 
 using namespace std;
 
-int main() {
+struct options {
+    // Execute the program instead of printing it
+    bool exec = false;
+    // Print estimated clocks of every instruction
+    bool cycles = false;
+    // Only count instructions
+    bool count = false;
+    // Only print the instruction mix
+    bool stats = false;
+    // Follow the control flow from the entry point instead of the linear sweep
+    bool cfg = false;
+    // Print bytes which fail to decode as data and continue
+    bool resilient = false;
+    // Disassemble every program from the paths into its own file
+    bool batch = false;
+    // Read, decode and print the program on separate threads without loading it as a whole
+    bool stream = false;
+    cycles::Model model = cycles::Model::I8086;
+    // Syntax of the listing, clocks are always printed in NASM syntax
+    format::Syntax syntax = format::Syntax::NASM;
+    // Maximum number of instructions to execute
+    u64 limit = 100'000'000;
+    // Threads which disassemble the program, 0 means one per core
+    unsigned threads = 1;
+    // Directory with decoded programs, keyed by the hash of the program
+    const char* cache = nullptr;
+    // File with the previous decode of the program, only the changes are decoded again
+    const char* incremental = nullptr;
+    // Directory of the batch listings
+    const char* output = ".";
+    // File which receives the trace of the execution
+    const char* trace = nullptr;
+    // Trace file to replay instead of a program
+    const char* replay = nullptr;
+    // Instructions to replay, every instruction of the trace is printed if there is no limit
+    u64 step = ~u64{0};
+    // Initial registers of the runs, the program is executed once per vector
+    const char* vectors = nullptr;
+    // Run the vectors on several machines in lockstep
+    bool lanes = false;
+    // File which receives the program translated into C++, see vm8086_runner
+    const char* translate = nullptr;
+    // Programs, only batch mode takes more than one
+    vector<const char*> paths{};
+};
+
+bool parse_options(const int argc, char** argv, options* opts) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--exec") == 0) opts->exec = true;
+        else if (strcmp(arg, "--cycles") == 0) opts->cycles = true;
+        else if (strcmp(arg, "--count") == 0) opts->count = true;
+        else if (strcmp(arg, "--stats") == 0) opts->stats = true;
+        else if (strcmp(arg, "--cfg") == 0) opts->cfg = true;
+        else if (strcmp(arg, "--resilient") == 0) opts->resilient = true;
+        else if (strcmp(arg, "--batch") == 0) opts->batch = true;
+        else if (strcmp(arg, "--stream") == 0) opts->stream = true;
+        else if (strcmp(arg, "--lanes") == 0) opts->lanes = true;
+        else if (strcmp(arg, "--8088") == 0) opts->model = cycles::Model::I8088;
+        else if (strcmp(arg, "--limit") == 0 && i + 1 < argc) opts->limit = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(arg, "--threads") == 0 && i + 1 < argc) opts->threads = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(arg, "--cache") == 0 && i + 1 < argc) opts->cache = argv[++i];
+        else if (strcmp(arg, "--incremental") == 0 && i + 1 < argc) opts->incremental = argv[++i];
+        else if (strcmp(arg, "--output") == 0 && i + 1 < argc) opts->output = argv[++i];
+        else if (strcmp(arg, "--trace") == 0 && i + 1 < argc) opts->trace = argv[++i];
+        else if (strcmp(arg, "--replay") == 0 && i + 1 < argc) opts->replay = argv[++i];
+        else if (strcmp(arg, "--step") == 0 && i + 1 < argc) opts->step = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(arg, "--vectors") == 0 && i + 1 < argc) opts->vectors = argv[++i];
+        else if (strcmp(arg, "--translate") == 0 && i + 1 < argc) opts->translate = argv[++i];
+        else if (strcmp(arg, "--syntax") == 0 && i + 1 < argc) {
+            if (!format::find_syntax(argv[++i], &opts->syntax)) return false;
+        }
+        else if (arg[0] == '-' && arg[1] == '-') return false;
+        else opts->paths.push_back(arg);
+    }
+    // Only the simulation without clocks is traced
+    if (opts->trace && (!opts->exec || opts->cycles)) return false;
+    if (opts->vectors && (!opts->exec || opts->cycles || opts->trace)) return false;
+    if (opts->lanes && !opts->vectors) return false;
+    // Batch mode only writes the listings
+    if (opts->batch && (opts->exec || opts->count || opts->stats || opts->cfg || opts->resilient || opts->cache
+            || opts->replay)) return false;
+    if (opts->replay) return opts->paths.empty();
+    if (opts->translate && (opts->exec || opts->cycles || opts->count || opts->stats || opts->cfg || opts->resilient
+            || opts->batch || opts->cache || opts->stream || opts->incremental)) return false;
+    // Incremental runs only print the changed lines of the linear listing
+    if (opts->incremental && (opts->exec || opts->cycles || opts->count || opts->stats || opts->cfg || opts->resilient
+            || opts->batch || opts->cache || opts->stream)) return false;
+    // Execution, the count, the instruction mix and the control flow graph are separate modes, which don't
+    // print the linear listing, so they don't take its options either. Only execution prints clocks
+    const bool mode = opts->exec || opts->count || opts->stats || opts->cfg;
+    if (opts->exec + opts->count + opts->stats + opts->cfg > 1) return false;
+    if (mode && (opts->resilient || opts->cache || opts->threads != 1 || opts->syntax != format::Syntax::NASM)) return false;
+    if ((opts->count || opts->stats || opts->cfg) && opts->cycles) return false;
+    // Resilient decoding is a linear sweep on a single thread, which isn't cached
+    if (opts->resilient && (opts->cfg || opts->cache || opts->threads != 1)) return false;
+    // Streaming only prints the linear listing
+    if (opts->stream && (opts->exec || opts->cycles || opts->count || opts->stats || opts->cfg || opts->resilient
+            || opts->batch || opts->cache)) return false;
+    return opts->batch ? !opts->paths.empty() : opts->paths.size() <= 1;
+}
+
+void print_decoding_error(const decoder::DecodingError error, const u8 byte, const size_t pos) {
+    const char* error_message = decoder::decoding_error_message[static_cast<int>(error)];
+    cerr << "\nError: " << error_message << endl;
+    cerr << "Decoding failed on: byte = ";
+    bits::print_bits(cerr, byte);
+    cerr << ", position = " << pos << "\n";
+}
+
+// Prints the decoded program, followed by the error if decoding stopped before the end
+int print_decoded(const span<const u8> program,
+                  const span<const decoder::Instruction> instructions,
+                  const decoder::label_view labels,
+                  const decoder::DecodingError error,
+                  const size_t pos,
+                  const options& opts,
+                  printer::writer& out) {
+    if (opts.cycles) cycles::print_program(out, instructions, labels, opts.model);
+    else printer::print_program(out, instructions, labels, opts.syntax);
+
+    if (error != decoder::DecodingError::NONE) {
+        out.flush();
+        print_decoding_error(error, program[pos], pos);
+        return 1;
+    }
+    return 0;
+}
+
+// Prints the program from the cache, or decodes it and stores it in the cache
+int disassemble_cached(const span<const u8> program, const options& opts, printer::writer& out) {
+    cache::entry entry{};
+    if (entry.open(opts.cache, program)) {
+        return print_decoded(program, entry.instructions(), entry.labels(), entry.error(), entry.end(), opts, out);
+    }
+
+    vector<decoder::Instruction> instructions{};
+    size_t pos;
+    const decoder::DecodingError error = decoder::decode_program(program, instructions, &pos);
+    const decoder::label_table labels = decoder::find_labels(instructions);
+    const size_t end = error == decoder::DecodingError::NONE ? program.size() : pos;
+    if (!cache::store(opts.cache, program, instructions, labels, error, end)) {
+        cerr << "Warning: failed to write the cache: " << strerror(errno) << "\n";
+    }
+    return print_decoded(program, instructions, labels, error, end, opts, out);
+}
+
+// Decodes only the parts of the program which changed since the previous run and prints the changed lines
+int disassemble_incremental(const span<const u8> program, const options& opts, printer::writer& out) {
+    incremental::summary summary{};
+    if (!incremental::update(opts.incremental, program, out, opts.syntax, &summary)) {
+        out.flush();
+        cerr << "Warning: failed to write the incremental state: " << strerror(errno) << "\n";
+    }
+    if (!summary.full) incremental::print_summary(out, summary);
+
+    if (summary.error != decoder::DecodingError::NONE) {
+        out.flush();
+        print_decoding_error(summary.error, program[summary.end], summary.end);
+        return 1;
+    }
+    return 0;
+}
+
+int disassemble(const span<const u8> program, const options& opts, printer::writer& out) {
+    vector<decoder::Instruction> instructions{};
+    size_t pos;
+
+    if (opts.resilient) {
+        decoder::error_summary summary{};
+        decoder::decode_program_resilient(program, instructions, &summary);
+        const decoder::label_table labels = decoder::find_labels(instructions);
+        if (opts.cycles) cycles::print_program(out, instructions, labels, opts.model);
+        else printer::print_program(out, instructions, labels, opts.syntax);
+        // Listing in JSON is one object per line, the summary is the last of them
+        if (opts.syntax != format::Syntax::JSON) out.put('\n');
+        printer::print_error_summary(out, opts.cycles ? format::Syntax::NASM : opts.syntax, summary);
+        return 0;
+    }
+
+    if (opts.incremental) return disassemble_incremental(program, opts, out);
+    if (opts.cache) return disassemble_cached(program, opts, out);
+    if (opts.threads == 1 || opts.cycles) {
+        // Clocks are accumulated from the beginning of the program, so they are printed sequentially
+        const decoder::DecodingError error = decoder::decode_program(program, instructions, &pos);
+        const decoder::label_table labels = decoder::find_labels(instructions);
+        return print_decoded(program, instructions, labels, error, pos, opts, out);
+    }
+
+    const unsigned threads = opts.threads ? opts.threads : max(thread::hardware_concurrency(), 1u);
+    const decoder::DecodingError error = parallel::disassemble(program, threads, out, &pos, opts.syntax);
+    if (error != decoder::DecodingError::NONE) {
+        out.flush();
+        print_decoding_error(error, program[pos], pos);
+        return 1;
+    }
+    return 0;
+}
+
+int count(const span<const u8> program, printer::writer& out) {
+    size_t end;
+    const size_t instructions = boundaries::count(program, boundaries::best_implementation(), &end);
+    out.line();
+    out.write("Instructions: ", 14);
+    out.unsigned_integer(instructions);
+    out.put('\n');
+    if (end == program.size()) return 0;
+
+    // Length pre-pass doesn't know why it stopped, the decoder does
+    decoder::Instruction instr{};
+    out.flush();
+    print_decoding_error(decoder::decode(program.subspan(end), &instr), program[end], end);
+    return 1;
+}
+
+int print_stats(const span<const u8> program, printer::writer& out) {
+    const stats::mix mix = stats::collect(program, boundaries::best_implementation());
+    stats::print(out, mix);
+    if (mix.end == program.size()) return 0;
+
+    decoder::Instruction instr{};
+    out.flush();
+    print_decoding_error(decoder::decode(program.subspan(mix.end), &instr), program[mix.end], mix.end);
+    return 1;
+}
+
+int disassemble_reachable(const span<const u8> program, printer::writer& out) {
+    const flow::graph g = flow::build(program, 0);
+    const decoder::label_table labels = flow::find_labels(g);
+    flow::print_program(out, program, g, labels);
+    out.put('\n');
+    flow::print_graph(out, g);
+    return 0;
+}
+
+int execute(const span<const u8> program, const options& opts, printer::writer& out) {
+    simulator::machine m{};
+    blocks::cache cache{};
+    m.load(program);
+
+    trace::recorder recorder{};
+    if (opts.trace && !recorder.open(opts.trace, program)) {
+        cerr << "Error: failed to create the trace: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    decoder::DecodingError decoding_error = decoder::DecodingError::NONE;
+    const u16 end = static_cast<u16>(min<size_t>(program.size(), 0xFFFF));
+    simulator::ExecutionError error;
+    if (opts.cycles) {
+        // Labels are only used to name the jump targets and group clocks
+        vector<decoder::Instruction> instructions{};
+        size_t pos;
+        decoder::decode_program(program, instructions, &pos);
+        const decoder::label_table labels = decoder::find_labels(instructions);
+
+        error = cycles::run(out, m, end, opts.limit, labels, opts.model, &decoding_error);
+        out.put('\n');
+    } else {
+        error = blocks::run(m, cache, end, opts.limit, &decoding_error, opts.trace ? &recorder : nullptr);
+        if (opts.trace && !recorder.close(m)) cerr << "Warning: failed to write the trace: " << strerror(errno) << "\n";
+    }
+
+    simulator::print_state(out, m);
+    if (error == simulator::ExecutionError::NONE) return 0;
+
+    out.flush();
+    if (error == simulator::ExecutionError::DECODING_FAILED) {
+        print_decoding_error(decoding_error, m.read_byte(m.physical(simulator::Segment::CS, m.ip)), m.ip);
+    } else {
+        cerr << "\nError: " << simulator::execution_error_message[static_cast<int>(error)] << "\n";
+    }
+    return 1;
+}
+
+// <index>: <registers> ip=<ip> flags=<flags> executed=<instructions> [error]
+void print_run(printer::writer& out, const size_t index, const lanes::result& run) {
+    const static char* register_names[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" };
+    const static char flag_names[] = { 'C', 'P', 'A', 'Z', 'S', 'O' };
+    const static u16 flag_bits[] = { simulator::CF, simulator::PF, simulator::AF, simulator::ZF, simulator::SF, simulator::OF };
+
+    out.line();
+    out.unsigned_integer(index);
+    out.put(':');
+    for (u8 reg = 0; reg < 8; reg++) {
+        out.put(' ');
+        out.str(register_names[reg]);
+        out.write("=0x", 3);
+        out.hex(run.regs.word(reg), 4);
+    }
+    out.write(" ip=0x", 6);
+    out.hex(run.ip, 4);
+    out.write(" flags=", 7);
+    for (size_t i = 0; i < sizeof(flag_bits) / sizeof(flag_bits[0]); i++) {
+        if (run.flags & flag_bits[i]) out.put(flag_names[i]);
+    }
+    out.write(" executed=", 10);
+    out.unsigned_integer(run.executed);
+    if (run.error != simulator::ExecutionError::NONE) {
+        out.write(" error: ", 8);
+        out.str(simulator::execution_error_message[static_cast<int>(run.error)]);
+    }
+    out.put('\n');
+}
+
+// Executes the vectors on LANES machines in lockstep, prints the runs in the order of the vectors and the throughput
+int execute_lanes(const span<const u8> program,
+                  const span<const simulator::register_file> vectors,
+                  const options& opts,
+                  printer::writer& out) {
+    vector<lanes::result> results(vectors.size());
+    const auto start = chrono::steady_clock::now();
+    const lanes::summary summary = lanes::run(program, vectors, opts.limit, results);
+    const auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].error != simulator::ExecutionError::NONE) failed += 1;
+        print_run(out, i, results[i]);
+    }
+
+    out.line();
+    out.write("\nVectors: ", 10);
+    out.unsigned_integer(vectors.size());
+    out.write(", failed: ", 10);
+    out.unsigned_integer(failed);
+    out.write(", detached: ", 12);
+    out.unsigned_integer(summary.detached);
+    out.put('\n');
+
+    out.line();
+    out.write("Lanes: ", 7);
+    out.unsigned_integer(summary.avx2 ? LANES : 1);
+    out.write(", vector operations: ", 21);
+    out.unsigned_integer(summary.vector_steps);
+    out.write(", scalar instructions: ", 23);
+    out.unsigned_integer(summary.scalar_instructions);
+    out.put('\n');
+
+    out.line();
+    out.write("Machine instructions: ", 22);
+    out.unsigned_integer(summary.executed);
+    out.write(", per second: ", 14);
+    out.unsigned_integer(static_cast<u64>(static_cast<double>(summary.executed) * 1e9 / static_cast<double>(max<i64>(elapsed, 1))));
+    out.put('\n');
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Executes the program once for every vector of initial general purpose registers: 8 little-endian
+ * words ax, cx, dx, bx, sp, bp, si, di. The machine is restored from a snapshot between the runs,
+ * so only the memory written by the previous run is copied.
+ */
+int execute_vectors(const span<const u8> program, const options& opts, printer::writer& out) {
     io::input_stream is;
-    decoder::DecodingError error;
+    if (!is.open(opts.vectors)) {
+        cerr << "Error: failed to read the vectors: " << strerror(errno) << "\n";
+        return 1;
+    }
+    const span<const u8> vectors = is.data();
+    if (vectors.size() % sizeof(simulator::register_file) != 0) {
+        cerr << "Error: size of " << opts.vectors << " is not a multiple of " << sizeof(simulator::register_file) << " bytes\n";
+        return 1;
+    }
 
-    for (is.next(); !is.complete(); is.next()) {
-        if ((error = decoder::decode(is)) == decoder::DecodingError::NONE) continue;
+    const size_t count = vectors.size() / sizeof(simulator::register_file);
+    if (opts.lanes) {
+        return execute_lanes(program, { reinterpret_cast<const simulator::register_file*>(vectors.data()), count }, opts, out);
+    }
 
-        const char* error_message = decoder::decoding_error_message[static_cast<int>(error)];
-        cerr << "\nError: " << error_message << endl;
-        cerr << "Decoding failed on: byte = ";
-        bits::print_bits(cerr, is.byte());
-        cerr << ", position = " << is.pos << "\n";
+    simulator::machine m{};
+    blocks::cache cache{};
+    m.load(program);
+    snapshot::snapshot initial{};
+    snapshot::take(m, &initial);
+
+    const u16 end = static_cast<u16>(min<size_t>(program.size(), 0xFFFF));
+    size_t restored = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) restored += snapshot::restore(m, initial);
+        memcpy(&m.regs, vectors.data() + i * sizeof(simulator::register_file), sizeof(simulator::register_file));
+
+        decoder::DecodingError decoding_error = decoder::DecodingError::NONE;
+        const simulator::ExecutionError error = blocks::run(m, cache, end, opts.limit, &decoding_error);
+        if (error != simulator::ExecutionError::NONE) failed += 1;
+        print_run(out, i, lanes::result { m.regs, m.ip, m.flags.get(), m.executed, error });
+    }
+
+    out.line();
+    out.write("\nVectors: ", 10);
+    out.unsigned_integer(count);
+    out.write(", failed: ", 10);
+    out.unsigned_integer(failed);
+    out.write(", restored pages: ", 18);
+    out.unsigned_integer(restored);
+    out.put('\n');
+    return failed == 0 ? 0 : 1;
+}
+
+// Prints the instructions of the trace up to the step followed by the state after them,
+// or only the state if the step is given
+int replay(const options& opts, printer::writer& out) {
+    io::input_stream is;
+    if (!is.open(opts.replay)) {
+        cerr << "Error: failed to read the trace: " << strerror(errno) << "\n";
         return 1;
     }
+    trace::reader reader{};
+    if (!reader.open(is.data())) {
+        cerr << "Error: " << opts.replay << " is not a complete trace of this version\n";
+        return 1;
+    }
+
+    simulator::machine m{};
+    if (opts.step == ~u64{0}) {
+        trace::print_trace(out, m, reader, opts.step);
+        out.put('\n');
+    } else {
+        trace::replay(m, reader, opts.step);
+    }
+    simulator::print_state(out, m);
     return 0;
 }
+
+// Writes the C++ source of the translated program into the file and prints what was translated
+int translate_program(const span<const u8> program, const options& opts, printer::writer& out) {
+    const int fd = ::open(opts.translate, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Error: failed to create the translation: " << strerror(errno) << "\n";
+        return 1;
+    }
+    translate::summary summary{};
+    printer::writer source{fd};
+    translate::emit(source, program, &summary);
+    const bool written = source.flush();
+    source.fd = -1;
+    ::close(fd);
+    if (!written) {
+        cerr << "Error: failed to write the translation: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    out.line();
+    out.str("Blocks: ");
+    out.unsigned_integer(summary.blocks);
+    out.str(", instructions: ");
+    out.unsigned_integer(summary.instructions);
+    out.str(", dropped flag updates: ");
+    out.unsigned_integer(summary.dead_flags);
+    out.put('\n');
+    return 0;
+}
+
+int disassemble_stream(const options& opts, printer::writer& out) {
+    const int fd = opts.paths.empty() ? STDIN_FILENO : ::open(opts.paths[0], O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: failed to read the program: " << strerror(errno) << "\n";
+        return 1;
+    }
+    const stream::result r = stream::disassemble(fd, out, opts.syntax);
+    if (fd != STDIN_FILENO) ::close(fd);
+
+    if (r.read_error != 0) {
+        out.flush();
+        cerr << "Error: failed to read the program: " << strerror(r.read_error) << "\n";
+        return 1;
+    }
+    if (r.error != decoder::DecodingError::NONE) {
+        out.flush();
+        print_decoding_error(r.error, r.byte, r.pos);
+        return 1;
+    }
+    return 0;
+}
+
+int disassemble_batch(const options& opts, printer::writer& out) {
+    batch::settings settings{};
+    settings.directory = opts.output;
+    settings.threads = opts.threads ? opts.threads : max(thread::hardware_concurrency(), 1u);
+    settings.cycles = opts.cycles;
+    settings.syntax = opts.syntax;
+    settings.model = opts.model;
+
+    vector<batch::job> jobs = batch::collect(opts.paths, settings);
+    batch::run(jobs, settings);
+    return batch::print_summary(out, jobs) == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    options opts{};
+    if (!parse_options(argc, argv, &opts)) {
+        cerr << "Usage: vm8086 [--cycles [--8088]] [--threads <count>] [--resilient] [--stream] [--cache <dir>] [--incremental <file>] [--syntax nasm|masm|att|json] [program]\n";
+        cerr << "       vm8086 --count|--stats|--cfg [program]\n";
+        cerr << "       vm8086 --exec [--limit <instructions>] [--cycles [--8088]] [program]\n";
+        cerr << "       vm8086 --exec [--limit <instructions>] --trace <file> [program]\n";
+        cerr << "       vm8086 --exec [--limit <instructions>] --vectors <file> [--lanes] [program]\n";
+        cerr << "       vm8086 --replay <trace> [--step <instructions>]\n";
+        cerr << "       vm8086 --translate <file> [program]\n";
+        cerr << "       vm8086 --batch [--output <dir>] [--threads <count>] [--cycles [--8088]] [--syntax <syntax>] <program or dir>...\n";
+        return 1;
+    }
+
+    printer::writer out{STDOUT_FILENO};
+    if (opts.batch) return disassemble_batch(opts, out);
+    if (opts.replay) return replay(opts, out);
+    if (opts.stream) return disassemble_stream(opts, out);
+
+    io::input_stream is;
+    const bool opened = opts.paths.empty() ? is.open(STDIN_FILENO) : is.open(opts.paths[0]);
+    if (!opened) {
+        cerr << "Error: failed to read the program: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    if (opts.translate) return translate_program(is.data(), opts, out);
+    if (opts.exec && opts.vectors) return execute_vectors(is.data(), opts, out);
+    if (opts.exec) return execute(is.data(), opts, out);
+    if (opts.count) return count(is.data(), out);
+    if (opts.stats) return print_stats(is.data(), out);
+    if (opts.cfg) return disassemble_reachable(is.data(), out);
+    return disassemble(is.data(), opts, out);
+}
@@ -0,0 +1,160 @@
+#include "parallel.h"
+#include <algorithm>
+using namespace parallel;
+using decoder::DecodingError;
+using decoder::Instruction;
+
+// Decodes the chunk as if its first byte was the beginning of an instruction
+static void decode_speculative(const std::span<const u8> program, chunk& c) {
+    // Most of the instructions are 2-4 bytes long
+    c.speculative.reserve((c.end - c.begin) / 3);
+
+    Instruction instr{};
+    size_t pos = c.begin;
+    while (pos < c.end) {
+        c.error = decoder::decode(program.subspan(pos), &instr);
+        if (c.error != DecodingError::NONE) break;
+        c.speculative.push_back(instr);
+        pos += instr.length;
+    }
+    c.decoded_end = pos;
+}
+
+/**
+ * Decodes true instructions from `entry` until they reach one of the speculative boundaries.
+ * Decoding is deterministic, so from that point on the speculative instructions are the true
+ * ones. Usually they converge after one or two instructions. Returns the error on the true path.
+ */
+static DecodingError stitch(const std::span<const u8> program, chunk& c, const size_t entry, size_t* error_pos) {
+    c.entry = entry;
+    size_t speculative_pos = c.begin;
+    size_t index = 0;
+    size_t pos = entry;
+    Instruction instr{};
+
+    while (true) {
+        while (index < c.speculative.size() && speculative_pos < pos) speculative_pos += c.speculative[index++].length;
+        if (speculative_pos == pos) {
+            c.skip = index;
+            c.exit = c.decoded_end;
+            if (c.error != DecodingError::NONE) *error_pos = c.decoded_end;
+            return c.error;
+        }
+
+        // Paths didn't converge within the chunk, every instruction is in the lead
+        if (pos >= c.end) {
+            c.skip = c.speculative.size();
+            c.exit = pos;
+            return DecodingError::NONE;
+        }
+
+        const DecodingError error = decoder::decode(program.subspan(pos), &instr);
+        if (error != DecodingError::NONE) {
+            c.skip = c.speculative.size();
+            c.exit = pos;
+            *error_pos = pos;
+            return error;
+        }
+        c.lead.push_back(instr);
+        pos += instr.length;
+    }
+}
+
+// Calls f(pos, instr) for every true instruction of the chunk
+template <typename F>
+static void for_each_instruction(const chunk& c, F&& f) {
+    size_t pos = c.entry;
+    for (const Instruction& instr : c.lead) {
+        f(pos, instr);
+        pos += instr.length;
+    }
+    for (size_t i = c.skip; i < c.speculative.size(); i++) {
+        f(pos, c.speculative[i]);
+        pos += c.speculative[i].length;
+    }
+}
+
+// Sorted jump targets of the chunk
+static std::vector<i64> find_targets(const chunk& c) {
+    std::vector<i64> targets{};
+    for_each_instruction(c, [&targets](const size_t pos, const Instruction& instr) {
+        if (instr.dest.kind == decoder::OperandKind::RELATIVE) targets.push_back(decoder::jump_target(instr, pos));
+    });
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    return targets;
+}
+
+// Targets from every chunk which point into [entry, exit) of the chunk, or at exit for the last one
+static void find_chunk_labels(chunk& c, const std::vector<std::vector<i64>>& targets, const bool last) {
+    std::vector<i64> inside{};
+    for (const std::vector<i64>& t : targets) {
+        const auto from = std::lower_bound(t.begin(), t.end(), static_cast<i64>(c.entry));
+        const auto to = last
+                ? std::upper_bound(from, t.end(), static_cast<i64>(c.exit))
+                : std::lower_bound(from, t.end(), static_cast<i64>(c.exit));
+        inside.insert(inside.end(), from, to);
+    }
+    std::sort(inside.begin(), inside.end());
+    inside.erase(std::unique(inside.begin(), inside.end()), inside.end());
+
+    // Only targets at the beginning of an instruction can be labeled
+    auto target = inside.begin();
+    const auto label = [&](const size_t pos) {
+        while (target != inside.end() && *target < static_cast<i64>(pos)) ++target;
+        if (target != inside.end() && *target == static_cast<i64>(pos)) c.labels.push_back(static_cast<u32>(pos));
+    };
+    for_each_instruction(c, [&label](const size_t pos, const Instruction&) { label(pos); });
+    // The end of the program is a valid target as well
+    if (last) label(c.exit);
+}
+
+decoder::DecodingError parallel::disassemble(const std::span<const u8> program,
+                                             const unsigned threads,
+                                             printer::writer& out,
+                                             size_t* pos,
+                                             const format::Syntax syntax) {
+    const size_t chunk_size = std::max<size_t>(PARALLEL_MIN_CHUNK,
+                                               program.size() / (std::max(threads, 1u) * PARALLEL_CHUNKS_PER_THREAD) + 1);
+    const size_t count = (program.size() + chunk_size - 1) / chunk_size;
+    std::vector<chunk> chunks(count);
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].begin = i * chunk_size;
+        chunks[i].end = std::min(chunks[i].begin + chunk_size, program.size());
+    }
+
+    for_each(count, threads, [&](const size_t i) { decode_speculative(program, chunks[i]); });
+
+    // True instructions enter every chunk where they leave the previous one
+    DecodingError error = DecodingError::NONE;
+    size_t used = 0;
+    *pos = 0;
+    while (used < count && error == DecodingError::NONE) {
+        chunk& c = chunks[used++];
+        error = stitch(program, c, *pos, pos);
+        if (error == DecodingError::NONE) *pos = c.exit;
+    }
+
+    std::vector<std::vector<i64>> targets(used);
+    for_each(used, threads, [&](const size_t i) { targets[i] = find_targets(chunks[i]); });
+    for_each(used, threads, [&](const size_t i) { find_chunk_labels(chunks[i], targets, i + 1 == used); });
+
+    decoder::label_table labels{};
+    for (size_t i = 0; i < used; i++) {
+        labels.positions.insert(labels.positions.end(), chunks[i].labels.begin(), chunks[i].labels.end());
+    }
+
+    for_each(used, threads, [&](const size_t i) {
+        chunk& c = chunks[i];
+        const size_t lead_end = printer::print_instructions(c.out, c.lead, labels, c.entry, syntax);
+        const std::span<const Instruction> rest = std::span<const Instruction>(c.speculative).subspan(c.skip);
+        printer::print_instructions(c.out, rest, labels, lead_end, syntax);
+
+        // Label after the last instruction
+        const i32 label = i + 1 == used ? labels.find(static_cast<i64>(c.exit)) : -1;
+        if (label >= 0) printer::print_label(c.out, syntax, label, c.exit);
+    });
+
+    for (size_t i = 0; i < used; i++) out.splice(chunks[i].out);
+    return error;
+}
@@ -0,0 +1,140 @@
+#ifndef VM8086_PARALLEL_H
+#define VM8086_PARALLEL_H
+
+// Smaller chunks don't pay for the thread synchronization
+#define PARALLEL_MIN_CHUNK (1 << 16)
+// Chunks per thread, so a slow chunk doesn't stall the others
+#define PARALLEL_CHUNKS_PER_THREAD 4
+
+#include <utils/types.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+#include "decoder.h"
+#include "printer.h"
+
+namespace parallel {
+
+    /**
+     * Runs task(index) for every index in [0, count) on `threads` threads. Threads take the next
+     * index once they are done with the previous one, so uneven tasks are balanced.
+     */
+    template <typename F>
+    void for_each(const size_t count, const unsigned threads, F&& task) {
+        std::atomic<size_t> next{0};
+        const auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) task(i);
+        };
+
+        std::vector<std::thread> pool{};
+        for (unsigned i = 1; i < threads && i < count; i++) pool.emplace_back(worker);
+        worker();
+        for (std::thread& thread : pool) thread.join();
+    }
+
+    /**
+     * Same as for_each, but the indices are split between the threads up front. A thread takes
+     * indices from the beginning of its own range, and once the range is empty it steals the second
+     * half of the range of another thread. Task is called as task(index, thread), so every thread
+     * can reuse its own state between the tasks.
+     */
+    template <typename F>
+    void for_each_stealing(const size_t count, const unsigned threads, F&& task) {
+        struct range {
+            std::mutex lock;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+
+        const size_t workers = std::max<size_t>(std::min<size_t>(threads, count), 1);
+        const std::unique_ptr<range[]> ranges{new range[workers]};
+        for (size_t i = 0; i < workers; i++) {
+            ranges[i].begin = count * i / workers;
+            ranges[i].end = count * (i + 1) / workers;
+        }
+
+        const auto take = [&](const size_t self, size_t* index) {
+            {
+                std::lock_guard<std::mutex> guard{ranges[self].lock};
+                if (ranges[self].begin < ranges[self].end) {
+                    *index = ranges[self].begin++;
+                    return true;
+                }
+            }
+            // Nothing is ever added, so one pass over the others is enough to see that everything is taken
+            for (size_t i = 1; i < workers; i++) {
+                range& victim = ranges[(self + i) % workers];
+                size_t begin;
+                size_t end;
+                {
+                    std::lock_guard<std::mutex> guard{victim.lock};
+                    if (victim.begin >= victim.end) continue;
+                    begin = victim.end - (victim.end - victim.begin + 1) / 2;
+                    end = victim.end;
+                    victim.end = begin;
+                }
+                std::lock_guard<std::mutex> guard{ranges[self].lock};
+                ranges[self].begin = begin + 1;
+                ranges[self].end = end;
+                *index = begin;
+                return true;
+            }
+            return false;
+        };
+        const auto worker = [&](const size_t self) {
+            size_t index;
+            while (take(self, &index)) task(index, static_cast<unsigned>(self));
+        };
+
+        std::vector<std::thread> pool{};
+        for (size_t i = 1; i < workers; i++) pool.emplace_back(worker, i);
+        worker(0);
+        for (std::thread& thread : pool) thread.join();
+    }
+
+    /**
+     * Part of the program decoded by a single thread. It is decoded speculatively from `begin`,
+     * which is not necessarily an instruction boundary, and stitched to the previous chunk later.
+     */
+    struct chunk {
+        size_t begin = 0;
+        size_t end = 0;
+
+        // Instructions decoded from `begin` until the first one that starts at or after `end`
+        std::vector<decoder::Instruction> speculative{};
+        // Position after the last speculative instruction
+        size_t decoded_end = 0;
+        decoder::DecodingError error = decoder::DecodingError::NONE;
+
+        // Position of the first true instruction of the chunk
+        size_t entry = 0;
+        // True instructions decoded from `entry` until they converge with the speculative ones
+        std::vector<decoder::Instruction> lead{};
+        // Speculative instructions before the convergence point, they are not a part of the program
+        size_t skip = 0;
+        // Position after the last true instruction of the chunk
+        size_t exit = 0;
+
+        // Labels which point into the chunk
+        std::vector<u32> labels{};
+        printer::writer out{-1};
+    };
+
+    /**
+     * Disassembles the program on `threads` threads. Output is identical to the one of the
+     * sequential decode_program, find_labels and print_program. If decoding fails, `pos` is
+     * the position of the instruction that failed to decode.
+     */
+    decoder::DecodingError disassemble(std::span<const u8> program,
+                                       unsigned threads,
+                                       printer::writer& out,
+                                       size_t* pos,
+                                       format::Syntax syntax = format::Syntax::NASM);
+
+}
+
+#endif //VM8086_PARALLEL_H
@@ -3,88 +3,199 @@
 //
 
 #include "printer.h"
-#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include "instrument.h"
 using namespace printer;
 
-const static char *register_names_byte[] = {
-        "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"
-};
+static_assert(WRITER_MAX_LINE >= FORMAT_MAX_LINE + 1, "Every formatted line has to fit with its line break");
 
-const static char *register_names_word[] = {
-        "ax", "cx", "dx", "bx", "sp", "bp", "si", "di"
-};
+printer::writer::writer(const int fd): fd(fd), buffer(WRITER_BUFFER_SIZE) {}
 
-const static char *register_pattern[] = {
-        "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"
-};
+printer::writer::~writer() {
+    flush();
+}
 
-const char* printer::get_register_name(bool word_data, u8 reg) {
-    return word_data ? register_names_word[reg] : register_names_byte[reg];
+void printer::writer::integer(const i32 value) {
+    size += format::integer(value, buffer.data() + size);
 }
 
-const char* printer::get_register_pattern(u8 reg) {
-    return register_pattern[reg];
+void printer::writer::unsigned_integer(const u64 value) {
+    size += format::unsigned_integer(value, buffer.data() + size);
 }
 
-// <instr> <arg1: str>, <arg2: str>
-void printer::print_instr_str_str(bool invert, const char* instr, const char* arg1, const char* arg2) {
-    std::cout << instr << " ";
-    if (!invert) std::cout << arg1 << ", " << arg2;
-    else std::cout << arg2 << ", " << arg1;
-    std::cout << "\n";
+void printer::writer::hex(const u32 value, const int digits) {
+    size += format::hex(value, digits, buffer.data() + size);
 }
 
-// [<arg1: str> + <addr: int>]
-void print_arg_str_int(const char* arg1, const i32 addr) {
-    if (addr == 0) {
-        std::cout << "[";
-        if (arg1) std::cout << arg1;
-        std::cout << "]";
-    }
-    else if (addr > 0) {
-        std::cout << "[";
-        if (arg1) std::cout << arg1 << " + ";
-        std::cout << addr << "]";
+// Writes all bytes, retrying interrupted and partial writes
+static bool write_all(const int fd, const char* data, const size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        const ssize_t bytes = ::write(fd, data + written, length - written);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        written += bytes;
     }
-    else {
-        std::cout << "[";
-        if (arg1) std::cout << arg1 << " - ";
-        std::cout << std::abs(addr) << "]";
+    return true;
+}
+
+bool printer::writer::flush() {
+    if (fd < 0) return true;
+    const bool written = write_all(fd, buffer.data(), size);
+    size = 0;
+    return written;
+}
+
+bool printer::writer::splice(writer& other) {
+    bool written = true;
+    if (fd >= 0) {
+        // Large block goes straight to the file descriptor without copying
+        written = flush() && write_all(fd, other.buffer.data(), other.size);
+    } else {
+        if (buffer.size() - size < other.size + WRITER_MAX_LINE) buffer.resize(size + other.size + WRITER_MAX_LINE);
+        write(other.buffer.data(), other.size);
     }
+    other.size = 0;
+    return written;
 }
 
-// <instr> [<arg1: str> + <addr: int>], <arg2: str>
-void printer::print_instr_str_int_str(const char* instr, const char* arg1, const i32 addr, const char* arg2) {
-    std::cout << instr << " ";
-    print_arg_str_int(arg1, addr);
-    std::cout << ", " << arg2 << "\n";
+void printer::writer::grow() {
+    if (fd >= 0) flush();
+    if (buffer.size() - size < WRITER_MAX_LINE) buffer.resize(buffer.size() * 2);
 }
 
-// <instr> <arg1: str>, [<arg2: str> + <addr: int>]
-void printer::print_instr_str_str_int(const char* instr, const char* arg1, const char* arg2, const i32 addr) {
-    std::cout << instr << " " << arg1 << ", ";
-    print_arg_str_int(arg2, addr);
-    std::cout << "\n";
+void printer::print_instruction(writer& out, const decoder::Instruction& instr, const i32 label) {
+    print_operation(out, instr, label);
+    out.put('\n');
 }
 
-// <instr> <arg1: str>, <data: int>
-void printer::print_instr_str_int(const char* instr, const char* arg1, const i32 data) {
-    std::cout << instr << " " << arg1 << ", " << data << "\n";
+void printer::print_operation(writer& out, const decoder::Instruction& instr, const i32 label) {
+    print_operation(out, format::Syntax::NASM, instr, label, 0);
 }
 
-// <instr> [<arg1: str> + <addr: int>], <data: int>
-void printer::print_instr_str_int_int(const char* instr, const char* arg1, const i32 addr, const i32 data) {
-    std::cout << instr << " ";
-    print_arg_str_int(arg1, addr);
-    std::cout << ", " << data << "\n";
+void printer::print_operation(writer& out,
+                              const format::Syntax syntax,
+                              const decoder::Instruction& instr,
+                              const i32 label,
+                              const size_t pos) {
+    INSTRUMENT_TIME(PRINT);
+    out.line();
+    out.size += format::instruction(format::get(syntax), instr, label, pos, out.buffer.data() + out.size);
 }
 
-// <instr> <data: int>
-void printer::print_instr_int(const char* const instr, const i32 data) {
-    std::cout << instr << " " << data << "\n";
+// label_<index>:
+void printer::print_label(writer& out, const i32 label) {
+    print_label(out, format::Syntax::NASM, label, 0);
 }
 
-// <instr> <arg1: str>
-void printer::print_instr_str(const char* const instr, const char* const arg1) {
-    std::cout << instr << " " << arg1 << "\n";
+void printer::print_label(writer& out, const format::Syntax syntax, const i32 label, const size_t pos) {
+    out.line();
+    out.size += format::label(format::get(syntax), label, pos, out.buffer.data() + out.size);
+    out.put('\n');
+}
+
+void printer::print_data(writer& out, const std::span<const u8> bytes) {
+    out.line();
+    out.write("db ", 3);
+    for (size_t i = 0; i < bytes.size(); i++) {
+        if (i != 0) out.write(", ", 2);
+        out.write("0x", 2);
+        out.hex(bytes[i], 2);
+    }
+    out.put('\n');
+}
+
+static void print_json_error_summary(printer::writer& out, const decoder::error_summary& summary) {
+    out.line();
+    out.str("{\"errors\":");
+    out.unsigned_integer(summary.errors.size());
+    out.str(",\"counts\":{");
+    bool first = true;
+    for (size_t error = 0; error < sizeof(summary.counts) / sizeof(summary.counts[0]); error++) {
+        if (summary.counts[error] == 0) continue;
+        out.line();
+        if (!first) out.put(',');
+        first = false;
+        out.put('"');
+        out.str(decoder::decoding_error_message[error]);
+        out.str("\":");
+        out.unsigned_integer(summary.counts[error]);
+    }
+    out.str("},\"skipped\":[");
+    for (size_t i = 0; i < summary.errors.size(); i++) {
+        const decoder::error_summary::skipped& skipped = summary.errors[i];
+        out.line();
+        if (i > 0) out.put(',');
+        out.str("{\"pos\":");
+        out.unsigned_integer(skipped.pos);
+        out.str(",\"error\":\"");
+        out.str(decoder::decoding_error_message[static_cast<int>(skipped.error)]);
+        out.str("\"}");
+    }
+    out.line();
+    out.str("]}\n");
+}
+
+void printer::print_error_summary(writer& out, const format::Syntax syntax, const decoder::error_summary& summary) {
+    if (syntax == format::Syntax::JSON) return print_json_error_summary(out, summary);
+
+    out.line();
+    out.write("; Decoding errors: ", 19);
+    out.unsigned_integer(summary.errors.size());
+    out.put('\n');
+    for (size_t error = 0; error < sizeof(summary.counts) / sizeof(summary.counts[0]); error++) {
+        if (summary.counts[error] == 0) continue;
+        out.line();
+        out.write(";   ", 4);
+        out.str(decoder::decoding_error_message[error]);
+        out.write(": ", 2);
+        out.unsigned_integer(summary.counts[error]);
+        out.put('\n');
+    }
+    for (const decoder::error_summary::skipped& skipped : summary.errors) {
+        out.line();
+        out.write(";   at position ", 16);
+        out.unsigned_integer(skipped.pos);
+        out.write(": ", 2);
+        out.str(decoder::decoding_error_message[static_cast<int>(skipped.error)]);
+        out.put('\n');
+    }
+}
+
+size_t printer::print_instructions(writer& out,
+                                   const std::span<const decoder::Instruction> instructions,
+                                   const decoder::label_view labels,
+                                   const size_t start,
+                                   const format::Syntax syntax) {
+    auto label = std::lower_bound(labels.positions.begin(), labels.positions.end(), start);
+    size_t pos = start;
+
+    for (const decoder::Instruction& instr : instructions) {
+        if (label != labels.positions.end() && *label == pos) {
+            print_label(out, syntax, labels.name(label - labels.positions.begin()), pos);
+            ++label;
+        }
+        const i32 target = instr.dest.kind == decoder::OperandKind::RELATIVE
+                ? labels.find(decoder::jump_target(instr, pos))
+                : -1;
+        print_operation(out, syntax, instr, target, pos);
+        out.put('\n');
+        pos += instr.length;
+    }
+    return pos;
+}
+
+void printer::print_program(writer& out,
+                            const std::span<const decoder::Instruction> instructions,
+                            const decoder::label_view labels,
+                            const format::Syntax syntax) {
+    const size_t end = print_instructions(out, instructions, labels, 0, syntax);
+
+    // Label after the last instruction
+    const i32 label = labels.find(static_cast<i64>(end));
+    if (label >= 0) print_label(out, syntax, label, end);
 }
@@ -5,36 +5,109 @@
 #ifndef VM8086_PRINTER_H
 #define VM8086_PRINTER_H
 
+#define WRITER_BUFFER_SIZE (1 << 16)
+#define WRITER_MAX_LINE 256
+
 #include <utils/types.h>
-#include "io.h"
+#include <cstring>
+#include <vector>
+#include "decoder.h"
+#include "format.h"
 
 // Ha-ha, funny name ;D
 namespace printer {
 
-    // <instr> <arg1: str>, <arg2: str>
-    void print_instr_str_str(bool invert, const char* instr, const char* arg1, const char* arg2);
+    /**
+     * Output buffer for printed instructions. Lines are rendered directly into the buffer,
+     * which is flushed to the file descriptor with large write(2) calls. Writer without a file
+     * descriptor (fd < 0) keeps everything in memory.
+     */
+    struct writer {
+        int fd;
+        std::vector<char> buffer;
+        size_t size = 0;
+
+        explicit writer(int fd);
+
+        writer(const writer&) = delete;
+
+        writer& operator=(const writer&) = delete;
+
+        ~writer();
+
+        // Makes sure that at least WRITER_MAX_LINE bytes can be written without checks
+        void line() {
+            if (buffer.size() - size < WRITER_MAX_LINE) grow();
+        }
+
+        void put(const char c) {
+            buffer[size++] = c;
+        }
+
+        void write(const char* data, const size_t length) {
+            std::memcpy(buffer.data() + size, data, length);
+            size += length;
+        }
+
+        void str(const char* data) {
+            write(data, std::strlen(data));
+        }
+
+        void integer(i32 value);
+
+        void unsigned_integer(u64 value);
+
+        // Writes the value as a hexadecimal number with at least `digits` digits
+        void hex(u32 value, int digits);
+
+        // Writes everything that was buffered to the file descriptor
+        bool flush();
+
+        // Moves everything buffered in `other` after the contents of this writer
+        bool splice(writer& other);
+
+    private:
+        void grow();
+    };
+
+    // Prints the instruction, label is an index of the label for instructions with a relative operand.
+    // If label is negative, the operand is printed as an offset from the instruction: $+<offset>
+    void print_instruction(writer& out, const decoder::Instruction& instr, i32 label);
 
-    // <instr> [<arg1: str> + <addr: int>], <arg2: str>
-    void print_instr_str_int_str(const char* instr, const char* arg1, i32 addr, const char* arg2);
+    // Same as print_instruction, but without the line break, so the line can be annotated
+    void print_operation(writer& out, const decoder::Instruction& instr, i32 label);
 
-    // <instr> <arg1: str>, [<arg2: str> + <addr: int>]
-    void print_instr_str_str_int(const char* instr, const char* arg1, const char* arg2, i32 addr);
+    // Same as print_operation in the syntax, `pos` is the position of the instruction in the program
+    void print_operation(writer& out, format::Syntax syntax, const decoder::Instruction& instr, i32 label, size_t pos);
 
-    // <instr> <arg1: str>, <data: int>
-    void print_instr_str_int(const char* instr, const char* arg1, i32 data);
+    // label_<index>:
+    void print_label(writer& out, i32 label);
 
-    // <instr> [<arg1: str> + <addr: int>], <data: int>
-    void print_instr_str_int_int(const char* instr, const char* arg1, i32 addr, i32 data);
+    // Label at the position in the syntax
+    void print_label(writer& out, format::Syntax syntax, i32 label, size_t pos);
 
-    // <instr> <data: int>
-    void print_instr_int(const char* instr, i32 data);
+    // db 0x<byte>, 0x<byte>, ... on a single line, at most (WRITER_MAX_LINE - 4) / 6 bytes
+    void print_data(writer& out, std::span<const u8> bytes);
 
-    // <instr> <arg1: str>
-    void print_instr_str(const char* instr, const char* arg1);
+    /**
+     * ; Decoding errors: <count>, followed by the count of every error type and the position of every error.
+     * In JSON syntax it's a single object: {"errors":<count>,"counts":{"<error>":<count>,...},"skipped":[{"pos":<pos>,"error":"<error>"},...]}
+     */
+    void print_error_summary(writer& out, format::Syntax syntax, const decoder::error_summary& summary);
 
-    const char* get_register_name(bool word_data, u8 reg);
+    // Prints instructions which start at `start` in the program, together with the labels in front of them.
+    // Returns the position after the last instruction
+    size_t print_instructions(writer& out,
+                              std::span<const decoder::Instruction> instructions,
+                              decoder::label_view labels,
+                              size_t start,
+                              format::Syntax syntax = format::Syntax::NASM);
 
-    const char* get_register_pattern(u8 pattern);
+    // Prints every instruction of the program together with the labels they are jumping to
+    void print_program(writer& out,
+                       std::span<const decoder::Instruction> instructions,
+                       decoder::label_view labels,
+                       format::Syntax syntax = format::Syntax::NASM);
 
 }
 
@@ -0,0 +1,51 @@
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <utils/bits.h>
+
+#include "printer.h"
+#include "simulator.h"
+#include "translate.h"
+
+using namespace std;
+
+/**
+ * Executes the program compiled in from the output of vm8086 --translate, and prints the same
+ * final state and errors as vm8086 --exec.
+ */
+int main(int argc, char** argv) {
+    u64 limit = 100'000'000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit = strtoull(argv[++i], nullptr, 10);
+        } else {
+            cerr << "Usage: vm8086_runner [--limit <instructions>]\n";
+            return 1;
+        }
+    }
+
+    const span<const u8> program{translate::program, translate::program_size};
+    simulator::machine m{};
+    m.load(program);
+
+    decoder::DecodingError decoding_error = decoder::DecodingError::NONE;
+    const u16 end = static_cast<u16>(min<size_t>(program.size(), 0xFFFF));
+    const simulator::ExecutionError error = translate::run(m, translate::translated, program,
+                                                           { translate::blocks, translate::block_count },
+                                                           end, limit, &decoding_error);
+
+    printer::writer out{STDOUT_FILENO};
+    simulator::print_state(out, m);
+    if (error == simulator::ExecutionError::NONE) return 0;
+
+    out.flush();
+    if (error == simulator::ExecutionError::DECODING_FAILED) {
+        cerr << "\nError: " << decoder::decoding_error_message[static_cast<int>(decoding_error)] << endl;
+        cerr << "Decoding failed on: byte = ";
+        bits::print_bits(cerr, m.read_byte(m.physical(simulator::Segment::CS, m.ip)));
+        cerr << ", position = " << m.ip << "\n";
+    } else {
+        cerr << "\nError: " << simulator::execution_error_message[static_cast<int>(error)] << "\n";
+    }
+    return 1;
+}
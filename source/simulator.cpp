@@ -0,0 +1,318 @@
+#include "simulator.h"
+#include <array>
+#include <bit>
+#include <cstring>
+using namespace simulator;
+using decoder::Instruction;
+using decoder::Operand;
+using decoder::OperandKind;
+using decoder::Operation;
+
+static_assert(std::endian::native == std::endian::little, "Byte registers are aliased for little-endian hosts");
+
+void simulator::machine::load(const std::span<const u8> program) {
+    const u32 start = physical(Segment::CS, 0);
+    const size_t size = std::min<size_t>(program.size(), MEMORY_SIZE - start);
+    std::memcpy(memory.get() + start, program.data(), size);
+}
+
+// Base registers of every register pattern, the second one is 0xFF if there's only one
+const static u8 pattern_registers[8][2] = {
+        { 3, 6 }, { 3, 7 }, { 5, 6 }, { 5, 7 }, { 6, 0xFF }, { 7, 0xFF }, { 5, 0xFF }, { 3, 0xFF }
+};
+
+u32 simulator::effective_address(const machine& m, const Instruction& instr, const Operand& operand) {
+    // Segment override prefix stores the segment register + 1
+    const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+    const Segment override = static_cast<Segment>(segment - 1);
+
+    if (operand.kind == OperandKind::DIRECT_ADDRESS) {
+        return m.physical(segment ? override : Segment::DS, static_cast<u16>(instr.displacement));
+    }
+
+    const u8* base = pattern_registers[operand.reg];
+    u16 offset = m.regs.word(base[0]) + static_cast<u16>(instr.displacement);
+    if (base[1] != 0xFF) offset += m.regs.word(base[1]);
+
+    // Patterns based on BP are addressed relative to the stack segment
+    const bool stack = base[0] == static_cast<u8>(Register::BP);
+    if (segment) return m.physical(override, offset);
+    return m.physical(stack ? Segment::SS : Segment::DS, offset);
+}
+
+u16 read_operand(const machine& m, const Instruction& instr, const Operand& operand) {
+    switch (operand.kind) {
+        case OperandKind::REGISTER:
+            return instr.word ? m.regs.word(operand.reg) : m.regs.byte(operand.reg);
+        case OperandKind::BYTE_REGISTER:
+            return m.regs.byte(operand.reg);
+        case OperandKind::WORD_REGISTER:
+            return m.regs.word(operand.reg);
+        case OperandKind::SEGMENT_REGISTER:
+            return m.segments[operand.reg];
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS: {
+            const u32 address = effective_address(m, instr, operand);
+            return instr.word ? m.read_word(address) : m.read_byte(address);
+        }
+        case OperandKind::IMMEDIATE:
+            return instr.word ? static_cast<u16>(instr.immediate) : static_cast<u8>(instr.immediate);
+        case OperandKind::NONE:
+        case OperandKind::RELATIVE:
+        case OperandKind::FAR:
+            break;
+    }
+    return 0;
+}
+
+void write_operand(machine& m, const Instruction& instr, const Operand& operand, const u16 value) {
+    switch (operand.kind) {
+        case OperandKind::REGISTER:
+            if (instr.word) m.regs.set_word(operand.reg, value);
+            else m.regs.set_byte(operand.reg, static_cast<u8>(value));
+            return;
+        case OperandKind::BYTE_REGISTER:
+            m.regs.set_byte(operand.reg, static_cast<u8>(value));
+            return;
+        case OperandKind::WORD_REGISTER:
+            m.regs.set_word(operand.reg, value);
+            return;
+        case OperandKind::SEGMENT_REGISTER:
+            m.segments[operand.reg] = value;
+            return;
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS: {
+            const u32 address = effective_address(m, instr, operand);
+            if (instr.word) m.write_word(address, value);
+            else m.write_byte(address, static_cast<u8>(value));
+            return;
+        }
+        case OperandKind::NONE:
+        case OperandKind::IMMEDIATE:
+        case OperandKind::RELATIVE:
+        case OperandKind::FAR:
+            return;
+    }
+}
+
+ExecutionError execute_unsupported(machine&, const Instruction&) {
+    return ExecutionError::UNSUPPORTED_INSTRUCTION;
+}
+
+ExecutionError execute_mov(machine& m, const Instruction& instr) {
+    write_operand(m, instr, instr.dest, read_operand(m, instr, instr.source));
+    return ExecutionError::NONE;
+}
+
+ExecutionError execute_add(machine& m, const Instruction& instr) {
+    const u16 left = read_operand(m, instr, instr.dest);
+    const u16 right = read_operand(m, instr, instr.source);
+    const u32 result = static_cast<u32>(left) + right;
+    m.flags.set(FlagOp::ADD, instr.word, left, right, result);
+    write_operand(m, instr, instr.dest, static_cast<u16>(result));
+    return ExecutionError::NONE;
+}
+
+ExecutionError execute_sub(machine& m, const Instruction& instr) {
+    const u16 left = read_operand(m, instr, instr.dest);
+    const u16 right = read_operand(m, instr, instr.source);
+    const u32 result = static_cast<u32>(left) - right;
+    m.flags.set(FlagOp::SUB, instr.word, left, right, result);
+    write_operand(m, instr, instr.dest, static_cast<u16>(result));
+    return ExecutionError::NONE;
+}
+
+ExecutionError execute_cmp(machine& m, const Instruction& instr) {
+    const u16 left = read_operand(m, instr, instr.dest);
+    const u16 right = read_operand(m, instr, instr.source);
+    m.flags.set(FlagOp::SUB, instr.word, left, right, static_cast<u32>(left) - right);
+    return ExecutionError::NONE;
+}
+
+// Jumps if the condition holds
+template <bool (*condition)(machine& m)>
+ExecutionError execute_jump(machine& m, const Instruction& instr) {
+    if (condition(m)) m.ip += static_cast<u16>(instr.immediate);
+    return ExecutionError::NONE;
+}
+
+// Decrements CX before checking the condition
+u16 decrement_cx(machine& m) {
+    const u16 cx = m.regs.word(static_cast<u8>(Register::CX)) - 1;
+    m.regs.set_word(static_cast<u8>(Register::CX), cx);
+    return cx;
+}
+
+// Conditions of the jumps, named after the operation
+bool condition_je(machine& m) { return m.flags.zf(); }
+bool condition_jl(machine& m) { return m.flags.sf() != m.flags.of(); }
+bool condition_jle(machine& m) { return m.flags.zf() || m.flags.sf() != m.flags.of(); }
+bool condition_jb(machine& m) { return m.flags.cf(); }
+bool condition_jbe(machine& m) { return m.flags.cf() || m.flags.zf(); }
+bool condition_jp(machine& m) { return m.flags.pf(); }
+bool condition_jo(machine& m) { return m.flags.of(); }
+bool condition_js(machine& m) { return m.flags.sf(); }
+bool condition_jne(machine& m) { return !m.flags.zf(); }
+bool condition_jnl(machine& m) { return m.flags.sf() == m.flags.of(); }
+bool condition_jnle(machine& m) { return !m.flags.zf() && m.flags.sf() == m.flags.of(); }
+bool condition_jnb(machine& m) { return !m.flags.cf(); }
+bool condition_jnbe(machine& m) { return !m.flags.cf() && !m.flags.zf(); }
+bool condition_jnp(machine& m) { return !m.flags.pf(); }
+bool condition_jno(machine& m) { return !m.flags.of(); }
+bool condition_jns(machine& m) { return !m.flags.sf(); }
+bool condition_loop(machine& m) { return decrement_cx(m) != 0; }
+bool condition_loopz(machine& m) { return decrement_cx(m) != 0 && m.flags.zf(); }
+bool condition_loopnz(machine& m) { return decrement_cx(m) != 0 && !m.flags.zf(); }
+bool condition_jcxz(machine& m) { return m.regs.word(static_cast<u8>(Register::CX)) == 0; }
+
+constexpr std::array<execute_handler, 256> make_execute_table() {
+    std::array<execute_handler, 256> table{};
+    for (execute_handler& entry : table) entry = execute_unsupported;
+
+    const auto set = [&table](const Operation operation, const execute_handler function) {
+        table[static_cast<u8>(operation)] = function;
+    };
+
+    set(Operation::MOV, execute_mov);
+    set(Operation::ADD, execute_add);
+    set(Operation::SUB, execute_sub);
+    set(Operation::CMP, execute_cmp);
+
+    set(Operation::JE, execute_jump<condition_je>);
+    set(Operation::JL, execute_jump<condition_jl>);
+    set(Operation::JLE, execute_jump<condition_jle>);
+    set(Operation::JB, execute_jump<condition_jb>);
+    set(Operation::JBE, execute_jump<condition_jbe>);
+    set(Operation::JP, execute_jump<condition_jp>);
+    set(Operation::JO, execute_jump<condition_jo>);
+    set(Operation::JS, execute_jump<condition_js>);
+    set(Operation::JNE, execute_jump<condition_jne>);
+    set(Operation::JNL, execute_jump<condition_jnl>);
+    set(Operation::JNLE, execute_jump<condition_jnle>);
+    set(Operation::JNB, execute_jump<condition_jnb>);
+    set(Operation::JNBE, execute_jump<condition_jnbe>);
+    set(Operation::JNP, execute_jump<condition_jnp>);
+    set(Operation::JNO, execute_jump<condition_jno>);
+    set(Operation::JNS, execute_jump<condition_jns>);
+    set(Operation::LOOP, execute_jump<condition_loop>);
+    set(Operation::LOOPZ, execute_jump<condition_loopz>);
+    set(Operation::LOOPNZ, execute_jump<condition_loopnz>);
+    set(Operation::JCXZ, execute_jump<condition_jcxz>);
+
+    return table;
+}
+
+// Maps an operation to the function which executes it
+constexpr static std::array<execute_handler, 256> execute_table = make_execute_table();
+
+// Operations whose handlers write the destination operand
+constexpr std::array<bool, 256> make_write_table() {
+    std::array<bool, 256> table{};
+    table[static_cast<u8>(Operation::MOV)] = true;
+    table[static_cast<u8>(Operation::ADD)] = true;
+    table[static_cast<u8>(Operation::SUB)] = true;
+    return table;
+}
+
+constexpr static std::array<bool, 256> write_table = make_write_table();
+
+u16 simulator::written_state(const Instruction& instr) {
+    // Loops decrement CX before checking the condition
+    const bool loops = instr.operation == Operation::LOOP
+            || instr.operation == Operation::LOOPZ
+            || instr.operation == Operation::LOOPNZ;
+    const u16 implicit = loops ? 1 << static_cast<u8>(Register::CX) : 0;
+    if (!write_table[static_cast<u8>(instr.operation)]) return implicit;
+
+    const Operand& dest = instr.dest;
+    switch (dest.kind) {
+        case OperandKind::REGISTER:
+            // Byte registers are halves of the first four word registers
+            return implicit | 1 << (instr.word ? dest.reg : dest.reg & 0b011);
+        case OperandKind::BYTE_REGISTER:
+            return implicit | 1 << (dest.reg & 0b011);
+        case OperandKind::WORD_REGISTER:
+            return implicit | 1 << dest.reg;
+        case OperandKind::SEGMENT_REGISTER:
+            return implicit | 1 << (8 + dest.reg);
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS:
+            return implicit | WRITES_MEMORY;
+        case OperandKind::NONE:
+        case OperandKind::IMMEDIATE:
+        case OperandKind::RELATIVE:
+        case OperandKind::FAR:
+            break;
+    }
+    return implicit;
+}
+
+execute_handler simulator::handler(const Operation operation) {
+    return execute_table[static_cast<u8>(operation)];
+}
+
+ExecutionError simulator::execute(machine& m, const Instruction& instr) {
+    const ExecutionError error = execute_table[static_cast<u8>(instr.operation)](m, instr);
+    m.executed += 1;
+    return error;
+}
+
+ExecutionError simulator::step(machine& m, decoder::DecodingError* decoding_error) {
+    const u32 address = m.physical(Segment::CS, m.ip);
+    Instruction instr{};
+
+    *decoding_error = decoder::decode({ m.memory.get() + address, MEMORY_SIZE - address }, &instr);
+    if (*decoding_error != decoder::DecodingError::NONE) return ExecutionError::DECODING_FAILED;
+
+    m.ip += instr.length;
+    return execute(m, instr);
+}
+
+ExecutionError simulator::run(machine& m, const u16 end, const u64 limit, decoder::DecodingError* decoding_error) {
+    while (m.ip < end) {
+        if (m.executed >= limit) return ExecutionError::INSTRUCTION_LIMIT;
+        const ExecutionError error = step(m, decoding_error);
+        if (error != ExecutionError::NONE) return error;
+    }
+    return ExecutionError::NONE;
+}
+
+const static char* register_names[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" };
+
+const static char* segment_names[] = { "es", "cs", "ss", "ds" };
+
+// <name>: 0x<hex> (<value>)
+void print_register(printer::writer& out, const char* name, const u16 value) {
+    out.line();
+    out.write("      ", 6);
+    out.str(name);
+    out.write(": 0x", 4);
+    out.hex(value, 4);
+    out.write(" (", 2);
+    out.integer(value);
+    out.write(")\n", 2);
+}
+
+void simulator::print_state(printer::writer& out, const machine& m) {
+    out.line();
+    out.write("Final registers:\n", 17);
+    for (u8 reg = 0; reg < 8; reg++) print_register(out, register_names[reg], m.regs.word(reg));
+    for (u8 segment = 0; segment < 4; segment++) print_register(out, segment_names[segment], m.segments[segment]);
+    print_register(out, "ip", m.ip);
+
+    const u16 flags = m.flags.get();
+    const static char flag_names[] = { 'C', 'P', 'A', 'Z', 'S', 'O' };
+    const static u16 flag_bits[] = { CF, PF, AF, ZF, SF, OF };
+
+    out.line();
+    out.write("   flags: ", 10);
+    for (size_t i = 0; i < sizeof(flag_bits) / sizeof(flag_bits[0]); i++) {
+        if (flags & flag_bits[i]) out.put(flag_names[i]);
+    }
+    out.put('\n');
+
+    out.line();
+    out.write("Executed instructions: ", 23);
+    out.unsigned_integer(m.executed);
+    out.put('\n');
+}
@@ -0,0 +1,255 @@
+#ifndef VM8086_SIMULATOR_H
+#define VM8086_SIMULATOR_H
+
+#define MEMORY_SIZE (1 << 20)
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define CODE_PAGE_SIZE 256
+#define CODE_PAGES (MEMORY_SIZE / CODE_PAGE_SIZE)
+// Granularity of the write tracking used by snapshots, has to be a multiple of CODE_PAGE_SIZE
+#define DIRTY_PAGE_SIZE 4096
+#define DIRTY_PAGES (MEMORY_SIZE / DIRTY_PAGE_SIZE)
+
+#include <utils/types.h>
+#include <memory>
+#include <span>
+#include <vector>
+#include "decoder.h"
+#include "printer.h"
+
+namespace simulator {
+
+    enum class Register : u8 {
+        AX = 0, CX = 1, DX = 2, BX = 3, SP = 4, BP = 5, SI = 6, DI = 7,
+    };
+
+    enum class Segment : u8 {
+        ES = 0, CS = 1, SS = 2, DS = 3,
+    };
+
+    /**
+     * General purpose registers. Byte registers are aliased onto the word registers in the same
+     * order as they are encoded in instructions: al, cl, dl, bl are low bytes and ah, ch, dh, bh
+     * are high bytes of ax, cx, dx, bx.
+     */
+    struct register_file {
+        u16 words[8];
+
+        u16 word(const u8 reg) const {
+            return words[reg];
+        }
+
+        void set_word(const u8 reg, const u16 value) {
+            words[reg] = value;
+        }
+
+        u8 byte(const u8 reg) const {
+            return reinterpret_cast<const u8*>(words)[byte_offset(reg)];
+        }
+
+        void set_byte(const u8 reg, const u8 value) {
+            reinterpret_cast<u8*>(words)[byte_offset(reg)] = value;
+        }
+
+    private:
+        // Requires little-endian host, checked in simulator.cpp
+        static size_t byte_offset(const u8 reg) {
+            return (reg & 0b011) * 2 + (reg >> 2);
+        }
+    };
+
+    enum FlagBit : u16 {
+        CF = 1 << 0,
+        PF = 1 << 2,
+        AF = 1 << 4,
+        ZF = 1 << 6,
+        SF = 1 << 7,
+        OF = 1 << 11,
+    };
+
+    enum class FlagOp : u8 {
+        // Flags are not derived from an operation, they are stored in `value`
+        NONE,
+        ADD,
+        SUB,
+    };
+
+    /**
+     * Arithmetic flags are not computed when an instruction is executed. Instead we remember the
+     * operands and the result of the last ALU operation, and derive flags only when they are read.
+     */
+    struct lazy_flags {
+        FlagOp op = FlagOp::NONE;
+        bool word = false;
+        u16 left = 0;
+        u16 right = 0;
+        u32 result = 0;
+        u16 value = 0;
+
+        void set(const FlagOp operation, const bool is_word, const u16 a, const u16 b, const u32 r) {
+            op = operation;
+            word = is_word;
+            left = a;
+            right = b;
+            result = r;
+        }
+
+        u16 sign_bit() const { return word ? 0x8000 : 0x80; }
+
+        u16 mask() const { return word ? 0xFFFF : 0xFF; }
+
+        bool zf() const { return op == FlagOp::NONE ? value & ZF : (result & mask()) == 0; }
+
+        bool sf() const { return op == FlagOp::NONE ? value & SF : result & sign_bit(); }
+
+        // Result doesn't fit into the operand, or borrow is needed for subtraction
+        bool cf() const { return op == FlagOp::NONE ? value & CF : (result & ~static_cast<u32>(mask())) != 0; }
+
+        bool of() const {
+            switch (op) {
+                case FlagOp::ADD: return (~(left ^ right) & (left ^ result)) & sign_bit();
+                case FlagOp::SUB: return ((left ^ right) & (left ^ result)) & sign_bit();
+                case FlagOp::NONE: break;
+            }
+            return value & OF;
+        }
+
+        // Parity of the low byte of the result
+        bool pf() const { return op == FlagOp::NONE ? value & PF : !__builtin_parity(result & 0xFF); }
+
+        // Carry out of (or borrow into) the low nibble
+        bool af() const { return op == FlagOp::NONE ? value & AF : (left ^ right ^ result) & 0x10; }
+
+        u16 get() const {
+            // Every flag below checks the operation again, returning early lets the compiler drop those checks
+            if (op == FlagOp::NONE) return value & (CF | PF | AF | ZF | SF | OF);
+            u16 flags = 0;
+            if (cf()) flags |= CF;
+            if (pf()) flags |= PF;
+            if (af()) flags |= AF;
+            if (zf()) flags |= ZF;
+            if (sf()) flags |= SF;
+            if (of()) flags |= OF;
+            return flags;
+        }
+    };
+
+    /**
+     * State of the simulated 8086 machine with 1 MB of memory.
+     */
+    struct machine {
+        register_file regs{};
+        u16 segments[4]{};
+        u16 ip = 0;
+        lazy_flags flags{};
+        std::unique_ptr<u8[]> memory = std::make_unique<u8[]>(MEMORY_SIZE);
+
+        // Executed instructions
+        u64 executed = 0;
+
+        // Pages of memory which contain cached code, one bit per page
+        std::unique_ptr<u64[]> code_pages = std::make_unique<u64[]>(CODE_PAGES / 64);
+        // Set when a write hits one of the code pages, the pages are listed in `modified_pages`
+        bool code_modified = false;
+        std::vector<u32> modified_pages{};
+
+        // Pages of memory written since the last snapshot, one bit per page, the pages are listed in `dirty_list`
+        u64 dirty_pages[DIRTY_PAGES / 64]{};
+        std::vector<u32> dirty_list{};
+
+        // Copies the program at CS:0
+        void load(std::span<const u8> program);
+
+        u32 physical(Segment segment, u16 offset) const {
+            return ((static_cast<u32>(segments[static_cast<u8>(segment)]) << 4) + offset) & MEMORY_MASK;
+        }
+
+        u8 read_byte(const u32 address) const {
+            return memory[address];
+        }
+
+        u16 read_word(const u32 address) const {
+            return memory[address] | (memory[(address + 1) & MEMORY_MASK] << 8);
+        }
+
+        void write_byte(const u32 address, const u8 value) {
+            memory[address] = value;
+            mark_dirty(address);
+            check_code(address);
+        }
+
+        void write_word(const u32 address, const u16 value) {
+            const u32 high = (address + 1) & MEMORY_MASK;
+            memory[address] = static_cast<u8>(value);
+            memory[high] = static_cast<u8>(value >> 8);
+            mark_dirty(address);
+            mark_dirty(high);
+            check_code(address);
+            check_code(high);
+        }
+
+        bool is_code(const u32 address) const {
+            const u32 page = address / CODE_PAGE_SIZE;
+            return (code_pages[page / 64] >> (page % 64)) & 1;
+        }
+
+    private:
+        void mark_dirty(const u32 address) {
+            const u32 page = address / DIRTY_PAGE_SIZE;
+            const u64 bit = u64{1} << (page % 64);
+            if (dirty_pages[page / 64] & bit) return;
+            dirty_pages[page / 64] |= bit;
+            dirty_list.push_back(page);
+        }
+
+        void check_code(const u32 address) {
+            if (!is_code(address)) return;
+            code_modified = true;
+            modified_pages.push_back(address / CODE_PAGE_SIZE);
+        }
+    };
+
+    enum struct ExecutionError {
+        NONE = 99,
+        DECODING_FAILED = 0,
+        UNSUPPORTED_INSTRUCTION = 1,
+        INSTRUCTION_LIMIT = 2,
+    };
+
+    inline constexpr const char* execution_error_message[] = {
+            "Failed to decode the instruction",
+            "This instruction can't be executed",
+            "Limit of executed instructions is reached"
+    };
+
+    using execute_handler = ExecutionError (*)(machine& m, const decoder::Instruction& instr);
+
+    // Function which executes the operation
+    execute_handler handler(decoder::Operation operation);
+
+    // Physical address of the memory operand of the instruction
+    u32 effective_address(const machine& m, const decoder::Instruction& instr, const decoder::Operand& operand);
+
+    // Instruction writes memory through its destination operand, the only way memory is written
+    constexpr u16 WRITES_MEMORY = 1 << 12;
+
+    /**
+     * State which can be written by the instruction, besides IP and flags: bits 0-7 are the general
+     * purpose registers, bits 8-11 are the segment registers, and WRITES_MEMORY. Has to be kept
+     * in sync with the handlers.
+     */
+    u16 written_state(const decoder::Instruction& instr);
+
+    // Executes an already decoded instruction, IP must point to the next instruction
+    ExecutionError execute(machine& m, const decoder::Instruction& instr);
+
+    // Decodes and executes the instruction at CS:IP
+    ExecutionError step(machine& m, decoder::DecodingError* decoding_error);
+
+    // Runs the program until IP leaves [0, end), an error occurs or `limit` instructions are executed
+    ExecutionError run(machine& m, u16 end, u64 limit, decoder::DecodingError* decoding_error);
+
+    void print_state(printer::writer& out, const machine& m);
+
+}
+
+#endif //VM8086_SIMULATOR_H
@@ -0,0 +1,45 @@
+#include "snapshot.h"
+#include <cstring>
+using namespace snapshot;
+
+static_assert(DIRTY_PAGE_SIZE % CODE_PAGE_SIZE == 0);
+
+// Forgets the written pages, the next write to any page will be tracked again
+static void clear_dirty(simulator::machine& m) {
+    for (const u32 page : m.dirty_list) m.dirty_pages[page / 64] &= ~(u64{1} << (page % 64));
+    m.dirty_list.clear();
+}
+
+void snapshot::take(simulator::machine& m, snapshot* s) {
+    s->regs = m.regs;
+    std::memcpy(s->segments, m.segments, sizeof(s->segments));
+    s->ip = m.ip;
+    s->flags = m.flags;
+    s->executed = m.executed;
+    std::memcpy(s->memory.get(), m.memory.get(), MEMORY_SIZE);
+    clear_dirty(m);
+}
+
+size_t snapshot::restore(simulator::machine& m, const snapshot& s) {
+    m.regs = s.regs;
+    std::memcpy(m.segments, s.segments, sizeof(m.segments));
+    m.ip = s.ip;
+    m.flags = s.flags;
+    m.executed = s.executed;
+
+    const size_t restored = m.dirty_list.size();
+    for (const u32 page : m.dirty_list) {
+        const size_t offset = static_cast<size_t>(page) * DIRTY_PAGE_SIZE;
+        std::memcpy(m.memory.get() + offset, s.memory.get() + offset, DIRTY_PAGE_SIZE);
+
+        // Blocks decoded after the write don't match the restored bytes anymore
+        const u32 first = static_cast<u32>(offset / CODE_PAGE_SIZE);
+        for (u32 code_page = first; code_page < first + DIRTY_PAGE_SIZE / CODE_PAGE_SIZE; code_page++) {
+            if (!m.is_code(code_page * CODE_PAGE_SIZE)) continue;
+            m.code_modified = true;
+            m.modified_pages.push_back(code_page);
+        }
+    }
+    clear_dirty(m);
+    return restored;
+}
@@ -0,0 +1,35 @@
+#ifndef VM8086_SNAPSHOT_H
+#define VM8086_SNAPSHOT_H
+
+#include <utils/types.h>
+#include <memory>
+#include "simulator.h"
+
+namespace snapshot {
+
+    /**
+     * Saved state of the machine. Memory is copied once when the snapshot is taken, after that
+     * the machine tracks pages it writes, and only those pages are copied back by restore().
+     */
+    struct snapshot {
+        simulator::register_file regs{};
+        u16 segments[4]{};
+        u16 ip = 0;
+        simulator::lazy_flags flags{};
+        u64 executed = 0;
+        std::unique_ptr<u8[]> memory = std::make_unique<u8[]>(MEMORY_SIZE);
+    };
+
+    // Saves the whole state of the machine and starts tracking writes from this point
+    void take(simulator::machine& m, snapshot* s);
+
+    /**
+     * Brings the machine back to the snapshot, which has to be the last one taken of this machine.
+     * Only pages written since then are copied. Cached code on those pages is marked as modified,
+     * blocks::run invalidates it before executing anything. Returns the number of restored pages.
+     */
+    size_t restore(simulator::machine& m, const snapshot& s);
+
+}
+
+#endif //VM8086_SNAPSHOT_H
@@ -0,0 +1,131 @@
+#include "stats.h"
+#include <algorithm>
+#include <array>
+using namespace stats;
+using decoder::Operation;
+
+static Addressing addressing_of(const u8 mod_reg_rm) {
+    const u8 mod = mod_reg_rm >> 6;
+    const u8 rm = mod_reg_rm & 0b111;
+    switch (mod) {
+        case 0b00: return rm == 0b110 ? Addressing::DIRECT_ADDRESS : Addressing::MEMORY;
+        case 0b01: return Addressing::MEMORY_8;
+        case 0b10: return Addressing::MEMORY_16;
+        default: return Addressing::REGISTER;
+    }
+}
+
+/**
+ * Everything the classification needs in flat byte tables, so an instruction is classified
+ * without branches on its bytes.
+ */
+struct tables {
+    // Indexed by opcode << 3 | reg
+    u8 operation[256 * 8];
+    // Indexed by opcode, 0 for instructions without mod reg rm, 1 + mod reg rm byte is the index of addressing
+    u16 has_mod_reg_rm[256];
+    u8 addressing[257];
+    bool prefix[256];
+
+    tables(): operation(), has_mod_reg_rm(), addressing(), prefix() {
+        for (size_t opcode = 0; opcode < 256; opcode++) {
+            const decoder::opcode_length& length = decoder::length_of(static_cast<u8>(opcode));
+            for (size_t reg = 0; reg < 8; reg++) {
+                const Operation operation = decoder::operation_of(static_cast<u8>(opcode), static_cast<u8>(reg << 3));
+                this->operation[opcode << 3 | reg] = static_cast<u8>(operation);
+            }
+            has_mod_reg_rm[opcode] = length.mod_reg_rm ? 0xFFFF : 0;
+            prefix[opcode] = length.slow && length.length == 1;
+        }
+        addressing[0] = static_cast<u8>(Addressing::NONE);
+        for (size_t byte = 0; byte < 256; byte++) addressing[byte + 1] = static_cast<u8>(addressing_of(static_cast<u8>(byte)));
+    }
+};
+
+const static tables lookup{};
+
+// Adds the instruction with the opcode at `pos`
+static void add(mix& m, const std::span<const u8> program, const size_t pos, const Operation operation) {
+    const u8 opcode = program[pos];
+    const u8 mod_reg_rm = pos + 1 < program.size() ? program[pos + 1] : 0;
+    m.operations[static_cast<size_t>(operation)] += 1;
+    m.addressing[lookup.addressing[(mod_reg_rm + 1) & lookup.has_mod_reg_rm[opcode]]] += 1;
+}
+
+// Decodes the prefixes, the instruction after them is classified as usual
+static void add_prefixed(mix& m, const std::span<const u8> program, const size_t pos) {
+    decoder::Instruction instr{};
+    decoder::decode(program.subspan(pos), &instr);
+
+    size_t opcode = pos;
+    while (lookup.prefix[program[opcode]]) opcode++;
+    add(m, program, opcode, instr.operation);
+
+    m.segment += (instr.prefix & decoder::SEGMENT_MASK) != 0;
+    m.lock += (instr.prefix & decoder::LOCK) != 0;
+    m.rep += (instr.prefix & decoder::REP) != 0;
+    m.repne += (instr.prefix & decoder::REPNE) != 0;
+}
+
+mix stats::collect(const std::span<const u8> program, const boundaries::Implementation implementation) {
+    const boundaries::result r = boundaries::find(program, implementation);
+    mix m{};
+    m.instructions = r.count;
+    m.bytes = r.end;
+    m.end = r.end;
+
+    for (size_t word = 0; word < r.bitmap.size(); word++) {
+        for (u64 bits = r.bitmap[word]; bits != 0; bits &= bits - 1) {
+            const size_t pos = word * 64 + __builtin_ctzll(bits);
+            const u8 opcode = program[pos];
+            if (lookup.prefix[opcode]) {
+                add_prefixed(m, program, pos);
+                continue;
+            }
+            // Operation only depends on reg for groups, which always have the mod reg rm byte
+            const u8 reg = pos + 1 < program.size() ? (program[pos + 1] >> 3) & 0b111 : 0;
+            add(m, program, pos, static_cast<Operation>(lookup.operation[opcode << 3 | reg]));
+        }
+    }
+    return m;
+}
+
+// ;   <name>: <count>
+static void print_count(printer::writer& out, const char* name, const u64 count) {
+    out.line();
+    out.write(";   ", 4);
+    out.str(name);
+    out.write(": ", 2);
+    out.unsigned_integer(count);
+    out.put('\n');
+}
+
+void stats::print(printer::writer& out, const mix& m) {
+    out.line();
+    out.write("; Instructions: ", 16);
+    out.unsigned_integer(m.instructions);
+    out.write("\n; Bytes: ", 10);
+    out.unsigned_integer(m.bytes);
+    out.write("\n; Operations:\n", 15);
+
+    std::array<u8, static_cast<size_t>(Operation::COUNT)> order{};
+    for (size_t i = 0; i < order.size(); i++) order[i] = static_cast<u8>(i);
+    std::stable_sort(order.begin(), order.end(), [&m](const u8 a, const u8 b) {
+        return m.operations[a] > m.operations[b];
+    });
+    for (const u8 operation : order) {
+        if (m.operations[operation] == 0) continue;
+        print_count(out, decoder::operation_name[operation], m.operations[operation]);
+    }
+
+    out.line();
+    out.write("; Operands:\n", 12);
+    for (size_t i = 0; i < static_cast<size_t>(Addressing::COUNT); i++) print_count(out, addressing_name[i], m.addressing[i]);
+
+    out.line();
+    out.write("; Prefixes:\n", 12);
+    print_count(out, "segment", m.segment);
+    print_count(out, "lock", m.lock);
+    print_count(out, "rep", m.rep);
+    print_count(out, "repne", m.repne);
+}
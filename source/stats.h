@@ -0,0 +1,58 @@
+#ifndef VM8086_STATS_H
+#define VM8086_STATS_H
+
+#include <utils/types.h>
+#include <span>
+#include "decoder.h"
+#include "printer.h"
+#include "boundaries.h"
+
+namespace stats {
+
+    // Form of the reg/mem operand, selected by the mod and rm fields
+    enum class Addressing : u8 {
+        // Instruction doesn't have a mod reg rm byte
+        NONE,
+        REGISTER,
+        MEMORY,
+        MEMORY_8,
+        MEMORY_16,
+        DIRECT_ADDRESS,
+        COUNT
+    };
+
+    inline constexpr const char* addressing_name[] = {
+            "no mod reg rm", "register", "memory", "memory + disp8", "memory + disp16", "direct address"
+    };
+
+    static_assert(sizeof(addressing_name) / sizeof(addressing_name[0]) == static_cast<size_t>(Addressing::COUNT));
+
+    /**
+     * Instruction mix of a program.
+     */
+    struct mix {
+        u64 instructions = 0;
+        u64 bytes = 0;
+        u64 operations[static_cast<size_t>(decoder::Operation::COUNT)]{};
+        u64 addressing[static_cast<size_t>(Addressing::COUNT)]{};
+        // Instructions with a segment override, lock, rep and repne prefixes
+        u64 segment = 0;
+        u64 lock = 0;
+        u64 rep = 0;
+        u64 repne = 0;
+        // Position after the last instruction, the instruction at this position fails to decode
+        size_t end = 0;
+    };
+
+    /**
+     * Instructions are found with the length pre-pass of boundaries::find, then every instruction
+     * is classified by its first two bytes with table lookups. Only prefixed instructions are decoded.
+     */
+    mix collect(std::span<const u8> program, boundaries::Implementation implementation);
+
+    // ; Instructions: <count>, followed by the counts of operations (most frequent first), addressing and prefixes
+    void print(printer::writer& out, const mix& m);
+
+}
+
+#endif //VM8086_STATS_H
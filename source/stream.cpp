@@ -0,0 +1,263 @@
+#include "stream.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <unistd.h>
+using namespace stream;
+using decoder::DecodingError;
+using decoder::Instruction;
+
+// Farthest a relative jump can reach backwards
+constexpr static i64 JUMP_REACH = 1 << 15;
+static_assert(STREAM_LOOKAHEAD >= 2 * (JUMP_REACH + MAX_INSTRUCTION_LENGTH));
+// Printed instruction, jump reach behind it, and a jump reach past the lookahead and one more batch
+static_assert(STREAM_POSITIONS >= STREAM_LOOKAHEAD + 2 * JUMP_REACH + STREAM_BATCH * MAX_INSTRUCTION_LENGTH);
+
+// Stops publishing the input once `cancelled` is set, the decoder drains the blocks until the last one
+static void read_blocks(const int fd, ring<block, STREAM_BLOCKS>& blocks, const std::atomic<bool>& cancelled) {
+    while (true) {
+        block& b = blocks.produce();
+        if (cancelled.load(std::memory_order_acquire)) {
+            b.size = 0;
+            b.last = true;
+            b.error = 0;
+            blocks.publish();
+            return;
+        }
+        ssize_t bytes;
+        do bytes = ::read(fd, b.data, STREAM_BLOCK_SIZE); while (bytes < 0 && errno == EINTR);
+
+        const bool last = bytes <= 0;
+        b.size = last ? 0 : static_cast<size_t>(bytes);
+        b.last = last;
+        b.error = bytes < 0 ? errno : 0;
+        blocks.publish();
+        if (last) return;
+    }
+}
+
+static batch& start_batch(ring<batch, STREAM_BATCHES>& batches) {
+    batch& b = batches.produce();
+    b.count = 0;
+    b.last = false;
+    b.error = DecodingError::NONE;
+    b.byte = 0;
+    b.read_error = 0;
+    return b;
+}
+
+/**
+ * Instructions which cross the end of a block are decoded from the carry buffer: the bytes left
+ * in the previous blocks, followed by the beginning of the next block.
+ */
+static void decode_blocks(ring<block, STREAM_BLOCKS>& blocks,
+                          ring<batch, STREAM_BATCHES>& batches,
+                          std::atomic<bool>& cancelled) {
+    u8 carry[MAX_INSTRUCTION_LENGTH];
+    size_t carry_size = 0;
+    batch* current = &start_batch(batches);
+
+    const auto emit = [&](const Instruction& instr) {
+        current->instructions[current->count++] = instr;
+        if (current->count < STREAM_BATCH) return;
+        batches.publish();
+        current = &start_batch(batches);
+    };
+    // Reader may be waiting for a free block, so blocks are released until it publishes the last one
+    const auto finish = [&](const block* b, const DecodingError error, const u8 byte, const int read_error) {
+        current->last = true;
+        current->error = error;
+        current->byte = byte;
+        current->read_error = read_error;
+        batches.publish();
+
+        cancelled.store(true, std::memory_order_release);
+        while (!b->last) {
+            blocks.release();
+            b = &blocks.consume();
+        }
+        blocks.release();
+    };
+
+    Instruction instr{};
+    while (true) {
+        const block& b = blocks.consume();
+        if (b.error != 0) return finish(&b, DecodingError::NONE, 0, b.error);
+
+        size_t offset = 0;
+        if (carry_size > 0) {
+            const size_t taken = std::min(b.size, sizeof(carry) - carry_size);
+            std::memcpy(carry + carry_size, b.data, taken);
+            const DecodingError error = decoder::decode({ carry, carry_size + taken }, &instr);
+            if (error == DecodingError::UNEXPECTED_END && !b.last && taken == b.size) {
+                // Block was too small to finish the instruction
+                carry_size += taken;
+                blocks.release();
+                continue;
+            }
+            if (error != DecodingError::NONE) return finish(&b, error, carry[0], 0);
+            emit(instr);
+            offset = instr.length - carry_size;
+            carry_size = 0;
+        }
+
+        while (offset < b.size) {
+            const DecodingError error = decoder::decode({ b.data + offset, b.size - offset }, &instr);
+            if (error == DecodingError::UNEXPECTED_END && !b.last) {
+                carry_size = b.size - offset;
+                std::memcpy(carry, b.data + offset, carry_size);
+                break;
+            }
+            if (error != DecodingError::NONE) return finish(&b, error, b.data[offset], 0);
+            emit(instr);
+            offset += instr.length;
+        }
+
+        if (b.last) return finish(&b, DecodingError::NONE, 0, 0);
+        blocks.release();
+        // The next block may take a while to arrive, what is decoded so far shouldn't wait for it
+        if (current->count > 0) {
+            batches.publish();
+            current = &start_batch(batches);
+        }
+    }
+}
+
+namespace {
+
+    /**
+     * Prints instructions once STREAM_LOOKAHEAD bytes after them are decoded. Labels are numbered
+     * in the order of their positions as soon as no jump which is still to be decoded can reach
+     * them, which is well before they are printed or referenced by a printed jump.
+     *
+     * Targets and labels are kept in arrays indexed by the position modulo STREAM_POSITIONS.
+     * Positions which are alive at the same time, from a jump reach behind the printed instruction
+     * to a jump reach past the last decoded one, always fit into the arrays.
+     */
+    struct formatter {
+        struct entry {
+            Instruction instr;
+            u64 pos;
+        };
+
+        printer::writer& out;
+        format::Syntax syntax;
+
+        std::deque<entry> window{};
+        // Entries at the front of the window which are numbered
+        size_t numbered = 0;
+        // Position after the last decoded instruction
+        u64 end = 0;
+        bool finished = false;
+        // Positions which are targets of the decoded jumps, one bit per position
+        std::unique_ptr<u64[]> targets = std::make_unique<u64[]>(STREAM_POSITIONS / 64);
+        // Index of the label at the position or -1, only valid for numbered positions
+        std::unique_ptr<i32[]> labels = std::make_unique<i32[]>(STREAM_POSITIONS);
+        i32 next_label = 0;
+        // Label after the last instruction, only known once the stream is finished
+        i32 end_label = -1;
+
+        static size_t slot(const u64 position) {
+            return position % STREAM_POSITIONS;
+        }
+
+        bool take_target(const u64 position) {
+            const size_t s = slot(position);
+            const u64 bit = u64{1} << (s % 64);
+            const bool target = targets[s / 64] & bit;
+            targets[s / 64] &= ~bit;
+            return target;
+        }
+
+        void add(const Instruction& instr) {
+            if (instr.dest.kind == decoder::OperandKind::RELATIVE) {
+                // Every numbered instruction is farther behind than a jump can reach
+                const i64 target = decoder::jump_target(instr, end);
+                if (target >= 0) targets[slot(target) / 64] |= u64{1} << (slot(target) % 64);
+            }
+            window.push_back({ instr, end });
+            end += instr.length;
+        }
+
+        void number() {
+            while (numbered < window.size()) {
+                const entry& e = window[numbered];
+                if (!finished && end < e.pos + JUMP_REACH + MAX_INSTRUCTION_LENGTH) break;
+
+                labels[slot(e.pos)] = take_target(e.pos) ? next_label++ : -1;
+                // Targets inside of the instruction are not labeled
+                for (u64 pos = e.pos + 1; pos < e.pos + e.instr.length; pos++) {
+                    take_target(pos);
+                    labels[slot(pos)] = -1;
+                }
+                numbered += 1;
+            }
+        }
+
+        i32 find_label(const i64 target) const {
+            if (target < 0 || target > static_cast<i64>(end)) return -1;
+            if (target == static_cast<i64>(end)) return end_label;
+            return labels[slot(static_cast<u64>(target))];
+        }
+
+        void print_front() {
+            const entry& e = window.front();
+            const i32 label = labels[slot(e.pos)];
+            if (label >= 0) printer::print_label(out, syntax, label, e.pos);
+
+            const i32 target = e.instr.dest.kind == decoder::OperandKind::RELATIVE
+                    ? find_label(decoder::jump_target(e.instr, e.pos))
+                    : -1;
+            printer::print_operation(out, syntax, e.instr, target, e.pos);
+            out.put('\n');
+            window.pop_front();
+            numbered -= 1;
+        }
+
+        void print_ready() {
+            number();
+            while (!window.empty() && (finished || end >= window.front().pos + STREAM_LOOKAHEAD)) print_front();
+        }
+
+        void finish() {
+            finished = true;
+            number();
+            if (take_target(end)) end_label = next_label;
+            print_ready();
+            if (end_label >= 0) printer::print_label(out, syntax, end_label, end);
+        }
+    };
+
+}
+
+result stream::disassemble(const int fd, printer::writer& out, const format::Syntax syntax) {
+    ring<block, STREAM_BLOCKS> blocks{};
+    ring<batch, STREAM_BATCHES> batches{};
+    std::atomic<bool> cancelled{false};
+    std::thread reader(read_blocks, fd, std::ref(blocks), std::cref(cancelled));
+    std::thread decoder(decode_blocks, std::ref(blocks), std::ref(batches), std::ref(cancelled));
+
+    result r{};
+    formatter f { .out = out, .syntax = syntax };
+    while (true) {
+        // Whatever is printed is written before waiting for more input
+        if (!batches.ready()) out.flush();
+        const batch& b = batches.consume();
+        for (size_t i = 0; i < b.count; i++) f.add(b.instructions[i]);
+        f.print_ready();
+
+        const bool last = b.last;
+        r.error = b.error;
+        r.byte = b.byte;
+        r.read_error = b.read_error;
+        batches.release();
+        if (last) break;
+    }
+    f.finish();
+    r.pos = f.end;
+
+    reader.join();
+    decoder.join();
+    return r;
+}
@@ -0,0 +1,130 @@
+#ifndef VM8086_STREAM_H
+#define VM8086_STREAM_H
+
+// Bytes of one read(2), blocks are published as soon as the read returns
+#define STREAM_BLOCK_SIZE (1 << 16)
+// Blocks between the reader and the decoder
+#define STREAM_BLOCKS 8
+// Instructions in one batch between the decoder and the formatter
+#define STREAM_BATCH 1024
+// Batches between the decoder and the formatter
+#define STREAM_BATCHES 64
+/**
+ * Bytes decoded ahead of the printed instruction. Relative jumps reach at most 32 KB in both
+ * directions, so once twice that much is decoded every label which points before the printed
+ * instruction or which is referenced by it is known, and labels are numbered the same as by
+ * find_labels.
+ */
+#define STREAM_LOOKAHEAD (1 << 17)
+// Positions the formatter keeps jump targets and labels for, has to cover the lookahead and the jump reach around it
+#define STREAM_POSITIONS (1 << 18)
+// Times a thread checks an empty or full ring before it goes to sleep
+#define STREAM_SPIN 64
+
+#include <utils/types.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "decoder.h"
+#include "printer.h"
+
+namespace stream {
+
+    /**
+     * Single producer, single consumer ring of slots. The producer fills the slot returned by
+     * produce() in place and publishes it, the consumer reads the slot returned by consume()
+     * in place and releases it, so nothing is copied between the threads. Threads spin for
+     * a while and then sleep on the position of the other side.
+     */
+    template <typename T, size_t N>
+    struct ring {
+        std::unique_ptr<T[]> slots = std::make_unique<T[]>(N);
+        // Next position published by the producer
+        alignas(64) std::atomic<u64> head{0};
+        // Next position released by the consumer
+        alignas(64) std::atomic<u64> tail{0};
+
+        // Waits for a free slot
+        T& produce() {
+            const u64 position = head.load(std::memory_order_relaxed);
+            wait(tail, position - N);
+            return slots[position % N];
+        }
+
+        void publish() {
+            head.fetch_add(1, std::memory_order_release);
+            head.notify_one();
+        }
+
+        // Waits for a published slot
+        T& consume() {
+            const u64 position = tail.load(std::memory_order_relaxed);
+            wait(head, position);
+            return slots[position % N];
+        }
+
+        // Published slot is available without waiting
+        bool ready() const {
+            return head.load(std::memory_order_acquire) != tail.load(std::memory_order_relaxed);
+        }
+
+        void release() {
+            tail.fetch_add(1, std::memory_order_release);
+            tail.notify_one();
+        }
+
+    private:
+        // Waits until the position moves past `seen`
+        static void wait(const std::atomic<u64>& position, const u64 seen) {
+            u64 current = position.load(std::memory_order_acquire);
+            for (int i = 0; i < STREAM_SPIN && current == seen; i++) {
+                std::this_thread::yield();
+                current = position.load(std::memory_order_acquire);
+            }
+            while (current == seen) {
+                position.wait(seen, std::memory_order_acquire);
+                current = position.load(std::memory_order_acquire);
+            }
+        }
+    };
+
+    struct block {
+        u8 data[STREAM_BLOCK_SIZE];
+        size_t size = 0;
+        // Nothing follows the block
+        bool last = false;
+        // errno of the failed read, the block is the last one
+        int error = 0;
+    };
+
+    struct batch {
+        decoder::Instruction instructions[STREAM_BATCH];
+        size_t count = 0;
+        bool last = false;
+        // Why decoding stopped, only set in the last batch
+        decoder::DecodingError error = decoder::DecodingError::NONE;
+        // First byte of the instruction which failed to decode
+        u8 byte = 0;
+        int read_error = 0;
+    };
+
+    struct result {
+        decoder::DecodingError error = decoder::DecodingError::NONE;
+        // Position of the instruction which failed to decode, or the end of the stream
+        size_t pos = 0;
+        u8 byte = 0;
+        // errno of a failed read, 0 otherwise
+        int read_error = 0;
+    };
+
+    /**
+     * Disassembles everything read from the file descriptor. Reading and decoding run on their
+     * own threads, the calling thread formats and writes the listing. Memory use doesn't depend
+     * on the size of the stream. Output is identical to the one of decode_program, find_labels
+     * and print_program, and it's flushed whenever the formatter runs out of input.
+     */
+    result disassemble(int fd, printer::writer& out, format::Syntax syntax = format::Syntax::NASM);
+
+}
+
+#endif //VM8086_STREAM_H
@@ -0,0 +1,256 @@
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace trace;
+using simulator::Segment;
+
+const static char magic[8] = { 'v', 'm', '8', '0', '8', '6', 't', 'r' };
+
+static_assert(sizeof(record) == 12);
+static_assert(sizeof(header) == 48);
+static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0);
+static_assert(TRACE_RING_SIZE % TRACE_WRITE_BATCH == 0);
+
+static size_t records_offset(const u64 program_size) {
+    const size_t end = sizeof(header) + program_size;
+    return (end + alignof(record) - 1) & ~(alignof(record) - 1);
+}
+
+static bool write_all(const int fd, const void* data, size_t size) {
+    const u8* bytes = static_cast<const u8*>(data);
+    while (size > 0) {
+        const ssize_t written = ::write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+recorder::~recorder() {
+    if (fd < 0) return;
+    // Header is only written by close, so the unfinished trace is never mistaken for a complete one
+    stopped.store(true, std::memory_order_release);
+    writer.join();
+    ::close(fd);
+}
+
+bool recorder::open(const char* path, const std::span<const u8> program) {
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    const header empty{};
+    const u8 padding[alignof(record)]{};
+    const size_t padding_size = records_offset(program.size()) - sizeof(header) - program.size();
+    const bool written = write_all(fd, &empty, sizeof(empty))
+            && write_all(fd, program.data(), program.size())
+            && write_all(fd, padding, padding_size);
+    if (!written) {
+        const int error_code = errno;
+        ::close(fd);
+        fd = -1;
+        errno = error_code;
+        return false;
+    }
+
+    program_size = program.size();
+    writer = std::thread(&recorder::drain, this);
+    return true;
+}
+
+void recorder::wait_for_space() {
+    cached_tail = queue.tail.load(std::memory_order_acquire);
+    while (head - cached_tail == TRACE_RING_SIZE) {
+        std::this_thread::yield();
+        cached_tail = queue.tail.load(std::memory_order_acquire);
+    }
+}
+
+void recorder::drain() {
+    u64 tail = 0;
+    while (true) {
+        // Simulator stops only after the last record is queued, so the head we see after it is final
+        const bool stopping = stopped.load(std::memory_order_acquire);
+        const u64 available = queue.head.load(std::memory_order_acquire);
+        if (available == tail && stopping) return;
+
+        // Small writes are only made at the end of the trace
+        if (available - tail < TRACE_WRITE_BATCH && !stopping) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        // Batches never wrap around the end of the ring
+        const u64 end = std::min(available, (tail / TRACE_WRITE_BATCH + 1) * TRACE_WRITE_BATCH);
+        const record* first = queue.records.get() + tail % TRACE_RING_SIZE;
+        if (write_error.load(std::memory_order_relaxed) == 0 && !write_all(fd, first, (end - tail) * sizeof(record))) {
+            // Records are still consumed, so the simulator doesn't wait forever
+            write_error.store(errno, std::memory_order_relaxed);
+        }
+        tail = end;
+        queue.tail.store(tail, std::memory_order_release);
+    }
+}
+
+bool recorder::close(const simulator::machine& m) {
+    if (fd < 0) return true;
+    stopped.store(true, std::memory_order_release);
+    writer.join();
+
+    header h{};
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = TRACE_VERSION;
+    h.record_size = sizeof(record);
+    h.program_size = program_size;
+    h.record_count = head;
+    h.executed = executed;
+    h.ip = m.ip;
+    h.operation_count = static_cast<u32>(decoder::Operation::COUNT);
+
+    int error_code = write_error.load(std::memory_order_relaxed);
+    if (error_code == 0 && ::pwrite(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h))) error_code = errno;
+    if (::close(fd) != 0 && error_code == 0) error_code = errno;
+    fd = -1;
+
+    if (error_code != 0) {
+        errno = error_code;
+        return false;
+    }
+    return true;
+}
+
+bool reader::open(const std::span<const u8> data) {
+    image = data;
+    if (data.size() < sizeof(header)) return false;
+
+    const header& h = get_header();
+    const bool valid = std::memcmp(h.magic, magic, sizeof(magic)) == 0
+            && h.version == TRACE_VERSION
+            && h.record_size == sizeof(record)
+            && h.operation_count == static_cast<u32>(decoder::Operation::COUNT)
+            && h.program_size <= data.size()
+            && h.record_count <= data.size() / sizeof(record)
+            && records_offset(h.program_size) + h.record_count * sizeof(record) == data.size();
+    if (!valid) image = {};
+    return valid;
+}
+
+const header& reader::get_header() const {
+    return *reinterpret_cast<const header*>(image.data());
+}
+
+std::span<const u8> reader::program() const {
+    return image.subspan(sizeof(header), get_header().program_size);
+}
+
+std::span<const record> reader::records() const {
+    const header& h = get_header();
+    return { reinterpret_cast<const record*>(image.data() + records_offset(h.program_size)), h.record_count };
+}
+
+void trace::apply(simulator::machine& m, const record& r) {
+    const u32 reg = (r.changes & REGISTER_MASK) >> REGISTER_SHIFT;
+    if (reg > 8) m.segments[reg - 9] = r.value;
+    else if (reg > 0) m.regs.set_word(static_cast<u8>(reg - 1), r.value);
+
+    const u32 address = r.changes & ADDRESS_MASK;
+    if (r.changes & MEMORY_WORD) m.write_word(address, r.memory);
+    else if (r.changes & MEMORY_BYTE) m.write_byte(address, static_cast<u8>(r.memory));
+
+    m.flags = simulator::lazy_flags{};
+    m.flags.value = unpack_flags(r.flags);
+    if (!(r.flags & CONTINUATION)) m.executed += 1;
+}
+
+u64 trace::replay(simulator::machine& m, const reader& trace, const u64 steps) {
+    m.load(trace.program());
+    const std::span<const record> records = trace.records();
+    size_t i = 0;
+    for (; i < records.size(); i++) {
+        if (!(records[i].flags & CONTINUATION) && m.executed == steps) break;
+        apply(m, records[i]);
+    }
+    m.ip = i < records.size() ? records[i].ip : static_cast<u16>(trace.get_header().ip);
+    return m.executed;
+}
+
+// Letters of the flags in the same order as the final state prints them
+static void print_flags(printer::writer& out, const u16 flags) {
+    const static char flag_names[] = { 'C', 'P', 'A', 'Z', 'S', 'O' };
+    const static u16 flag_bits[] = { simulator::CF, simulator::PF, simulator::AF, simulator::ZF, simulator::SF, simulator::OF };
+    for (size_t i = 0; i < sizeof(flag_bits) / sizeof(flag_bits[0]); i++) {
+        if (flags & flag_bits[i]) out.put(flag_names[i]);
+    }
+}
+
+// <register>:0x<old>->0x<new> [0x<address>]:0x<old>->0x<new>, before the record is applied
+static void print_changes(printer::writer& out, const simulator::machine& m, const record& r) {
+    const format::syntax& s = format::get(format::Syntax::NASM);
+    const u32 reg = (r.changes & REGISTER_MASK) >> REGISTER_SHIFT;
+    if (reg > 0) {
+        const format::fragment name = reg > 8 ? s.segments[reg - 9] : s.word_registers[reg - 1];
+        const u16 old = reg > 8 ? m.segments[reg - 9] : m.regs.word(static_cast<u8>(reg - 1));
+        out.put(' ');
+        out.write(name.data, name.size);
+        out.write(":0x", 3);
+        out.hex(old, 4);
+        out.write("->0x", 4);
+        out.hex(r.value, 4);
+    }
+
+    if (r.changes & (MEMORY_WORD | MEMORY_BYTE)) {
+        const u32 address = r.changes & ADDRESS_MASK;
+        const bool word = r.changes & MEMORY_WORD;
+        out.write(" [0x", 4);
+        out.hex(address, 5);
+        out.write("]:0x", 4);
+        out.hex(word ? m.read_word(address) : m.read_byte(address), word ? 4 : 2);
+        out.write("->0x", 4);
+        out.hex(r.memory, word ? 4 : 2);
+    }
+}
+
+u64 trace::print_trace(printer::writer& out, simulator::machine& m, const reader& trace, const u64 steps) {
+    m.load(trace.program());
+    const std::span<const record> records = trace.records();
+    size_t i = 0;
+    while (i < records.size() && m.executed < steps) {
+        const record& first = records[i];
+        const u32 address = m.physical(Segment::CS, first.ip);
+        decoder::Instruction instr{};
+        const decoder::DecodingError error = decoder::decode({ m.memory.get() + address, MEMORY_SIZE - address }, &instr);
+
+        out.line();
+        out.write("0x", 2);
+        out.hex(first.ip, 4);
+        out.write(": ", 2);
+        if (error == decoder::DecodingError::NONE) printer::print_operation(out, instr, -1);
+        else out.str(decoder::operation_name[first.operation]);
+
+        out.line();
+        out.write(" ;", 2);
+        const u16 flags = m.flags.get();
+        do {
+            print_changes(out, m, records[i]);
+            apply(m, records[i]);
+            i++;
+        } while (i < records.size() && (records[i].flags & CONTINUATION));
+
+        if (m.flags.get() != flags) {
+            out.write(" flags:", 7);
+            print_flags(out, flags);
+            out.write("->", 2);
+            print_flags(out, m.flags.get());
+        }
+        out.put('\n');
+    }
+    m.ip = i < records.size() ? records[i].ip : static_cast<u16>(trace.get_header().ip);
+    return m.executed;
+}
@@ -0,0 +1,242 @@
+#ifndef VM8086_TRACE_H
+#define VM8086_TRACE_H
+
+// Has to be incremented on every change of the file layout or of the records
+#define TRACE_VERSION 1
+// Records between the simulator and the thread which writes them, has to be a power of two
+#define TRACE_RING_SIZE (1 << 16)
+// Records the writer thread takes at once
+#define TRACE_WRITE_BATCH (1 << 12)
+
+#include <utils/types.h>
+#include <atomic>
+#include <memory>
+#include <span>
+#include <thread>
+#include "decoder.h"
+#include "printer.h"
+#include "simulator.h"
+
+namespace trace {
+
+    // Bits of record::changes
+    enum Change : u32 {
+        // Physical address of the memory write
+        ADDRESS_MASK = MEMORY_MASK,
+        // Index of the written register + 1, 0 if no register was written. Segment registers follow
+        // the general purpose registers, the same as in simulator::written_state
+        REGISTER_SHIFT = 20,
+        REGISTER_MASK = 0xF << REGISTER_SHIFT,
+        MEMORY_BYTE = 1 << 24,
+        MEMORY_WORD = 1 << 25,
+    };
+
+    // Bits of record::flags, the arithmetic flags keep their positions from the low byte of FLAGS
+    enum RecordFlag : u8 {
+        // OF doesn't fit into the low byte, it takes the place of a reserved bit
+        PACKED_OF = 1 << 1,
+        // Record holds one more changed register of the previous instruction
+        CONTINUATION = 1 << 3,
+    };
+
+    /**
+     * One executed instruction. Only the state which was written by the instruction is recorded:
+     * at most one register and one memory write, instructions which write more registers are
+     * followed by continuation records. The new IP is the IP of the next record.
+     */
+    struct record {
+        u32 changes;
+        // IP of the instruction
+        u16 ip;
+        // New value of the changed register
+        u16 value;
+        // Value written to memory, only the low byte for byte writes
+        u16 memory;
+        u8 operation;
+        // Arithmetic flags after the instruction
+        u8 flags;
+    };
+
+    inline u8 pack_flags(const u16 flags) {
+        return static_cast<u8>((flags & 0xD5) | ((flags >> 10) & PACKED_OF));
+    }
+
+    inline u16 unpack_flags(const u8 flags) {
+        return static_cast<u16>((flags & 0xD5) | ((flags & PACKED_OF) << 10));
+    }
+
+    /**
+     * Layout of a trace file, every number is in the byte order of the machine:
+     *   header
+     *   u8[program_size] - the program loaded at 0000:0000, padded to 4 bytes
+     *   record[record_count]
+     */
+    struct header {
+        char magic[8];
+        u32 version;
+        u32 record_size;
+        u64 program_size;
+        u64 record_count;
+        // Executed instructions, continuation records are not counted
+        u64 executed;
+        // IP after the last instruction
+        u32 ip;
+        u32 operation_count;
+    };
+
+    /**
+     * Single producer, single consumer queue of records. Positions only grow, the slot of a position
+     * is position % TRACE_RING_SIZE. Head and tail are on their own cache lines, so the simulator
+     * and the writer don't invalidate each other's line on every record.
+     */
+    struct ring {
+        std::unique_ptr<record[]> records = std::make_unique<record[]>(TRACE_RING_SIZE);
+        // Next position written by the simulator
+        alignas(64) std::atomic<u64> head{0};
+        // Next position read by the writer
+        alignas(64) std::atomic<u64> tail{0};
+    };
+
+    /**
+     * Records the execution into a trace file. The simulator calls before() and after() around
+     * every instruction, records are queued in the ring and written by a background thread.
+     * The simulator only waits for the writer when the ring is full.
+     */
+    struct recorder {
+        recorder() = default;
+
+        recorder(const recorder&) = delete;
+
+        recorder& operator=(const recorder&) = delete;
+
+        ~recorder();
+
+        /**
+         * Creates the trace file and starts the writer, returns false and sets errno on failure.
+         * The machine has to be in its initial state with the program loaded.
+         */
+        bool open(const char* path, std::span<const u8> program);
+
+        /**
+         * Remembers what may be written by the instruction, IP must point to the instruction.
+         * `written` is simulator::written_state of the instruction, computed once when it's decoded.
+         */
+        void before(const simulator::machine& m, const decoder::Instruction& instr, const u16 written) {
+            pending_ip = m.ip;
+            pending_registers = written & ~simulator::WRITES_MEMORY;
+            pending_address = NO_ADDRESS;
+            if (written & simulator::WRITES_MEMORY) pending_address = simulator::effective_address(m, instr, instr.dest);
+        }
+
+        /**
+         * Records the state written by the instruction. Registers are read only if the instruction
+         * can write them: comparing the whole register file after every instruction stalls on the
+         * register which was just written.
+         */
+        void after(const simulator::machine& m, const decoder::Instruction& instr) {
+            record r {
+                    .changes = 0,
+                    .ip = pending_ip,
+                    .value = 0,
+                    .memory = 0,
+                    .operation = static_cast<u8>(instr.operation),
+                    .flags = pack_flags(m.flags.get()),
+            };
+            if (pending_address != NO_ADDRESS) {
+                r.changes = pending_address | (instr.word ? MEMORY_WORD : MEMORY_BYTE);
+                r.memory = instr.word ? m.read_word(pending_address) : m.read_byte(pending_address);
+            }
+            executed += 1;
+
+            u32 registers = pending_registers;
+            if (registers == 0) {
+                push(r);
+                return;
+            }
+            while (true) {
+                const u32 reg = __builtin_ctz(registers);
+                r.changes |= (reg + 1) << REGISTER_SHIFT;
+                r.value = reg < 8 ? m.regs.word(static_cast<u8>(reg)) : m.segments[reg - 8];
+                push(r);
+                registers &= registers - 1;
+                if (registers == 0) return;
+
+                // Rest of the registers go into continuation records
+                r.changes = 0;
+                r.memory = 0;
+                r.flags |= CONTINUATION;
+            }
+        }
+
+        // Writes the remaining records and the final state, returns false and sets errno on failure
+        bool close(const simulator::machine& m);
+
+    private:
+        constexpr static u32 NO_ADDRESS = ~0u;
+
+        int fd = -1;
+        u64 program_size = 0;
+        ring queue{};
+        std::thread writer{};
+        std::atomic<bool> stopped{false};
+        // errno of the first failed write
+        std::atomic<int> write_error{0};
+
+        // Local copies of the positions, tail is only reloaded when the ring looks full
+        u64 head = 0;
+        u64 cached_tail = 0;
+        u64 executed = 0;
+
+        u16 pending_ip = 0;
+        u16 pending_registers = 0;
+        u32 pending_address = NO_ADDRESS;
+
+        void push(const record& r) {
+            if (head - cached_tail == TRACE_RING_SIZE) wait_for_space();
+            queue.records[head % TRACE_RING_SIZE] = r;
+            head += 1;
+            queue.head.store(head, std::memory_order_release);
+        }
+
+        void wait_for_space();
+
+        // Body of the writer thread
+        void drain();
+    };
+
+    /**
+     * Trace file mapped for the replay. Records and the program point into the data, so they are
+     * valid while the data is.
+     */
+    struct reader {
+        // Checks the header, returns false if it's not a trace or it was written by another version
+        bool open(std::span<const u8> data);
+
+        const header& get_header() const;
+
+        std::span<const u8> program() const;
+
+        std::span<const record> records() const;
+
+    private:
+        std::span<const u8> image{};
+    };
+
+    // Applies the changes of the record to the machine, IP is set to the IP of the instruction
+    void apply(simulator::machine& m, const record& r);
+
+    /**
+     * Loads the program and applies the records of the first `steps` instructions to the machine.
+     * The machine is left right after the last of them. Returns the number of replayed instructions.
+     */
+    u64 replay(simulator::machine& m, const reader& trace, u64 steps);
+
+    /**
+     * Replays the first `steps` instructions and prints them as they were executed:
+     * <ip>: <instruction> ; <register>:<old>-><new> [<address>]:<old>-><new> flags:<old>-><new>
+     */
+    u64 print_trace(printer::writer& out, simulator::machine& m, const reader& trace, u64 steps);
+
+}
+
+#endif //VM8086_TRACE_H
@@ -0,0 +1,570 @@
+#include "translate.h"
+#include <algorithm>
+#include "blocks.h"
+#include "flow.h"
+using decoder::Instruction;
+using decoder::Operand;
+using decoder::OperandKind;
+using decoder::Operation;
+
+const static char* segment_names[] = { "ES", "CS", "SS", "DS" };
+
+// Base registers of every register pattern, the second one is 0xFF if there's only one, same as in simulator.cpp
+const static u8 pattern_registers[8][2] = {
+        { 3, 6 }, { 3, 7 }, { 5, 6 }, { 5, 7 }, { 6, 0xFF }, { 7, 0xFF }, { 5, 0xFF }, { 3, 0xFF }
+};
+
+// Conditions of the jumps from JE to JCXZ, F stands for the flags
+const static char* conditions[] = {
+        "F.zf()",
+        "F.sf() != F.of()",
+        "F.zf() || F.sf() != F.of()",
+        "F.cf()",
+        "F.cf() || F.zf()",
+        "F.pf()",
+        "F.of()",
+        "F.sf()",
+        "!F.zf()",
+        "F.sf() == F.of()",
+        "!F.zf() && F.sf() == F.of()",
+        "!F.cf()",
+        "!F.cf() && !F.zf()",
+        "!F.pf()",
+        "!F.of()",
+        "!F.sf()",
+        "--regs.words[1] != 0",
+        "--regs.words[1] != 0 && F.zf()",
+        "--regs.words[1] != 0 && !F.zf()",
+        "regs.words[1] == 0",
+};
+
+static_assert(sizeof(conditions) / sizeof(conditions[0])
+        == static_cast<size_t>(Operation::JCXZ) - static_cast<size_t>(Operation::JE) + 1);
+
+static bool is_memory(const Operand& operand) {
+    return operand.kind == OperandKind::MEMORY || operand.kind == OperandKind::DIRECT_ADDRESS;
+}
+
+static bool sets_flags(const Operation operation) {
+    return operation == Operation::ADD || operation == Operation::SUB || operation == Operation::CMP;
+}
+
+// Instructions with a handler in the simulator, everything else is left to the interpreter
+static bool is_translated(const Instruction& instr) {
+    return instr.operation == Operation::MOV || sets_flags(instr.operation) || decoder::is_conditional(instr.operation);
+}
+
+// Instruction hands the machine over to the interpreter if it writes into the program
+static bool may_exit(const Instruction& instr) {
+    return is_memory(instr.dest) && instr.operation != Operation::CMP;
+}
+
+static bool writes_cs(const Instruction& instr) {
+    return instr.operation == Operation::MOV
+            && instr.dest.kind == OperandKind::SEGMENT_REGISTER
+            && instr.dest.reg == static_cast<u8>(simulator::Segment::CS);
+}
+
+static void emit_number(printer::writer& out, const u32 value, const int digits) {
+    out.str("0x");
+    out.hex(value, digits);
+}
+
+// Name of a local of the k-th instruction of the block: a3, l3...
+static void emit_local(printer::writer& out, const char name, const u32 k) {
+    out.put(name);
+    out.unsigned_integer(k);
+}
+
+static void emit_address(printer::writer& out, const Instruction& instr, const Operand& operand) {
+    // Segment override prefix stores the segment register + 1
+    const u8 segment = instr.prefix & decoder::SEGMENT_MASK;
+    out.str("m.physical(Segment::");
+    if (operand.kind == OperandKind::DIRECT_ADDRESS) {
+        out.str(segment ? segment_names[segment - 1] : "DS");
+        out.str(", ");
+        emit_number(out, static_cast<u16>(instr.displacement), 4);
+        out.put(')');
+        return;
+    }
+
+    // Patterns based on BP are addressed relative to the stack segment
+    const u8* base = pattern_registers[operand.reg];
+    const bool stack = base[0] == static_cast<u8>(simulator::Register::BP);
+    out.str(segment ? segment_names[segment - 1] : stack ? "SS" : "DS");
+    out.str(", static_cast<u16>(regs.words[");
+    out.put(static_cast<char>('0' + base[0]));
+    out.put(']');
+    if (base[1] != 0xFF) {
+        out.str(" + regs.words[");
+        out.put(static_cast<char>('0' + base[1]));
+        out.put(']');
+    }
+    if (instr.displacement != 0) {
+        out.str(" + ");
+        emit_number(out, static_cast<u16>(instr.displacement), 4);
+    }
+    out.str("))");
+}
+
+// Same as read_operand of the simulator, the address of a memory operand is in the local a<k>
+static void emit_read(printer::writer& out, const Instruction& instr, const Operand& operand, const u32 k) {
+    switch (operand.kind) {
+        case OperandKind::REGISTER:
+        case OperandKind::BYTE_REGISTER:
+        case OperandKind::WORD_REGISTER: {
+            const bool word = operand.kind == OperandKind::WORD_REGISTER
+                    || (operand.kind == OperandKind::REGISTER && instr.word);
+            out.str(word ? "regs.words[" : "regs.byte(");
+            out.put(static_cast<char>('0' + operand.reg));
+            out.put(word ? ']' : ')');
+            return;
+        }
+        case OperandKind::SEGMENT_REGISTER:
+            out.str("m.segments[");
+            out.put(static_cast<char>('0' + operand.reg));
+            out.put(']');
+            return;
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS:
+            out.str(instr.word ? "m.read_word(" : "m.read_byte(");
+            emit_local(out, 'a', k);
+            out.put(')');
+            return;
+        case OperandKind::IMMEDIATE:
+            if (instr.word) emit_number(out, static_cast<u16>(instr.immediate), 4);
+            else emit_number(out, static_cast<u8>(instr.immediate), 2);
+            return;
+        case OperandKind::NONE:
+        case OperandKind::RELATIVE:
+        case OperandKind::FAR:
+            break;
+    }
+    out.put('0');
+}
+
+// Same as write_operand of the simulator, `value` writes the expression of the value
+template <typename F>
+static void emit_write(printer::writer& out, const Instruction& instr, const Operand& operand, const u32 k, F value) {
+    switch (operand.kind) {
+        case OperandKind::REGISTER:
+        case OperandKind::BYTE_REGISTER:
+        case OperandKind::WORD_REGISTER: {
+            const bool word = operand.kind == OperandKind::WORD_REGISTER
+                    || (operand.kind == OperandKind::REGISTER && instr.word);
+            out.str(word ? "regs.words[" : "regs.set_byte(");
+            out.put(static_cast<char>('0' + operand.reg));
+            out.str(word ? "] = static_cast<u16>(" : ", static_cast<u8>(");
+            value();
+            out.str(word ? ");\n" : "));\n");
+            return;
+        }
+        case OperandKind::SEGMENT_REGISTER:
+            out.str("m.segments[");
+            out.put(static_cast<char>('0' + operand.reg));
+            out.str("] = static_cast<u16>(");
+            value();
+            out.str(");\n");
+            return;
+        case OperandKind::MEMORY:
+        case OperandKind::DIRECT_ADDRESS:
+            out.str(instr.word ? "m.write_word(" : "m.write_byte(");
+            emit_local(out, 'a', k);
+            out.str(instr.word ? ", static_cast<u16>(" : ", static_cast<u8>(");
+            value();
+            out.str("));\n");
+            return;
+        case OperandKind::NONE:
+        case OperandKind::IMMEDIATE:
+        case OperandKind::RELATIVE:
+        case OperandKind::FAR:
+            out.put('\n');
+            return;
+    }
+}
+
+// Continues with the block at `ip`: directly if it's translated, otherwise through the dispatch on IP
+static void emit_next(printer::writer& out, const char* indent, const u16 ip, const std::span<const u16> starts) {
+    out.line();
+    out.str(indent);
+    if (std::binary_search(starts.begin(), starts.end(), ip)) {
+        out.str("goto block_");
+        out.hex(ip, 4);
+        out.str(";\n");
+        return;
+    }
+    out.str("ip = ");
+    emit_number(out, ip, 4);
+    out.str(";\n");
+    out.str(indent);
+    out.str("continue;\n");
+}
+
+static void emit_condition(printer::writer& out, const Operation operation) {
+    for (const char* c = conditions[static_cast<u8>(operation) - static_cast<u8>(Operation::JE)]; *c; c++) {
+        if (*c == 'F') out.str("flags");
+        else out.put(*c);
+    }
+}
+
+static void emit_instruction(printer::writer& out,
+                             const char* indent,
+                             const Instruction& instr,
+                             const u32 k,
+                             const u16 next,
+                             const bool flags) {
+    const Operand& memory = is_memory(instr.dest) ? instr.dest : instr.source;
+    out.line();
+    if (is_memory(memory) && (instr.operation != Operation::CMP || flags)) {
+        out.str(indent);
+        out.str("const u32 ");
+        emit_local(out, 'a', k);
+        out.str(" = ");
+        emit_address(out, instr, memory);
+        out.str(";\n");
+    }
+
+    if (instr.operation == Operation::MOV) {
+        out.line();
+        out.str(indent);
+        emit_write(out, instr, instr.dest, k, [&]() { emit_read(out, instr, instr.source, k); });
+    } else if (instr.operation != Operation::CMP || flags) {
+        out.line();
+        out.str(indent);
+        out.str("const u16 ");
+        emit_local(out, 'l', k);
+        out.str(" = ");
+        emit_read(out, instr, instr.dest, k);
+        out.str(";\n");
+        out.line();
+        out.str(indent);
+        out.str("const u16 ");
+        emit_local(out, 'r', k);
+        out.str(" = ");
+        emit_read(out, instr, instr.source, k);
+        out.str(";\n");
+        out.line();
+        out.str(indent);
+        out.str("const u32 ");
+        emit_local(out, 'v', k);
+        out.str(" = static_cast<u32>(");
+        emit_local(out, 'l', k);
+        out.str(instr.operation == Operation::ADD ? ") + " : ") - ");
+        emit_local(out, 'r', k);
+        out.str(";\n");
+
+        if (flags) {
+            out.line();
+            out.str(indent);
+            out.str(instr.operation == Operation::ADD ? "flags.set(FlagOp::ADD, " : "flags.set(FlagOp::SUB, ");
+            out.str(instr.word ? "true, " : "false, ");
+            emit_local(out, 'l', k);
+            out.str(", ");
+            emit_local(out, 'r', k);
+            out.str(", ");
+            emit_local(out, 'v', k);
+            out.str(");\n");
+        }
+        if (instr.operation != Operation::CMP) {
+            out.line();
+            out.str(indent);
+            emit_write(out, instr, instr.dest, k, [&]() { emit_local(out, 'v', k); });
+        }
+    }
+
+    // Blocks decoded from the program don't know about writes into it
+    if (may_exit(instr)) {
+        out.line();
+        out.str(indent);
+        out.str("if (m.code_modified) {\n");
+        out.str(indent);
+        out.str("    ip = ");
+        emit_number(out, next, 4);
+        out.str(";\n");
+        out.str(indent);
+        out.str("    executed += ");
+        out.unsigned_integer(k + 1);
+        out.str(";\n");
+        out.str(indent);
+        out.str("    status = Status::INTERPRET;\n");
+        out.str(indent);
+        out.str("    goto leave;\n");
+        out.str(indent);
+        out.str("}\n");
+    }
+}
+
+// Instructions of the block which are translated, see emit_block
+struct block_plan {
+    u32 count = 0;
+    // IP after the translated instructions if the block doesn't end with a jump
+    u16 stop = 0;
+    // Translated instructions are followed by one for the interpreter
+    bool interpret = false;
+    bool jump = false;
+    // Last instruction before the jump which sets the flags, -1 if there is none
+    i64 flags = -1;
+};
+
+static block_plan plan_block(const flow::graph& g, const flow::basic_block& b, const u16 end) {
+    block_plan p{};
+    p.stop = static_cast<u16>(b.end);
+    for (u32 i = b.first; i < b.last; i++) {
+        const Instruction& instr = g.instructions[i];
+        const u32 pos = g.positions[i];
+        // Interpreter doesn't decode blocks past the end either, IP stops at the instruction
+        if (pos >= end) {
+            p.stop = static_cast<u16>(pos);
+            break;
+        }
+        // Blocks are translated for the original CS, so a write into CS is left to the interpreter
+        if (!is_translated(instr) || writes_cs(instr)) {
+            p.stop = static_cast<u16>(pos);
+            p.interpret = true;
+            break;
+        }
+        p.count++;
+        if (sets_flags(instr.operation)) p.flags = p.count - 1;
+    }
+
+    p.jump = p.count == b.last - b.first && decoder::is_conditional(g.instructions[b.last - 1].operation);
+    return p;
+}
+
+// Flags of the k-th instruction are read by the jump, by the blocks which follow or by the interpreter
+static bool flags_live(const flow::graph& g, const flow::basic_block& b, const block_plan& p, const u32 k) {
+    if (static_cast<i64>(k) == p.flags || may_exit(g.instructions[b.first + k])) return true;
+    for (u32 i = k + 1; i < p.count; i++) {
+        const Instruction& instr = g.instructions[b.first + i];
+        if (sets_flags(instr.operation)) return false;
+        if (may_exit(instr)) return true;
+    }
+    return true;
+}
+
+/**
+ * Block is a labelled part of `translated`, so jumps between the blocks are plain gotos. IP is
+ * only written when the machine leaves the translated code, or when the next block is looked up
+ * by the dispatch.
+ */
+static void emit_block(printer::writer& out,
+                       const flow::graph& g,
+                       const flow::basic_block& b,
+                       const block_plan& p,
+                       const size_t index,
+                       const std::span<const u16> starts,
+                       translate::summary* s) {
+    const char* indent = "            ";
+    out.line();
+    out.str("        // ");
+    emit_number(out, b.begin, 4);
+    out.str(" - ");
+    emit_number(out, b.end, 4);
+    out.str("\n        block_");
+    out.hex(b.begin, 4);
+    out.str(": {\n");
+    out.str("            if (executed + ");
+    out.unsigned_integer(p.count);
+    out.str(" > limit || stale[");
+    out.unsigned_integer(index);
+    out.str("]) {\n                ip = ");
+    emit_number(out, b.begin, 4);
+    out.str(";\n                status = Status::INTERPRET;\n                goto leave;\n            }\n");
+
+    const u32 body = p.jump ? p.count - 1 : p.count;
+    for (u32 k = 0; k < body; k++) {
+        const Instruction& instr = g.instructions[b.first + k];
+        const u16 next = static_cast<u16>(g.positions[b.first + k] + instr.length);
+        const bool live = sets_flags(instr.operation) && flags_live(g, b, p, k);
+        if (sets_flags(instr.operation) && !live) s->dead_flags++;
+        emit_instruction(out, indent, instr, k, next, live);
+    }
+    s->instructions += p.count;
+
+    out.line();
+    out.str(indent);
+    out.str("executed += ");
+    out.unsigned_integer(p.count);
+    out.str(";\n");
+    if (p.interpret) {
+        out.line();
+        out.str(indent);
+        out.str("ip = ");
+        emit_number(out, p.stop, 4);
+        out.str(";\n");
+        out.str(indent);
+        out.str("status = Status::INTERPRET;\n");
+        out.str(indent);
+        out.str("goto leave;\n");
+    } else if (!p.jump) {
+        emit_next(out, indent, p.stop, starts);
+    } else {
+        const Instruction& jump = g.instructions[b.first + p.count - 1];
+        const u32 pos = g.positions[b.first + p.count - 1];
+        out.line();
+        out.str(indent);
+        out.str("if (");
+        emit_condition(out, jump.operation);
+        out.str(") {\n");
+        emit_next(out, "                ", static_cast<u16>(decoder::jump_target(jump, pos)), starts);
+        out.str(indent);
+        out.str("}\n");
+        emit_next(out, indent, static_cast<u16>(pos + jump.length), starts);
+    }
+    out.str("        }\n");
+    s->blocks++;
+}
+
+void translate::emit(printer::writer& out, const std::span<const u8> program, summary* s) {
+    const u16 end = static_cast<u16>(std::min<size_t>(program.size(), 0xFFFF));
+    const flow::graph g = flow::build(program, 0);
+
+    out.line();
+    out.str("// Generated by vm8086 --translate, do not edit\n\n");
+    out.str("#include \"translate.h\"\n\n");
+    out.str("using simulator::FlagOp;\n");
+    out.str("using simulator::lazy_flags;\n");
+    out.str("using simulator::machine;\n");
+    out.str("using simulator::register_file;\n");
+    out.str("using simulator::Segment;\n\n");
+    out.str("const u8 translate::program[] = {\n");
+    for (size_t i = 0; i < std::max<size_t>(program.size(), 1); i += TRANSLATE_BYTES_LINE) {
+        out.line();
+        out.str("       ");
+        for (size_t j = i; j < std::min(i + TRANSLATE_BYTES_LINE, std::max<size_t>(program.size(), 1)); j++) {
+            out.put(' ');
+            emit_number(out, j < program.size() ? program[j] : 0, 2);
+            out.put(',');
+        }
+        out.put('\n');
+    }
+    out.line();
+    out.str("};\n\nconst size_t translate::program_size = ");
+    out.unsigned_integer(program.size());
+    out.str(";\n\n");
+
+    // Translated blocks in the order of their positions
+    std::vector<block_plan> plans(g.blocks.size());
+    std::vector<size_t> order{};
+    for (size_t i = 0; i < g.blocks.size(); i++) {
+        const flow::basic_block& b = g.blocks[i];
+        if (b.begin >= end) continue;
+        plans[i] = plan_block(g, b, end);
+        if (plans[i].count != 0) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&g](const size_t a, const size_t b) {
+        return g.blocks[a].begin < g.blocks[b].begin;
+    });
+    std::vector<u16> starts{};
+    for (const size_t i : order) starts.push_back(static_cast<u16>(g.blocks[i].begin));
+
+    out.line();
+    out.str("const translate::block_range translate::blocks[] = {\n");
+    for (const size_t i : order) {
+        const flow::basic_block& b = g.blocks[i];
+        const u32 last = b.first + plans[i].count - 1;
+        out.line();
+        out.str("        { ");
+        emit_number(out, b.begin, 4);
+        out.str(", ");
+        emit_number(out, g.positions[last] + g.instructions[last].length, 4);
+        out.str(" },\n");
+    }
+    // Array can't be empty
+    if (order.empty()) out.str("        { 0x0000, 0x0000 },\n");
+    out.line();
+    out.str("};\n\nconst size_t translate::block_count = ");
+    out.unsigned_integer(order.size());
+    out.str(";\n\n");
+
+    out.line();
+    out.str("translate::Status translate::translated(machine& m, const u16 end, const u64 limit, const u8* stale) {\n");
+    out.str("    register_file regs = m.regs;\n");
+    out.str("    lazy_flags flags = m.flags;\n");
+    out.str("    u64 executed = m.executed;\n");
+    out.str("    u16 ip = m.ip;\n");
+    out.str("    Status status = Status::DONE;\n");
+    out.str("    while (ip < end) {\n");
+    out.str("        switch (ip) {\n");
+    for (const u16 start : starts) {
+        out.line();
+        out.str("            case ");
+        emit_number(out, start, 4);
+        out.str(": goto block_");
+        out.hex(start, 4);
+        out.str(";\n");
+    }
+    out.line();
+    out.str("            default:\n");
+    out.str("                status = Status::INTERPRET;\n");
+    out.str("                goto leave;\n");
+    out.str("        }\n\n");
+    for (size_t k = 0; k < order.size(); k++) emit_block(out, g, g.blocks[order[k]], plans[order[k]], k, starts, s);
+    out.line();
+    out.str("    }\n\n");
+    out.str("leave:\n");
+    out.str("    m.regs = regs;\n");
+    out.str("    m.flags = flags;\n");
+    out.str("    m.executed = executed;\n");
+    out.str("    m.ip = ip;\n");
+    out.str("    return status;\n");
+    out.str("}\n");
+}
+
+// Blocks which cover bytes of the program changed by the writes into the code pages since the last check become stale
+static void mark_stale(simulator::machine& m,
+                       const std::span<const u8> program,
+                       const std::span<const translate::block_range> ranges,
+                       const u32 start,
+                       std::vector<u8>& stale) {
+    for (const u32 page : m.modified_pages) {
+        for (u32 address = page * CODE_PAGE_SIZE; address < (page + 1) * CODE_PAGE_SIZE; address++) {
+            const u32 offset = (address - start) & MEMORY_MASK;
+            if (offset >= program.size() || m.memory[address] == program[offset]) continue;
+            const auto after = std::upper_bound(ranges.begin(), ranges.end(), offset,
+                                                [](const u32 o, const translate::block_range& r) { return o < r.begin; });
+            if (after != ranges.begin() && offset < (after - 1)->end) stale[after - 1 - ranges.begin()] = 1;
+        }
+    }
+    m.modified_pages.clear();
+    m.code_modified = false;
+}
+
+simulator::ExecutionError translate::run(simulator::machine& m,
+                                         const entry_point translated,
+                                         const std::span<const u8> program,
+                                         const std::span<const block_range> ranges,
+                                         const u16 end,
+                                         const u64 limit,
+                                         decoder::DecodingError* decoding_error) {
+    using simulator::ExecutionError;
+    using simulator::Segment;
+    const u16 cs = m.segments[static_cast<u8>(Segment::CS)];
+    const u32 start = m.physical(Segment::CS, 0);
+    const auto mark = [&m](const u32 address) {
+        const u32 page = (address & MEMORY_MASK) / CODE_PAGE_SIZE;
+        m.code_pages[page / 64] |= u64{1} << (page % 64);
+    };
+    for (u32 offset = 0; offset < end; offset += CODE_PAGE_SIZE) mark(start + offset);
+    if (end > 0) mark(start + end - 1);
+
+    // Interpreter executes one instruction at a time until IP is at the beginning of a translated block
+    std::vector<u8> stale(ranges.size());
+    while (translated(m, end, limit, stale.data()) == Status::INTERPRET) {
+        if (m.ip >= end || m.executed >= limit) break;
+        if (m.code_modified) mark_stale(m, program, ranges, start, stale);
+
+        const u32 code = m.physical(Segment::CS, m.ip);
+        decoder::Instruction instr{};
+        if (decoder::decode({ m.memory.get() + code, MEMORY_SIZE - code }, &instr) != decoder::DecodingError::NONE) break;
+        m.ip += instr.length;
+        const ExecutionError error = simulator::execute(m, instr);
+        if (error != ExecutionError::NONE) return error;
+        // Blocks were translated for the original CS, the code at the new one is decoded by blocks::run
+        if (m.segments[static_cast<u8>(Segment::CS)] != cs) break;
+        if (m.code_modified) mark_stale(m, program, ranges, start, stale);
+    }
+
+    blocks::cache c{};
+    return blocks::run(m, c, end, limit, decoding_error);
+}
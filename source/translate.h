@@ -0,0 +1,87 @@
+#ifndef VM8086_TRANSLATE_H
+#define VM8086_TRANSLATE_H
+
+// Bytes of the program on one line of the generated array
+#define TRANSLATE_BYTES_LINE 16
+
+#include <utils/types.h>
+#include <span>
+#include "decoder.h"
+#include "printer.h"
+#include "simulator.h"
+
+namespace translate {
+
+    enum class Status : u8 {
+        // IP left [0, end)
+        DONE,
+        // Execution has to continue in the interpreter from the current state of the machine
+        INTERPRET,
+    };
+
+    // Bytes of the program [begin, end) a translated block was compiled from
+    struct block_range {
+        u16 begin;
+        u16 end;
+    };
+
+    // Runs translated blocks while IP is in [0, end), the next block fits into `limit` and it isn't stale
+    using entry_point = Status (*)(simulator::machine& m, u16 end, u64 limit, const u8* stale);
+
+    // Defined by the generated source, only the runner is linked with it
+    extern const u8 program[];
+    extern const size_t program_size;
+    // Translated blocks in the order of their positions, `stale` of translated has a flag for every one of them
+    extern const block_range blocks[];
+    extern const size_t block_count;
+    Status translated(simulator::machine& m, u16 end, u64 limit, const u8* stale);
+
+    struct summary {
+        size_t blocks = 0;
+        // Instructions compiled into the blocks, the rest is left to the interpreter
+        size_t instructions = 0;
+        // ADD, SUB and CMP whose flags are overwritten before a jump reads them
+        size_t dead_flags = 0;
+    };
+
+    /**
+     * Writes C++ source which executes the program without decoding it: the program bytes, the
+     * ranges of the basic blocks reachable from the beginning of the program, and `translated`
+     * with a labelled part for every block. Jumps to the blocks whose position is known are gotos,
+     * IP is only dispatched on when the function is entered or the target isn't a block. Registers,
+     * flags and the count of executed instructions are locals of the function, written back to the
+     * machine when it returns, and memory operands go through the read and write functions of the
+     * machine.
+     *
+     * Flags are only computed where they may be read: by the last ADD, SUB or CMP of a block, for
+     * its jump and the blocks which follow, and by those followed by a memory write before the
+     * next one, in case the interpreter takes over after the write. Other ADD, SUB and CMP don't
+     * touch the flags, so such CMP is dropped. Flags which the following blocks overwrite before
+     * reading are left to the compiler.
+     *
+     * Execution is handed over to the interpreter before an instruction which isn't translated
+     * or which writes CS, after a write into the program, at a jump to a position which doesn't
+     * start a block, and before a block which would exceed the limit or is stale.
+     */
+    void emit(printer::writer& out, std::span<const u8> program, summary* s);
+
+    /**
+     * Runs the translated program until IP leaves [0, end), an error occurs or `limit`
+     * instructions are executed, with the same final state as blocks::run. Pages of the program
+     * are marked as code, so writes into it are noticed, and the blocks whose bytes differ from
+     * `program` become stale. Wherever the translated code stops, the interpreter executes
+     * instructions until IP reaches a block which isn't stale. Writes into CS are executed by
+     * the interpreter as well, and once CS changes the rest of the program is run by blocks::run,
+     * since the blocks were translated for the original CS.
+     */
+    simulator::ExecutionError run(simulator::machine& m,
+                                  entry_point translated,
+                                  std::span<const u8> program,
+                                  std::span<const block_range> ranges,
+                                  u16 end,
+                                  u64 limit,
+                                  decoder::DecodingError* decoding_error);
+
+}
+
+#endif //VM8086_TRANSLATE_H